@@ -78,25 +78,34 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    // SEND A MESSAGE
-    char *msg = "ftp";
+    // SEND A MESSAGE, the server answers with a cookie we have to send back before it says yes
+    char msg[MAXBUFLEN] = "ftp";
+    char recv_buf[MAXBUFLEN];
     int numbytes;
-    numbytes = sendto(sockfd, msg, strlen(msg), 0, curr->ai_addr, curr->ai_addrlen);
-    if (numbytes == -1) {
-        perror("sendto");
-        freeaddrinfo(servinfo);
-        close(sockfd);
-        exit(1);
-    }
+    for (int attempt = 0; attempt < 2; attempt++) {
+        numbytes = sendto(sockfd, msg, strlen(msg), 0, curr->ai_addr, curr->ai_addrlen);
+        if (numbytes == -1) {
+            perror("sendto");
+            freeaddrinfo(servinfo);
+            close(sockfd);
+            exit(1);
+        }
 
-    // RECEIVE SERVER REPLY
-    char recv_buf[MAXBUFLEN];
-    struct sockaddr_storage serv_addr;
-    socklen_t serv_addr_len = sizeof serv_addr;
-    numbytes = recvfrom(sockfd, recv_buf, MAXBUFLEN - 1, 0, (struct sockaddr *) &serv_addr, &serv_addr_len);
-    if (numbytes == -1) {
-        perror("recvfrom");
-        exit(1);
+        // RECEIVE SERVER REPLY
+        struct sockaddr_storage serv_addr;
+        socklen_t serv_addr_len = sizeof serv_addr;
+        numbytes = recvfrom(sockfd, recv_buf, MAXBUFLEN - 1, 0, (struct sockaddr *) &serv_addr, &serv_addr_len);
+        if (numbytes == -1) {
+            perror("recvfrom");
+            exit(1);
+        }
+        recv_buf[numbytes] = '\0';
+
+        unsigned long long cookie;
+        if (sscanf(recv_buf, "retry:%llx", &cookie) != 1) {
+            break;
+        }
+        snprintf(msg, sizeof msg, "ftp:%llx", cookie);
     }
 
     if (strcmp("yes", recv_buf) == 0) {
@@ -6,12 +6,61 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netinet/in.h>
 
 
 #define MAXBUFLEN 1500
+#define COOKIE_EPOCH_S 30 // a cookie is good for this epoch and the one after it
 
 // credits: some of this code is adapted from beej's handbook, mainly section 6.3
 
+unsigned long long cookie_secret[2]; // 128-bit siphash key
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+void sipRound(unsigned long long v[4]) {
+    v[0] += v[1]; v[1] = ROTL(v[1], 13); v[1] ^= v[0]; v[0] = ROTL(v[0], 32);
+    v[2] += v[3]; v[3] = ROTL(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = ROTL(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = ROTL(v[1], 17); v[1] ^= v[2]; v[2] = ROTL(v[2], 32);
+}
+
+unsigned long long sipHash(const unsigned long long *words, int n) {
+    // siphash-2-4 over n whole 64-bit words. unlike an unkeyed mix it's a PRF, seeing any number
+    // of cookies doesn't give away cookie_secret or let anyone make one for another address
+    unsigned long long v[4] = {
+        cookie_secret[0] ^ 0x736f6d6570736575ULL, cookie_secret[1] ^ 0x646f72616e646f6dULL,
+        cookie_secret[0] ^ 0x6c7967656e657261ULL, cookie_secret[1] ^ 0x7465646279746573ULL,
+    };
+    for (int i = 0; i <= n; i++) {
+        // the last block is just the length, as siphash pads a message that ends on a word
+        unsigned long long m = i < n ? words[i] : (unsigned long long) (n * 8) << 56;
+        v[3] ^= m;
+        sipRound(v);
+        sipRound(v);
+        v[0] ^= m;
+    }
+    v[2] ^= 0xff;
+    for (int i = 0; i < 4; i++) {
+        sipRound(v);
+    }
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+unsigned long long makeCookie(const struct sockaddr_in *addr, long epoch) {
+    // keyed hash of the client's address and port with the epoch, so we don't have to remember
+    // anything about a client until it proves it gets our replies at that address
+    unsigned long long words[2] = {((unsigned long long) addr->sin_addr.s_addr << 16) | addr->sin_port, (unsigned long long) epoch};
+    return sipHash(words, 2);
+}
+
+int cookieValid(unsigned long long cookie, const struct sockaddr_in *addr) {
+    long epoch = time(NULL) / COOKIE_EPOCH_S;
+    return cookie == makeCookie(addr, epoch) || cookie == makeCookie(addr, epoch - 1);
+}
+
 int main(int argc, char *argv[]) {
     if (argc != 2) {
         fprintf(stderr, "Usage: server <server port number>\n");
@@ -59,6 +108,13 @@ int main(int argc, char *argv[]) {
     // don't need it anymore
     freeaddrinfo(servinfo);
 
+    int rand_fd = open("/dev/urandom", O_RDONLY);
+    if (rand_fd == -1 || read(rand_fd, cookie_secret, sizeof cookie_secret) != sizeof cookie_secret) {
+        perror("/dev/urandom");
+        exit(1);
+    }
+    close(rand_fd);
+
     // START ACCEPTING DATA 
     printf(">>> begin listening...\n");
 
@@ -75,28 +131,34 @@ int main(int argc, char *argv[]) {
             exit(1);
         }
 
-        printf(">>> received message %d bytes long\n", numbytes);
         recv_buf[numbytes] = '\0'; // since we assume it is string
-        printf("%s\n", recv_buf);
 
-        // reply depending on if it's ftp or not
+        // reply depending on if it's ftp or not. a bare ftp only gets a cookie back, the client
+        // has to echo it as ftp:<cookie> before we say yes, so spoofed sources get nowhere. only
+        // that last step is logged, anyone can make us do the others as fast as they can send.
+        // a failed send is theirs to retry, it doesn't take the server down
+        unsigned long long cookie;
+        char cookie_buf[32];
         if (strcmp("ftp", recv_buf) == 0) {
+            snprintf(cookie_buf, sizeof cookie_buf, "retry:%llx", makeCookie((struct sockaddr_in *) &client_addr, time(NULL) / COOKIE_EPOCH_S));
+            if (sendto(sockfd, cookie_buf, strlen(cookie_buf), 0, (struct sockaddr *) &client_addr, client_addr_len) == -1) {
+                perror("sendto");
+                continue;
+            }
+        } else if (sscanf(recv_buf, "ftp:%llx", &cookie) == 1 && cookieValid(cookie, (struct sockaddr_in *) &client_addr)) {
             char *send_buf = "yes";
+            printf(">>> received message %d bytes long\n", numbytes);
+            printf("%s\n", recv_buf);
             printf(">>> replying with yes\n");
-            numbytes = sendto(sockfd, send_buf, strlen(send_buf), 0, (struct sockaddr *) &client_addr, client_addr_len);
-            if (numbytes == -1) {
+            if (sendto(sockfd, send_buf, strlen(send_buf), 0, (struct sockaddr *) &client_addr, client_addr_len) == -1) {
                 perror("sendto");
-                close(sockfd);
-                exit(1);
+                continue;
             }
         } else {
             char *send_buf = "no";
-            printf(">>> replying with no\n");
-            numbytes = sendto(sockfd, send_buf, strlen(send_buf), 0, (struct sockaddr *) &client_addr, client_addr_len);
-            if (numbytes == -1) {
+            if (sendto(sockfd, send_buf, strlen(send_buf), 0, (struct sockaddr *) &client_addr, client_addr_len) == -1) {
                 perror("sendto");
-                close(sockfd);
-                exit(1);
+                continue;
             }
         }
     }
@@ -0,0 +1,142 @@
+#include "transfer.h"
+
+// model-based congestion control, roughly BBR v1: estimate the bottleneck bandwidth (max
+// delivery rate over the last few round trips) and the min RTT, pace at gain * bandwidth and
+// keep about 2 BDPs in flight. loss only matters through its effect on the delivery rate, so
+// the random drops in server.c don't shrink the window like they do with reno.
+
+// probe_bw spends one min RTT at each gain: probe for more bandwidth, drain the queue that made, cruise
+double bbr_cycle_gains[8] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+void bbrInit(struct sender *s, struct timespec now) {
+    struct bbr *b = &s->bbr;
+    memset(b, 0, sizeof *b);
+    b->state = BBR_STARTUP;
+    b->pacing_gain = BBR_HIGH_GAIN;
+    b->cwnd_gain = BBR_HIGH_GAIN;
+    b->min_rtt = -1;
+    b->min_rtt_stamp = now;
+
+    // nothing measured yet, so pace the initial window over the initial RTT guess
+    s->pacing_rate = BBR_HIGH_GAIN * s->cwnd / s->estimatedRTT;
+}
+
+double bbrBDP(const struct sender *s) {
+    // bandwidth delay product, in fragments
+    const struct bbr *b = &s->bbr;
+    double min_rtt = b->min_rtt > 0 ? b->min_rtt : s->estimatedRTT;
+    return b->btl_bw * min_rtt;
+}
+
+void bbrEnterProbeBW(struct sender *s, struct timespec now) {
+    struct bbr *b = &s->bbr;
+    b->state = BBR_PROBE_BW;
+    b->cwnd_gain = 2;
+    b->cycle_index = rand() % 8; // start somewhere random so flows sharing a link don't probe in sync
+    if (b->cycle_index == 1) { // but not in the drain phase
+        b->cycle_index = 2;
+    }
+    b->pacing_gain = bbr_cycle_gains[b->cycle_index];
+    b->cycle_stamp = now;
+}
+
+void bbrUpdateModel(struct sender *s, const struct frag_state *fs, double rtt, double ack_delay, struct timespec now, int *round_start) {
+    struct bbr *b = &s->bbr;
+
+    // delivery rate: how much got acked between when this fragment went out and now. the time the
+    // receiver sat on the ack comes out, same as for the RTT, or a paced sender with a fragment or
+    // two in flight would only ever measure ACK_EVERY / ACK_DELAY_MS and never leave startup
+    double interval = get_time_diff(fs->delivered_time, now) - ack_delay;
+    double rate = interval > 0 ? (s->delivered - fs->delivered) / interval : 0;
+
+    // a round trip is over once something sent after the last round started gets acked
+    *round_start = 0;
+    if (fs->delivered >= b->next_round_delivered) {
+        b->next_round_delivered = s->delivered;
+        b->round_count += 1;
+        b->bw_samples[b->round_count % BBR_BW_ROUNDS] = 0;
+        *round_start = 1;
+    }
+    double *slot = &b->bw_samples[b->round_count % BBR_BW_ROUNDS];
+    *slot = MAX(*slot, rate);
+
+    b->btl_bw = 0;
+    for (int i = 0; i < BBR_BW_ROUNDS; i++) {
+        b->btl_bw = MAX(b->btl_bw, b->bw_samples[i]);
+    }
+
+    int min_rtt_expired = get_time_diff(b->min_rtt_stamp, now) > BBR_MIN_RTT_MS;
+    if (rtt > 0 && (b->min_rtt < 0 || rtt <= b->min_rtt || min_rtt_expired)) {
+        b->min_rtt = rtt;
+        b->min_rtt_stamp = now;
+    }
+}
+
+void bbrUpdateState(struct sender *s, int round_start, struct timespec now) {
+    struct bbr *b = &s->bbr;
+
+    switch (b->state) {
+        case BBR_STARTUP:
+            // the pipe is full once bandwidth stops growing
+            if (round_start && b->btl_bw > 0) {
+                if (b->btl_bw >= b->full_bw * 1.25) {
+                    b->full_bw = b->btl_bw;
+                    b->full_bw_count = 0;
+                } else if (++b->full_bw_count >= 3) {
+                    b->state = BBR_DRAIN;
+                    b->pacing_gain = 1 / BBR_HIGH_GAIN; // empty the queue startup built
+                }
+            }
+            break;
+        case BBR_DRAIN:
+            if (s->next_frag - s->base <= bbrBDP(s)) {
+                bbrEnterProbeBW(s, now);
+            }
+            break;
+        case BBR_PROBE_BW:
+            if (b->min_rtt > 0 && get_time_diff(b->cycle_stamp, now) > b->min_rtt) {
+                b->cycle_index = (b->cycle_index + 1) % 8;
+                b->pacing_gain = bbr_cycle_gains[b->cycle_index];
+                b->cycle_stamp = now;
+            }
+            break;
+        case BBR_PROBE_RTT:
+            if (get_time_diff(b->probe_rtt_done, now) >= 0) {
+                b->min_rtt_stamp = now;
+                bbrEnterProbeBW(s, now);
+            }
+            break;
+    }
+
+    // min RTT hasn't been seen in a while, back off to a tiny window so queues drain and we can measure it again
+    if (b->state != BBR_PROBE_RTT && b->state != BBR_STARTUP && get_time_diff(b->min_rtt_stamp, now) > BBR_MIN_RTT_MS) {
+        b->state = BBR_PROBE_RTT;
+        b->pacing_gain = 1;
+        b->probe_rtt_done = add_time_ms(now, BBR_PROBE_RTT_MS);
+    }
+}
+
+void bbrOnAck(struct sender *s, const struct frag_state *fs, unsigned int newly_acked, double rtt, double ack_delay, struct timespec now) {
+    struct bbr *b = &s->bbr;
+    int round_start;
+    bbrUpdateModel(s, fs, rtt, ack_delay, now, &round_start);
+    bbrUpdateState(s, round_start, now);
+
+    if (b->btl_bw > 0) {
+        s->pacing_rate = b->pacing_gain * b->btl_bw;
+    }
+
+    // plus room for what the receiver holds back before acking, or delayed acks would cap us below the BDP
+    double target = b->cwnd_gain * bbrBDP(s) + ACK_EVERY;
+    if (b->state == BBR_PROBE_RTT) {
+        s->cwnd = BBR_MIN_CWND;
+    } else if (b->state == BBR_STARTUP || s->cwnd < target) {
+        s->cwnd += newly_acked; // grow like slow start until the model catches up
+        if (b->state != BBR_STARTUP) {
+            s->cwnd = MIN(s->cwnd, target);
+        }
+    } else {
+        s->cwnd = target;
+    }
+    s->cwnd = MAX(s->cwnd, BBR_MIN_CWND);
+}
@@ -0,0 +1,402 @@
+#include "transfer.h"
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+// content-addressed chunk store for uploads. before sending, the client cuts its file into
+// content-defined chunks and asks the server which of them it already has; fragments made
+// entirely of chunks the server has go as "dup" runs, and the server copies them out of its
+// store instead. a dedup server keeps every upload as a recipe (the list of its chunks) and the
+// chunks themselves once each in CHUNK_DIR, so the same artifact uploaded again costs neither
+// the bandwidth nor the disk
+
+#define RECIPE_MAGIC "ftp-recipe 1"
+
+// gear hash table, 256 random words. generated rather than written out, but it has to come out
+// the same everywhere or client and server would cut chunks in different places
+uint64_t gear[256];
+pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+void gearInit() {
+    uint64_t x = 0x6a09e667f3bcc908ULL;
+    for (int i = 0; i < 256; i++) { // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t chunkLength(const unsigned char *data, size_t len, int at_eof) {
+    // length of the chunk starting at data. the cut goes where the top CHUNK_AVG_BITS bits of the
+    // rolling hash are all zero, and the hash only depends on the last 64 bytes, so the same
+    // content gets cut the same way wherever it sits in a file. unless at_eof, len must be at
+    // least CHUNK_MAX
+    pthread_once(&gear_once, gearInit);
+    size_t end = MIN(len, CHUNK_MAX);
+    if (end <= CHUNK_MIN) { // only at the end of the file
+        return end;
+    }
+    uint64_t hash = 0;
+    for (size_t i = CHUNK_MIN - 64; i < end; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if (i >= CHUNK_MIN && (hash >> (64 - CHUNK_AVG_BITS)) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+void chunkPath(const unsigned char *hash, char *path, size_t path_size) {
+    int len = snprintf(path, path_size, "%s/", CHUNK_DIR);
+    for (int i = 0; i < SHA256_LEN && len + 2 < (int) path_size; i++) {
+        len += snprintf(path + len, path_size - len, "%02x", hash[i]);
+    }
+}
+
+int storeHas(const unsigned char *hash) {
+    char path[sizeof CHUNK_DIR + SHA256_LEN * 2 + 1];
+    chunkPath(hash, path, sizeof path);
+    return access(path, F_OK) == 0;
+}
+
+void storePut(const struct chunk *c, const unsigned char *data) {
+    // written under a temporary name first so a crash can't leave a short chunk behind its hash
+    char path[sizeof CHUNK_DIR + SHA256_LEN * 2 + 1];
+    char tmp_path[sizeof path + 4];
+    chunkPath(c->hash, path, sizeof path);
+    if (access(path, F_OK) == 0) {
+        return;
+    }
+    snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    for (size_t done = 0; done < c->len; ) {
+        ssize_t written = write(fd, data + done, c->len - done);
+        if (written == -1) {
+            perror("write");
+            exit(1);
+        }
+        done += written;
+    }
+    close(fd);
+    if (rename(tmp_path, path) == -1) {
+        perror("rename");
+    }
+}
+
+struct manifest *manifestNew(off_t size, unsigned long long count) {
+    struct manifest *m = malloc(sizeof(struct manifest));
+    if (m != NULL) {
+        m->chunks = calloc(MAX(count, 1), sizeof(struct chunk));
+    }
+    if (m == NULL || m->chunks == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for chunk manifest\n");
+        exit(1);
+    }
+    m->size = size;
+    m->count = count;
+    pthread_mutex_init(&m->lock, NULL);
+    m->open_chunk = -1;
+    m->open_fd = -1;
+    return m;
+}
+
+void manifestFree(struct manifest *m) {
+    if (m == NULL) {
+        return;
+    }
+    if (m->open_fd != -1) {
+        close(m->open_fd);
+    }
+    pthread_mutex_destroy(&m->lock);
+    free(m->chunks);
+    free(m);
+}
+
+struct manifest *manifestBuild(int fd, off_t size, int store) {
+    // chunks and hashes the first size bytes of fd, and with store puts every chunk we don't have
+    // into the store too. reads through a buffer so we always have CHUNK_MAX bytes to look at
+    struct manifest *m = manifestNew(size, size / CHUNK_MIN + 1); // can't be more than that
+    size_t buf_size = (1 << 20) + CHUNK_MAX;
+    unsigned char *buf = malloc(buf_size);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for chunk buffer\n");
+        exit(1);
+    }
+
+    off_t read_to = 0; // file offset of buf + buf_len
+    size_t start = 0, buf_len = 0; // unchunked bytes are buf[start, buf_len)
+    unsigned long long count = 0;
+    while (read_to - (off_t) (buf_len - start) < size) {
+        if (buf_len - start < CHUNK_MAX && read_to < size) { // top up
+            memmove(buf, buf + start, buf_len - start);
+            buf_len -= start;
+            start = 0;
+            size_t want = MIN((off_t) (buf_size - buf_len), size - read_to);
+            ssize_t got = pread(fd, buf + buf_len, want, read_to);
+            if (got <= 0) {
+                perror("pread");
+                exit(1);
+            }
+            buf_len += got;
+            read_to += got;
+            continue;
+        }
+
+        struct chunk *c = &m->chunks[count++];
+        c->offset = read_to - (off_t) (buf_len - start);
+        c->len = chunkLength(buf + start, buf_len - start, read_to == size);
+        c->have = 1;
+        sha256(buf + start, c->len, c->hash);
+        if (store) {
+            storePut(c, buf + start);
+        }
+        start += c->len;
+    }
+    free(buf);
+    m->count = count;
+    return m;
+}
+
+unsigned long long manifestFind(const struct manifest *m, off_t offset) {
+    // index of the chunk holding offset, offsets are in order so binary search
+    unsigned long long lo = 0, hi = m->count;
+    while (hi - lo > 1) {
+        unsigned long long mid = lo + (hi - lo) / 2;
+        if (m->chunks[mid].offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int manifestCovers(const struct manifest *m, off_t offset, off_t len) {
+    // whether every byte of [offset, offset + len) is in a chunk the receiver has
+    if (m == NULL || m->count == 0) {
+        return 0;
+    }
+    for (unsigned long long i = manifestFind(m, offset); len > 0; i++) {
+        const struct chunk *c = &m->chunks[i];
+        if (i >= m->count || !c->have || c->len == 0 || c->offset > offset || c->offset + c->len <= offset) {
+            return 0;
+        }
+        off_t take = MIN(len, c->offset + c->len - offset);
+        offset += take;
+        len -= take;
+    }
+    return 1;
+}
+
+int storeRead(struct manifest *m, char *buf, size_t len, off_t offset) {
+    // reads [offset, offset + len) of the file m describes out of the store, -1 if a chunk is missing.
+    // keeps the last chunk open since fragments are a lot smaller than chunks
+    pthread_mutex_lock(&m->lock);
+    int ret = 0;
+    for (unsigned long long i = manifestFind(m, offset); len > 0; i++) {
+        const struct chunk *c = &m->chunks[i];
+        if (i >= m->count || c->offset > offset || c->offset + c->len <= offset) {
+            ret = -1;
+            break;
+        }
+        if (m->open_chunk != (long long) i) {
+            char path[sizeof CHUNK_DIR + SHA256_LEN * 2 + 1];
+            chunkPath(c->hash, path, sizeof path);
+            if (m->open_fd != -1) {
+                close(m->open_fd);
+            }
+            m->open_fd = open(path, O_RDONLY);
+            m->open_chunk = m->open_fd == -1 ? -1 : (long long) i;
+            if (m->open_fd == -1) {
+                perror("open");
+                ret = -1;
+                break;
+            }
+        }
+        size_t take = MIN((off_t) len, c->offset + c->len - offset);
+        if (pread(m->open_fd, buf, take, offset - c->offset) != (ssize_t) take) {
+            perror("pread");
+            ret = -1;
+            break;
+        }
+        buf += take;
+        offset += take;
+        len -= take;
+    }
+    pthread_mutex_unlock(&m->lock);
+    return ret;
+}
+
+int recipeWrite(const struct manifest *m, const char *path) {
+    // "ftp-recipe 1 <size> <count>" then a "<hash> <len>" line per chunk
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    fprintf(f, "%s %lld %llu\n", RECIPE_MAGIC, (long long) m->size, m->count);
+    for (unsigned long long i = 0; i < m->count; i++) {
+        for (int j = 0; j < SHA256_LEN; j++) {
+            fprintf(f, "%02x", m->chunks[i].hash[j]);
+        }
+        fprintf(f, " %u\n", m->chunks[i].len);
+    }
+    if (fclose(f) == EOF) {
+        perror("fclose");
+        return -1;
+    }
+    return 0;
+}
+
+struct manifest *recipeLoad(int fd) {
+    // NULL if fd isn't a recipe (a plain file) or is a broken one
+    char magic[sizeof RECIPE_MAGIC];
+    if (pread(fd, magic, sizeof magic, 0) != sizeof magic || memcmp(magic, RECIPE_MAGIC " ", sizeof magic) != 0) {
+        return NULL;
+    }
+    FILE *f = fdopen(dup(fd), "r");
+    if (f == NULL) {
+        perror("fdopen");
+        return NULL;
+    }
+    long long size;
+    unsigned long long count;
+    struct manifest *m = NULL;
+    if (fscanf(f, RECIPE_MAGIC " %lld %llu\n", &size, &count) == 2 && size >= 0 && count <= (unsigned long long) size / CHUNK_MIN + 1) {
+        m = manifestNew(size, count);
+        off_t offset = 0;
+        for (unsigned long long i = 0; i < count && m != NULL; i++) {
+            struct chunk *c = &m->chunks[i];
+            char hex[SHA256_LEN * 2 + 1];
+            if (fscanf(f, "%64s %u\n", hex, &c->len) != 2 || strlen(hex) != SHA256_LEN * 2) {
+                manifestFree(m);
+                m = NULL;
+                break;
+            }
+            for (int j = 0; j < SHA256_LEN; j++) {
+                sscanf(hex + j * 2, "%2hhx", &c->hash[j]);
+            }
+            c->offset = offset;
+            c->have = 1;
+            offset += c->len;
+        }
+        if (m != NULL && offset != m->size) {
+            manifestFree(m);
+            m = NULL;
+        }
+    }
+    if (m == NULL) {
+        fprintf(stderr, "Error: broken recipe file\n");
+    }
+    fclose(f);
+    return m;
+}
+
+void dedupStore(const char *part_filename, const char *filename) {
+    // turns a finished upload into chunks in the store plus a recipe under its real name, and
+    // removes the full copy. the recipe goes in under another name first so the real name
+    // only ever points at something complete
+    int fd = open(part_filename, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    struct manifest *m = manifestBuild(fd, size, 1);
+    close(fd);
+
+    char recipe_filename[MAX_FILENAME + 8];
+    snprintf(recipe_filename, sizeof recipe_filename, "%s.recipe", filename);
+    if (recipeWrite(m, recipe_filename) == 0 && rename(recipe_filename, filename) == -1) {
+        perror("rename");
+    }
+    unlink(part_filename);
+    manifestFree(m);
+}
+
+size_t serializeChunkQuery(const struct chunk_query *q, char *dest_buf, size_t buf_size) {
+    int header_len = snprintf(dest_buf, buf_size, "chunks:%u:%llu:%llu:%lld:%u:", q->transfer_id, q->total, q->first, (long long) q->offset, q->count);
+    size_t len = header_len;
+    for (unsigned int i = 0; i < q->count && len + SHA256_LEN + 4 <= buf_size; i++) {
+        memcpy(dest_buf + len, q->chunks[i].hash, SHA256_LEN);
+        uint32_t chunk_len = htonl(q->chunks[i].len);
+        memcpy(dest_buf + len + SHA256_LEN, &chunk_len, 4);
+        len += SHA256_LEN + 4;
+    }
+    return len;
+}
+
+int deserializeChunkQuery(const char *src_buf, size_t buf_size, struct chunk_query *q) {
+    // returns -1 if this isn't a well formed chunk query
+    char temp_buf[buf_size + 1];
+    memcpy(temp_buf, src_buf, buf_size);
+    temp_buf[buf_size] = '\0';
+
+    long long offset;
+    int header_len = 0;
+    if (sscanf(temp_buf, "chunks:%u:%llu:%llu:%lld:%u:%n", &q->transfer_id, &q->total, &q->first, &offset, &q->count, &header_len) != 5 ||
+            header_len == 0 || q->count == 0 || q->count > CHUNKS_PER_QUERY || header_len + q->count * (SHA256_LEN + 4) != buf_size) {
+        return -1;
+    }
+    q->offset = offset;
+    const char *p = src_buf + header_len;
+    for (unsigned int i = 0; i < q->count; i++, p += SHA256_LEN + 4) {
+        uint32_t chunk_len;
+        memcpy(q->chunks[i].hash, p, SHA256_LEN);
+        memcpy(&chunk_len, p + SHA256_LEN, 4);
+        q->chunks[i].len = ntohl(chunk_len);
+    }
+    return 0;
+}
+
+size_t serializeChunkAnswer(const struct chunk_answer *a, char *dest_buf, size_t buf_size) {
+    return 1 + snprintf(dest_buf, buf_size, "have:%u:%llu:%u:%x", a->transfer_id, a->first, a->count, a->have);
+}
+
+int deserializeChunkAnswer(const char *src_buf, size_t buf_size, struct chunk_answer *a) {
+    char temp_buf[buf_size + 1];
+    memcpy(temp_buf, src_buf, buf_size);
+    temp_buf[buf_size] = '\0';
+    if (sscanf(temp_buf, "have:%u:%llu:%u:%x", &a->transfer_id, &a->first, &a->count, &a->have) != 4 || a->count > CHUNKS_PER_QUERY) {
+        return -1;
+    }
+    return 0;
+}
+
+void receiverOnChunkQuery(struct receiver *r, const struct chunk_query *q) {
+    // remember the chunks (the dup runs that come later refer to them) and tell the sender which
+    // ones the store has. a repeated query just gets answered again
+    if (q->transfer_id != r->transfer_id || q->total > (unsigned long long) r->file_size / CHUNK_MIN + 1 ||
+            q->first + q->count > q->total) {
+        return;
+    }
+    if (r->dedup == NULL) {
+        r->dedup = manifestNew(r->file_size, q->total);
+    } else if (r->dedup->count != q->total) {
+        return;
+    }
+
+    struct chunk_answer answer = {r->transfer_id, q->first, q->count, 0};
+    off_t offset = q->offset;
+    for (unsigned int i = 0; i < q->count; i++) {
+        if (offset + q->chunks[i].len > r->file_size || q->chunks[i].len == 0) {
+            return;
+        }
+        struct chunk *c = &r->dedup->chunks[q->first + i];
+        *c = q->chunks[i];
+        c->offset = offset;
+        c->have = storeHas(c->hash);
+        answer.have |= (unsigned int) c->have << i;
+        offset += c->len;
+    }
+
+    char msg[MAXBUFLEN];
+    size_t msg_len = serializeChunkAnswer(&answer, msg, MAXBUFLEN);
+    sendMsg(r->sockfd, msg, msg_len, (struct sockaddr *) &r->peer_addr, r->peer_addr_len);
+}
@@ -5,319 +5,155 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include "transfer.h"
 
-#define MAXBUFLEN 1500
-#define FRAG_SIZE 1000
-#define MAX_TIMEOUT 30000
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+// command line client, the transfers themselves are in session.c. with files after the options
+// it runs them one after another over the same session and exits, otherwise it asks for one.
+// "ftp -" uploads stdin, streamed if it's a pipe, as name=<name> or "stdin"
 
-// credits: some of this code is adapted from beej's handbook, mainly section 6.3
+const char *stdin_name = "stdin";
 
-struct packet {
-    unsigned int total_frag;
-    unsigned int frag_no;
-    unsigned int size;
-    char *filename;
-    char filedata[1000];
-};
-
-struct ackpkt {
-    unsigned int ack_nack; // 1 for ack, 0 for nack
-    unsigned int frag_no;
-};
-
-double timeout_ms = 100; // initial timeout 0.1 sec
-double estimatedRTT = 100, devRTT = 50;
-int exp_backoff = 0; // whether we are in exponential backoff mode or not
-
-void deserializeAck(const char *src_buf, size_t buf_size, struct ackpkt *ackpkt) {
-    char temp_buf[buf_size + 1];
-    memcpy(temp_buf, src_buf, buf_size); 
-    temp_buf[buf_size] = '\0'; // should be unnecessary bc the serialized ack packet is null-terminated
-
-    char *field = strtok(temp_buf, ":");
-    ackpkt->ack_nack = atoi(field);
-    field = strtok(temp_buf, ":");
-    ackpkt->frag_no = atoi(field);
-}
-
-size_t serializePkt(const struct packet *pkt, char *dest_buf, size_t buf_size) {
-    // note here we write the numbers as their corresponding ascii chars, not as binary numbers
-    // snprintf writes a terminating null, but memcpy overwrites that with the first byte of filedata
-    int header_len = snprintf(dest_buf, buf_size, "%u:%u:%u:%s:", pkt->total_frag, pkt->frag_no, pkt->size, pkt->filename);
-    
-    if (header_len < 0 || header_len >= buf_size) {
-        fprintf(stderr, "Error: header_len error when serializing packet\n");
-        return 0;
-    }
-
-    size_t total_size = header_len + pkt->size;
-    if (total_size > buf_size) {
-        fprintf(stderr, "Error: packet too big for serialization\n");
-        return 0;
-    }
-
-    memcpy(dest_buf + header_len, pkt->filedata, pkt->size);
-    return total_size;
-};
-
-void sendMsg(int sockfd, const void *msg, size_t len, struct addrinfo *ai) {
-    int numbytes;
-    numbytes = sendto(sockfd, msg, len, 0, ai->ai_addr, ai->ai_addrlen);
-
-    if (numbytes == -1) {
-        perror("sendto");
-        exit(1);
+int runLine(struct session *s, char *line) {
+    // "ftp <file-name>" or "get <file-name>", -1 if it isn't one or the transfer failed
+    line[strcspn(line, "\r\n")] = '\0';
+    char *cmd = strtok(line, " ");
+    char *filename = strtok(NULL, " ");
+    if (!cmd || !filename || (strtok(NULL, " ") != NULL) || (strcmp(cmd, "ftp") != 0 && strcmp(cmd, "get") != 0)) {
+        fprintf(stderr, "Input must be of form ftp <file-name> or get <file-name>, with no spaces in file name.\n");
+        return -1;
     }
-}
-
-// NOTE: perhaps in the future pass the expected length to receive into recvMsg
-int recvMsg(int sockfd, void *recv_buf, double timeout_ms) {
-    // will return -1 on timeout
-
-    // set timeout 
-    struct timeval timeout_struct;
-    timeout_struct.tv_sec = (long) (timeout_ms / 1000);
-    timeout_struct.tv_usec = ((long) (timeout_ms * 1000)) % 1000000;
-
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout_struct, sizeof(timeout_struct)) < 0) {
-        perror("setsockopt");
-        exit(1);
+    if (strcmp(cmd, "get") == 0) {
+        return sessionGet(s, filename);
     }
-    // printf("set the timeout to: %.6f\n", timeout_ms);
-    // receive the data
-    int numbytes;
-    struct sockaddr_storage serv_addr;
-    socklen_t serv_addr_len = sizeof serv_addr;
-
-    numbytes = recvfrom(sockfd, recv_buf, MAXBUFLEN - 1, 0, (struct sockaddr *) &serv_addr, &serv_addr_len);
-    if (numbytes == -1) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) { // timeout
-            return -1; 
-        }
-        perror("recvfrom");
-        exit(1);
+    if (strcmp(filename, "-") == 0) {
+        return sessionSendFd(s, STDIN_FILENO, stdin_name);
     }
-
-    return numbytes;
-}
-
-double get_time_diff(struct timespec start, struct timespec end) {
-    // in milliseconds
-    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
-}
-
-void updateRTT(double sampleRTT) {
-    estimatedRTT = (1 - 0.125) * estimatedRTT + (0.125) * sampleRTT;
-    if (sampleRTT - estimatedRTT > 0) {
-        devRTT = (1 - 0.25) * devRTT + (0.25) * (sampleRTT - estimatedRTT);
-    } else {
-        devRTT = (1 - 0.25) * devRTT + (0.25) * (estimatedRTT - sampleRTT);
+    if (access(filename, F_OK) != 0) {
+        fprintf(stderr, "File does not exist: %s\n", filename);
+        s->stats.files += 1;
+        s->stats.failed += 1;
+        return -1;
     }
+    return sessionSend(s, filename);
 }
 
-void sendFile(int sockfd, const char *filename, struct addrinfo *ai, int verbose) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) { // see if NULL
+int runList(struct session *s, const char *list) {
+    // one command per line, blank lines and #comments skipped. "-" reads them from stdin
+    FILE *f = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    if (f == NULL) {
         perror("fopen");
-        exit(1);
+        return -1;
     }
-
-    fseek(file, 0, SEEK_END); // move to end of file
-    long file_size = ftell(file); // position in file (we are at end, so we get length)
-    rewind(file);
-
-    unsigned int total_frag = (file_size + (FRAG_SIZE - 1)) / FRAG_SIZE; // file_size / FRAG_SIZE would truncate towards 0, add FRAG_SIZE - 1 to ceil
-    struct packet pkt;
-    pkt.filename = strdup(filename);
-    pkt.total_frag = total_frag;
-
-    printf("File %s is %d bytes long, %u fragments\n", filename, file_size, total_frag);
-
-    // begin transmission
-    unsigned int frag_no = 1;
-    while (frag_no <= total_frag) {
-        long initial_pos = ftell(file);
-
-        pkt.frag_no = frag_no;
-        pkt.size = fread(pkt.filedata, 1, FRAG_SIZE, file);
-
-        struct timespec start, end;
-
-        char send_buf[MAXBUFLEN];
-        size_t send_len = serializePkt(&pkt, send_buf, MAXBUFLEN);
-        clock_gettime(CLOCK_MONOTONIC, &start); // start of RTT
-        sendMsg(sockfd, send_buf, send_len, ai);
-        if (verbose) {
-            printf("Sent packet %u/%u (%d file bytes)\n", pkt.frag_no, pkt.total_frag, pkt.size);
-        }
-
-        struct ackpkt ack_nack;
-        char recv_buf[MAXBUFLEN];
-        int numbytes = recvMsg(sockfd, recv_buf, timeout_ms);
-
-        if (numbytes == -1) { // timeout
-            printf("TIMEOUT for fragment %u: waited %.6f ms\n", frag_no, timeout_ms);
-            exp_backoff = 1;
-            timeout_ms = MIN(timeout_ms * 2, MAX_TIMEOUT);
-
-            fseek(file, initial_pos, SEEK_SET);
+    char line[MAXBUFLEN];
+    int result = 0;
+    while (fgets(line, sizeof line, f) != NULL) {
+        size_t skip = strspn(line, " \t");
+        if (line[skip] == '\n' || line[skip] == '\0' || line[skip] == '#') {
             continue;
         }
-
-        clock_gettime(CLOCK_MONOTONIC, &end); // end of RTT
-        double rtt = get_time_diff(start, end);
-
-        deserializeAck(recv_buf, MAXBUFLEN, &ack_nack);
-
-        if (ack_nack.ack_nack == 1) {
-            if (verbose) {
-                printf("Received ack for fragment %u\n", ack_nack.frag_no);
-            }
-            if (exp_backoff) {
-                exp_backoff = 0;
-                timeout_ms = MIN(estimatedRTT + 4 * devRTT, MAX_TIMEOUT);
-            } else {
-                updateRTT(rtt);
-                timeout_ms = MIN(estimatedRTT + 4 * devRTT, MAX_TIMEOUT);
-            }
-            frag_no += 1; 
-        } else { // retransmit if nack (this case isn't rlly used)
-            printf("Received nack for fragment %u\n", ack_nack.frag_no);
-            fseek(file, initial_pos, SEEK_SET);
+        if (runLine(s, line + skip) == -1) {
+            result = -1;
         }
     }
-
-    printf("Finished transmitting file.\n");
-
-    free(pkt.filename);
+    if (f != stdin) {
+        fclose(f);
+    }
+    return result;
 }
 
-/* Timeout calculation
-EstimatedRTT = (1-0.125) * EstimatedRTT + (0.125) * SampleRTT
-DevRTT = (1-0.25) * DevRTT + (0.25) * |SampleRTT - EstimatedRTT|
-initial DevRTT will be half of first EstimatedRTT
-timeout = EstimatedRTT + 4 * DevRTT
-initial timeout = 1 sec?
-karn's alg: exponential backoff on retransmission
-cap the timeout at 30s
-*/
-
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: deliver <server address> <server port number>\n");
+    if (argc < 3) {
+        fprintf(stderr, "Usage: deliver <server address or multicast group> <server port number> [reno|bbr] [threaded|inline] [readahead=<MB>] [rate=<MB/s>] [mcastif=<addr>] [paths=<addr or interface>,...]\n"
+                        "               [nopmtu] [name=<name>] [verbose] [trace=<file>] [ftp|get <file-name>...]... [list=<file or ->]...\n");
         return 1;
     }
-
-    // POPULATE ADDRINFOS
-    int status;
-    struct addrinfo hints, *servinfo;
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
-
-    // no need for us to use inet_pton since getaddrinfo accepts a string ip address (or hostname)
-    if ((status = getaddrinfo(argv[1], argv[2], &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+    struct session sess;
+    if (sessionOpen(&sess, argv[1], argv[2]) == -1) {
         exit(1);
     }
 
-    // loop thru and get first socket we can
-    int sockfd;
-    struct addrinfo *curr;
-    for (curr = servinfo; curr != NULL; curr = curr->ai_next) {
-        sockfd = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
-        if (sockfd == -1) {
-            perror("socket");
-            continue;
+    // options after the port, in any order, then the batch if there is one
+    int read_ahead_mb = READ_AHEAD_MB;
+    char addr_str[64];
+    int batch = argc;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "ftp") == 0 || strcmp(argv[i], "get") == 0 || strncmp(argv[i], "list=", 5) == 0) {
+            batch = i;
+            break;
+        }
+        if (parseCC(argv[i]) != -1) {
+            sess.cc = parseCC(argv[i]);
+        } else if (strcmp(argv[i], "threaded") == 0 || strcmp(argv[i], "inline") == 0) {
+            sess.threaded = strcmp(argv[i], "threaded") == 0;
+        } else if (strcmp(argv[i], "verbose") == 0) {
+            sess.verbose = 1;
+        } else if (strcmp(argv[i], "nopmtu") == 0) { // FRAG_SIZE fragments, no probing
+            sess.no_pmtu = 1;
+        } else if (strncmp(argv[i], "name=", 5) == 0 && argv[i][5] != '\0') {
+            stdin_name = argv[i] + 5;
+        } else if (sscanf(argv[i], "readahead=%d", &read_ahead_mb) == 1 && read_ahead_mb >= 0) {
+            sess.read_ahead = (off_t) read_ahead_mb << 20;
+        } else if (sscanf(argv[i], "rate=%lf", &sess.rate_mb) == 1 && sess.rate_mb > 0) {
+            // set
+        } else if (strncmp(argv[i], "trace=", 6) == 0) {
+            if (tracer != NULL || traceStart(argv[i] + 6) == -1) {
+                sessionClose(&sess);
+                return 1;
+            }
+            atexit(traceStop); // whichever way we leave
+        } else if (strncmp(argv[i], "paths=", 6) == 0) {
+            if (sess.num_paths > 0 || sessionPaths(&sess, argv[i] + 6) == -1) {
+                sessionClose(&sess);
+                return 1;
+            }
+        } else if (sscanf(argv[i], "mcastif=%63s", addr_str) != 1 || inet_pton(AF_INET, addr_str, &sess.mcast_if) != 1) {
+            fprintf(stderr, "Unknown option %s, expected reno, bbr, threaded, inline, verbose, readahead=<MB>, rate=<MB/s>, mcastif=<addr>, paths=<list>, nopmtu, name=<name> or trace=<file>\n", argv[i]);
+            sessionClose(&sess);
+            return 1;
         }
-        break;
-    }
-
-    if (curr == NULL) {
-        fprintf(stderr, "client failed to bind socket\n");
-        exit(1);
-    }
-
-    // QUERY USER
-    printf("Input file transfer cmd: ftp <file-name>\n>>> ");
-    char input_buf[MAXBUFLEN] = {0};
-    if (fgets(input_buf, MAXBUFLEN, stdin) == NULL) {
-        fprintf(stderr, "Error reading input.\n");
-        freeaddrinfo(servinfo);
-        close(sockfd);
-        exit(1);
-    }
-    input_buf[strcspn(input_buf, "\n")] = '\0';
-
-    char *cmd = strtok(input_buf, " ");
-    char *filename = strtok(NULL, " ");
-    if (!cmd || !filename || (strtok(NULL, " ") != NULL)) { // make sure cmd and filename are non-NULL and there is nothing left in the input
-        fprintf(stderr, "Input must be of form ftp <file-name>, with no spaces in file name.\n");
-        freeaddrinfo(servinfo);
-        close(sockfd);
-        exit(1);
-    }
-
-    if (access(filename, F_OK) != 0) {
-        fprintf(stderr, "File does not exist.\n");
-        freeaddrinfo(servinfo);
-        close(sockfd);
-        exit(1);
     }
 
-    // initial handshake
-    char recv_buf[MAXBUFLEN];
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start); 
-
-    while (1) { // keep retransmitting if timeout
-        char *msg = "ftp";
-        sendMsg(sockfd, msg, strlen(msg), curr);
-
-        memset(recv_buf, 0, sizeof(recv_buf));
-        int numbytes = recvMsg(sockfd, recv_buf, timeout_ms);
-
-        if (numbytes == -1) { // timeout
-            printf("INITIAL MESSAGE TIMEOUT: waited %.6f ms\n", timeout_ms);
-            exp_backoff = 1;
-            timeout_ms = MIN(timeout_ms * 2, MAX_TIMEOUT);
+    if (batch == argc) {
+        // QUERY USER
+        printf("Input file transfer cmd: ftp <file-name> (upload) or get <file-name> (download)\n>>> ");
+        char input_buf[MAXBUFLEN] = {0};
+        if (fgets(input_buf, MAXBUFLEN, stdin) == NULL) {
+            fprintf(stderr, "Error reading input.\n");
+            sessionClose(&sess);
+            exit(1);
+        }
+        // the handshake goes out from sessionSend, together with the first window of data
+        int result = runLine(&sess, input_buf);
+        sessionClose(&sess);
+        return result == -1;
+    }
+
+    // BATCH: ftp a b c get d e list=more.txt ..., a failure doesn't stop the rest
+    char line[MAXBUFLEN];
+    const char *cmd = "ftp";
+    int result = 0;
+    for (int i = batch; i < argc; i++) {
+        if (strcmp(argv[i], "ftp") == 0 || strcmp(argv[i], "get") == 0) {
+            cmd = argv[i];
             continue;
-        } else {
-            recv_buf[numbytes] = '\0'; // reply we know should be string
-            break;
         }
+        if (strncmp(argv[i], "list=", 5) == 0) {
+            result |= runList(&sess, argv[i] + 5);
+            continue;
+        }
+        snprintf(line, sizeof line, "%s %s", cmd, argv[i]);
+        result |= runLine(&sess, line);
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &end); 
-
-    double rtt = get_time_diff(start, end);
-
-    if (exp_backoff) { // if first message required retransmissions, then the RTT we measured isn't rlly valid
-        printf("Round-Trip Time (likely invalid, required retransmissions): %.6f milliseconds\n", rtt);
-        // reset exp_backoff
-        exp_backoff = 0;
-        timeout_ms = MIN(estimatedRTT + 4 * devRTT, MAX_TIMEOUT); 
-    } else {
-        printf("Round-Trip Time: %.6f milliseconds\n", rtt);
-        updateRTT(rtt);
-        timeout_ms = MIN(estimatedRTT + 4 * devRTT, MAX_TIMEOUT);
-    }
-
-    if (strcmp("yes", recv_buf) == 0) {
-        printf("A file transfer can start.\n");
-    } else {
-        printf("Server cannot accept file transfer right now.\n");
-        exit(1);
-    }
-
-    sendFile(sockfd, filename, curr, 0);
-
-    freeaddrinfo(servinfo);
-    close(sockfd);
-
-    return 0;
+    const struct session_stats *st = sessionStats(&sess);
+    printf("Batch done: %llu of %llu transfers finished, %llu bytes in %.3f ms (%.2f MB/s), %llu retransmits\n",
+           st->files - st->failed, st->files, st->bytes, st->busy_ms,
+           st->busy_ms > 0 ? st->bytes / (st->busy_ms / 1000) / 1e6 : 0, st->retransmits);
+    sessionClose(&sess);
+    return result != 0;
 }
@@ -0,0 +1,347 @@
+#include "transfer.h"
+#include <unistd.h>
+#include <arpa/inet.h>
+
+// one-to-many uploads over IP multicast. the sender sends each fragment once to a group at a
+// fixed rate (no single receiver's acks to clock it by) and repeats an announcement of what it's
+// sending. receivers (servers started with mcast=<group>) keep a bitmap of what they have and,
+// after a random backoff, nack what's missing straight to the sender. the sender folds every
+// nack into one set of repairs, so a fragment lost by ten receivers still goes out once more, and
+// tells the group what it's about to repair so receivers that lost the same fragments hold their
+// nacks. past the first copy the sender only pays for repairs, however many receivers there are
+
+// announcement, "mcast:<version>:<transfer_id>:<frag_size>:<file_size>:<sent>:<filename>"
+
+size_t serializeAnnounce(const struct mcast_announce *a, char *dest_buf, size_t buf_size) {
+    return snprintf(dest_buf, buf_size, "mcast:%u:%u:%u:%lld:%llu:%s", PROTOCOL_VERSION, a->transfer_id, a->frag_size,
+                    a->file_size, a->sent, a->filename);
+}
+
+int deserializeAnnounce(const char *src_buf, size_t buf_size, struct mcast_announce *a) {
+    char temp_buf[buf_size + 1];
+    memcpy(temp_buf, src_buf, buf_size);
+    temp_buf[buf_size] = '\0';
+    unsigned int version;
+    int name_start = 0;
+    memset(a, 0, sizeof *a);
+    if (sscanf(temp_buf, "mcast:%u:%u:%u:%lld:%llu:%n", &version, &a->transfer_id, &a->frag_size, &a->file_size, &a->sent,
+               &name_start) != 5 || name_start == 0 || version != PROTOCOL_VERSION) {
+        return -1;
+    }
+    strncpy(a->filename, temp_buf + name_start, MAX_FILENAME - 1);
+    return 0;
+}
+
+int bitSet(const unsigned char *bits, unsigned long long i) {
+    return bits[i / 8] >> (i % 8) & 1;
+}
+
+unsigned char *bitmapNew(unsigned long long bits) {
+    unsigned char *map = calloc(bits / 8 + 1, 1);
+    if (map == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for multicast bitmap\n");
+        exit(1);
+    }
+    return map;
+}
+
+// sender
+
+void mcastSenderInit(struct mcast_sender *m, int sockfd, const struct sockaddr *group, socklen_t group_len,
+                     const struct file_source *src, const char *filename, double rate_mb) {
+    memset(m, 0, sizeof *m);
+    m->sockfd = sockfd;
+    memcpy(&m->group, group, group_len);
+    m->group_len = group_len;
+    m->src = src;
+    m->frag_size = FRAG_SIZE;
+    m->total_frag = totalFrags(src->size, FRAG_SIZE);
+    m->transfer_id = (unsigned int) rand();
+    strncpy(m->filename, filename, MAX_FILENAME - 1);
+    m->next_frag = 1;
+    m->repair = bitmapNew(m->total_frag + 1);
+    m->rate = rate_mb * 1000 / FRAG_SIZE; // fragments per ms
+    clock_gettime(CLOCK_MONOTONIC, &m->next_send);
+    m->next_announce = m->next_send;
+    m->quiet_since = m->next_send;
+}
+
+void mcastAnnounce(struct mcast_sender *m) {
+    struct mcast_announce a = {m->transfer_id, m->frag_size, m->src->size, m->next_frag - 1, ""};
+    strncpy(a.filename, m->filename, MAX_FILENAME - 1);
+    char msg[MAXBUFLEN];
+    size_t len = serializeAnnounce(&a, msg, MAXBUFLEN);
+    sendMsg(m->sockfd, msg, len, (struct sockaddr *) &m->group, m->group_len);
+}
+
+void mcastSendFragment(struct mcast_sender *m, unsigned long long frag_no) {
+    struct packet pkt;
+    pkt.total_frag = m->total_frag;
+    pkt.frag_no = frag_no;
+    pkt.transfer_id = m->transfer_id;
+    pkt.hole_frags = 0;
+    pkt.from_store = 0;
+    pkt.frag_len = 0;
+    off_t offset = (off_t) (frag_no - 1) * m->frag_size;
+    pkt.size = MIN((off_t) m->frag_size, m->src->size - offset);
+    if (sourceRead(m->src, pkt.filedata, pkt.size, offset) == -1) {
+        perror("pread");
+        exit(1);
+    }
+    char send_buf[MAXBUFLEN];
+    size_t send_len = serializePkt(&pkt, send_buf, MAXBUFLEN);
+    sendMsg(m->sockfd, send_buf, send_len, (struct sockaddr *) &m->group, m->group_len);
+}
+
+void mcastSenderStep(struct mcast_sender *m, struct timespec now) {
+    // whatever's due: the announcement, then repairs ahead of new fragments, as fast as the rate allows
+    if (get_time_diff(m->next_announce, now) >= 0) {
+        mcastAnnounce(m);
+        m->next_announce = add_time_ms(now, MCAST_ANNOUNCE_MS);
+    }
+    if (get_time_diff(m->next_send, now) > PACING_QUANTUM_MS) { // don't make up for time we had nothing to send
+        m->next_send = add_time_ms(now, -PACING_QUANTUM_MS);
+    }
+    while (get_time_diff(m->next_send, now) >= 0) {
+        if (m->repairs_pending > 0) {
+            while (!bitSet(m->repair, m->repair_next)) {
+                m->repair_next++;
+            }
+            m->repair[m->repair_next / 8] &= ~(1 << (m->repair_next % 8));
+            m->repairs_pending -= 1;
+            mcastSendFragment(m, m->repair_next);
+            m->repairs_sent += 1;
+        } else if (m->next_frag <= m->total_frag) {
+            mcastSendFragment(m, m->next_frag);
+            m->next_frag += 1;
+            if (m->next_frag > m->total_frag) {
+                m->quiet_since = now; // linger from here
+                mcastAnnounce(m); // so receivers that lost the tail know to nack it
+            }
+        } else {
+            return;
+        }
+        m->next_send = add_time_ms(m->next_send, 1 / m->rate);
+    }
+}
+
+double mcastSenderTimeLeft(const struct mcast_sender *m, struct timespec now) {
+    // ms until mcastSenderStep has something to do
+    double left = get_time_diff(now, m->next_announce);
+    if (m->repairs_pending > 0 || m->next_frag <= m->total_frag) {
+        left = MIN(left, get_time_diff(now, m->next_send));
+    }
+    return left;
+}
+
+void mcastSenderOnNack(struct mcast_sender *m, const char *buf, size_t len, struct timespec now) {
+    // "mnack:<transfer_id>:<ranges>" then ":<first>:<count>" for each. fragments already waiting
+    // for a repair aren't added again, which is what makes nacks from many receivers cost one repair
+    char temp_buf[len + 1];
+    memcpy(temp_buf, buf, len);
+    temp_buf[len] = '\0';
+    unsigned int transfer_id, ranges;
+    int pos = 0;
+    if (sscanf(temp_buf, "mnack:%u:%u%n", &transfer_id, &ranges, &pos) != 2 || pos == 0 || transfer_id != m->transfer_id ||
+            ranges > MCAST_NACK_RANGES) {
+        return;
+    }
+    m->nacks += 1;
+    m->quiet_since = now;
+    for (unsigned int i = 0; i < ranges; i++) {
+        unsigned long long first, count;
+        int n = 0;
+        if (sscanf(temp_buf + pos, ":%llu:%llu%n", &first, &count, &n) != 2 || n == 0) {
+            return;
+        }
+        pos += n;
+        if (first == 0 || first >= m->next_frag || count == 0) {
+            continue;
+        }
+        count = MIN(count, m->next_frag - first); // can't repair what we haven't sent
+        unsigned long long run_start = 0;
+        for (unsigned long long f = first; f < first + count; f++) {
+            if (!bitSet(m->repair, f)) {
+                m->repair[f / 8] |= 1 << (f % 8);
+                m->repairs_pending += 1;
+                m->repair_next = m->repairs_pending == 1 ? f : MIN(m->repair_next, f);
+                run_start = run_start ? run_start : f;
+            }
+            if (run_start && (f + 1 == first + count || bitSet(m->repair, f + 1))) {
+                // tell the group, so others missing these wait for the repair instead of nacking
+                char msg[MAXBUFLEN];
+                int msg_len = snprintf(msg, sizeof msg, "mrepair:%u:%llu:%llu", m->transfer_id, run_start, f - run_start + 1);
+                sendMsg(m->sockfd, msg, msg_len + 1, (struct sockaddr *) &m->group, m->group_len);
+                run_start = 0;
+            }
+        }
+    }
+}
+
+int mcastSenderDone(const struct mcast_sender *m, struct timespec now) {
+    // everything sent and repaired, and nobody's asked for anything in a while
+    return m->next_frag > m->total_frag && m->repairs_pending == 0 && get_time_diff(m->quiet_since, now) >= MCAST_LINGER_MS;
+}
+
+void mcastSenderClose(struct mcast_sender *m) {
+    free(m->repair);
+    m->repair = NULL;
+}
+
+// receiver
+
+void mcastReceiverInit(struct mcast_receiver *r, int sockfd, const struct sockaddr *sender, socklen_t sender_len,
+                       const struct mcast_announce *a, int fd, struct timespec now) {
+    memset(r, 0, sizeof *r);
+    r->sockfd = sockfd;
+    memcpy(&r->sender_addr, sender, sender_len);
+    r->sender_addr_len = sender_len;
+    r->fd = fd;
+    r->frag_size = a->frag_size;
+    r->file_size = a->file_size;
+    r->total_frag = totalFrags(a->file_size, a->frag_size);
+    r->transfer_id = a->transfer_id;
+    r->have = bitmapNew(r->total_frag + 1);
+    r->first_missing = 1;
+    r->last_heard = now;
+    mcastOnAnnounce(r, a, now);
+}
+
+void mcastScheduleNack(struct mcast_receiver *r, struct timespec now, double after_ms) {
+    // random backoff, so receivers that lost the same fragment don't all nack at once
+    if (!r->nack_pending) {
+        r->nack_pending = 1;
+        r->nack_due = add_time_ms(now, after_ms + (double) rand() / RAND_MAX * MCAST_NACK_BACKOFF_MS);
+    }
+}
+
+void mcastOnAnnounce(struct mcast_receiver *r, const struct mcast_announce *a, struct timespec now) {
+    if (a->transfer_id != r->transfer_id) {
+        return;
+    }
+    r->last_heard = now;
+    r->sent = MIN(MAX(r->sent, a->sent), r->total_frag);
+    if (r->first_missing <= r->sent) {
+        mcastScheduleNack(r, now, 0);
+    }
+}
+
+void mcastOnData(struct mcast_receiver *r, const struct packet *pkt, struct timespec now) {
+    if (pkt->transfer_id != r->transfer_id || pkt->frag_no == 0 || pkt->frag_no > r->total_frag || pkt->hole_frags > 0 || pkt->frag_len > 0) {
+        return;
+    }
+    r->last_heard = now;
+    if (bitSet(r->have, pkt->frag_no)) {
+        r->dup_frags += 1; // a repair someone else asked for
+        return;
+    }
+    off_t offset = (off_t) (pkt->frag_no - 1) * r->frag_size;
+    if (r->writer) {
+        writerWrite(r->writer, r->fd, pkt->filedata, pkt->size, offset);
+    } else if (pwrite(r->fd, pkt->filedata, pkt->size, offset) == -1) {
+        perror("pwrite");
+        exit(1);
+    }
+    r->have[pkt->frag_no / 8] |= 1 << (pkt->frag_no % 8);
+    r->received += 1;
+    while (r->first_missing <= r->total_frag && bitSet(r->have, r->first_missing)) {
+        r->first_missing++;
+    }
+
+    // new fragments go out in order, so anything missing below the newest one was lost
+    if (pkt->frag_no > r->sent) {
+        r->sent = pkt->frag_no;
+    }
+    if (r->first_missing < r->sent) {
+        mcastScheduleNack(r, now, 0);
+    }
+}
+
+void mcastOnRepair(struct mcast_receiver *r, const char *buf, size_t len, struct timespec now) {
+    // "mrepair:<transfer_id>:<first>:<count>", the sender's going to send these again anyway
+    char temp_buf[len + 1];
+    memcpy(temp_buf, buf, len);
+    temp_buf[len] = '\0';
+    unsigned int transfer_id;
+    struct mcast_range range;
+    if (sscanf(temp_buf, "mrepair:%u:%llu:%llu", &transfer_id, &range.first, &range.count) != 3 || transfer_id != r->transfer_id) {
+        return;
+    }
+    range.until = add_time_ms(now, MCAST_REPAIR_HOLD_MS);
+    r->held[r->held_next] = range;
+    r->held_next = (r->held_next + 1) % MCAST_HELD_RANGES;
+}
+
+int mcastHeld(const struct mcast_receiver *r, unsigned long long frag_no, struct timespec now) {
+    // whether the sender said it's repairing frag_no recently enough that we can wait for it
+    for (int i = 0; i < MCAST_HELD_RANGES; i++) {
+        const struct mcast_range *h = &r->held[i];
+        if (frag_no >= h->first && frag_no < h->first + h->count && get_time_diff(now, h->until) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+double mcastTimeLeft(const struct mcast_receiver *r, struct timespec now) {
+    // ms until the nack is due, or until we give up on a sender we haven't heard from
+    double left = MAX_TIMEOUT - get_time_diff(r->last_heard, now);
+    if (r->nack_pending) {
+        left = MIN(left, get_time_diff(now, r->nack_due));
+    }
+    return left;
+}
+
+int mcastOnTimer(struct mcast_receiver *r, struct timespec now) {
+    // sends the nack if it's due, returns -1 once the sender's been quiet for too long
+    if (get_time_diff(r->last_heard, now) >= MAX_TIMEOUT) {
+        return -1;
+    }
+    if (!r->nack_pending || get_time_diff(now, r->nack_due) > 0) {
+        return 0;
+    }
+    r->nack_pending = 0;
+
+    char msg[MAXBUFLEN];
+    char ranges_buf[MAXBUFLEN];
+    int ranges_len = 0;
+    unsigned int ranges = 0;
+    int held = 0;
+    for (unsigned long long f = r->first_missing; f <= r->sent && ranges < MCAST_NACK_RANGES; f++) {
+        if (bitSet(r->have, f)) {
+            continue;
+        }
+        if (mcastHeld(r, f, now)) {
+            held = 1;
+            continue;
+        }
+        unsigned long long count = 1;
+        while (f + count <= r->sent && !bitSet(r->have, f + count) && !mcastHeld(r, f + count, now)) {
+            count++;
+        }
+        ranges_len += snprintf(ranges_buf + ranges_len, sizeof ranges_buf - ranges_len, ":%llu:%llu", f, count);
+        ranges++;
+        f += count;
+    }
+    if (ranges > 0) {
+        int len = snprintf(msg, sizeof msg, "mnack:%u:%u%s", r->transfer_id, ranges, ranges_buf);
+        sendMsg(r->sockfd, msg, len + 1, (struct sockaddr *) &r->sender_addr, r->sender_addr_len);
+        r->nacks_sent += 1;
+    } else if (held) {
+        r->nacks_suppressed += 1;
+    }
+    // look again once repairs had time to arrive, they could get lost too
+    if (ranges > 0 || held) {
+        mcastScheduleNack(r, now, MCAST_REPAIR_HOLD_MS);
+    }
+    return 0;
+}
+
+int mcastDone(const struct mcast_receiver *r) {
+    return r->received >= r->total_frag;
+}
+
+void mcastReceiverClose(struct mcast_receiver *r) {
+    free(r->have);
+    r->have = NULL;
+}
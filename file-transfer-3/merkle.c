@@ -0,0 +1,434 @@
+#include "transfer.h"
+#include <unistd.h>
+
+// merkle tree over the file in blocks of MERKLE_BLOCK_FRAGS fragments. the sender puts the root
+// in its handshake; the receiver hashes each block once it has all of it (on the writer thread
+// when there is one, reading it back from disk), and as soon as a group of MERKLE_GROUP_LEAVES
+// leaves is hashed it sends the group's subtree root to the sender. the sender says ok, or
+// sends that group's leaves so the receiver can tell which blocks are bad and ask for only
+// those again. the last ack waits until every group and the root check out, so the sender
+// stays around to answer
+
+enum group_state {
+    GROUP_WAITING, // blocks not all in or hashed yet
+    GROUP_ASKED, // sent our subtree root, waiting for the answer
+    GROUP_REPAIR, // bad blocks asked for again
+    GROUP_OK
+};
+
+void merkleLeaf(const char *data, size_t len, unsigned char *digest) {
+    // leaves and inner nodes hash differently, so a block can't pass for a pair of hashes
+    struct sha256 c;
+    unsigned char tag = 0;
+    sha256Init(&c);
+    sha256Update(&c, &tag, 1);
+    sha256Update(&c, data, len);
+    sha256Final(&c, digest);
+}
+
+void merkleRoot(unsigned char (*leaf)[SHA256_LEN], unsigned long long n, unsigned char *digest) {
+    // root over n leaves, pairing up a level at a time, an odd one out moves up as it is. a group
+    // starts at a multiple of MERKLE_GROUP_LEAVES, a power of 2, so its root is a node of the whole tree
+    if (n == 0) {
+        sha256("", 0, digest);
+        return;
+    }
+    unsigned char (*level)[SHA256_LEN] = malloc(n * SHA256_LEN);
+    if (level == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for merkle tree\n");
+        exit(1);
+    }
+    memcpy(level, leaf, n * SHA256_LEN);
+    while (n > 1) {
+        for (unsigned long long i = 0; i < n / 2; i++) {
+            struct sha256 c;
+            unsigned char tag = 1;
+            sha256Init(&c);
+            sha256Update(&c, &tag, 1);
+            sha256Update(&c, level[i * 2], SHA256_LEN * 2); // left then right, they're adjacent
+            sha256Final(&c, level[i]);
+        }
+        if (n % 2 == 1) {
+            memmove(level[n / 2], level[n - 1], SHA256_LEN);
+        }
+        n = (n + 1) / 2;
+    }
+    memcpy(digest, level[0], SHA256_LEN);
+    free(level);
+}
+
+unsigned long long merkleLeaves(unsigned long long total_frag) {
+    return (total_frag + MERKLE_BLOCK_FRAGS - 1) / MERKLE_BLOCK_FRAGS;
+}
+
+struct merkle *merkleNew(unsigned long long leaves) {
+    struct merkle *m = malloc(sizeof(struct merkle));
+    if (m != NULL) {
+        memset(m, 0, sizeof *m);
+        m->leaves = leaves;
+        m->leaf = calloc(MAX(leaves, 1), SHA256_LEN);
+    }
+    if (m == NULL || m->leaf == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for merkle tree\n");
+        exit(1);
+    }
+    return m;
+}
+
+struct merkle *merkleBuild(const struct file_source *src, unsigned int frag_size) {
+    // the sender's side: every leaf and the root, read straight from the source
+    off_t block_size = (off_t) MERKLE_BLOCK_FRAGS * frag_size;
+    struct merkle *m = merkleNew(merkleLeaves(totalFrags(src->size, frag_size)));
+    m->frag_size = frag_size;
+    char *buf = src->map ? NULL : malloc(block_size);
+    for (unsigned long long i = 0; i < m->leaves; i++) {
+        off_t offset = i * block_size;
+        size_t len = MIN(block_size, src->size - offset);
+        const char *data = src->map ? src->map + offset : buf;
+        if (!src->map && (buf == NULL || sourceRead(src, buf, len, offset) == -1)) {
+            perror("pread");
+            exit(1);
+        }
+        merkleLeaf(data, len, m->leaf[i]);
+    }
+    free(buf);
+    merkleRoot(m->leaf, m->leaves, m->root);
+    return m;
+}
+
+void merkleFree(struct merkle *m) {
+    if (m == NULL) {
+        return;
+    }
+    free(m->leaf);
+    free((void *) m->hashed);
+    free(m->missing);
+    free(m->group_state);
+    free(m->group_asked);
+    free(m);
+}
+
+void merkleSetLeaf(struct merkle *m, unsigned long long block, const char *data, size_t len) {
+    // data is all of the block as it landed, the network thread can check it after this
+    merkleLeaf(data, len, m->leaf[block]);
+    atomic_store_explicit(&m->hashed[block], 1, memory_order_release);
+}
+
+void merkleHashBlock(struct merkle *m, int fd, unsigned long long block, off_t file_size) {
+    // reads a finished block back and hashes it, on the writer thread that's after its writes
+    off_t block_size = (off_t) MERKLE_BLOCK_FRAGS * m->frag_size;
+    off_t offset = block * block_size;
+    size_t len = MIN(block_size, file_size - offset);
+    char *buf = malloc(MAX(len, 1));
+    if (buf == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for merkle block\n");
+        exit(1);
+    }
+    if (pread(fd, buf, len, offset) != (ssize_t) len) {
+        perror("pread");
+        exit(1);
+    }
+    merkleSetLeaf(m, block, buf, len);
+    free(buf);
+}
+
+void merkleReceiverInit(struct receiver *r, const struct handshake *hs) {
+    struct merkle *m = merkleNew(merkleLeaves(r->total_frag));
+    m->frag_size = r->frag_size;
+    memcpy(m->root, hs->root, SHA256_LEN);
+    m->groups = (m->leaves + MERKLE_GROUP_LEAVES - 1) / MERKLE_GROUP_LEAVES;
+    m->hashed = calloc(MAX(m->leaves, 1), sizeof(atomic_uchar));
+    m->missing = calloc(MAX(m->leaves, 1), sizeof(unsigned long long));
+    m->group_state = calloc(MAX(m->groups, 1), 1);
+    m->group_asked = calloc(MAX(m->groups, 1), sizeof(struct timespec));
+    if (m->hashed == NULL || m->missing == NULL || m->group_state == NULL || m->group_asked == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for merkle tree\n");
+        exit(1);
+    }
+    m->verified = m->groups == 0; // nothing to check in an empty file
+    r->merkle = m;
+}
+
+void receiverHashBlock(struct receiver *r, unsigned long long block) {
+    // block is all here (again), get it hashed
+    atomic_store_explicit(&r->merkle->hashed[block], 0, memory_order_relaxed);
+    if (r->writer) {
+        writerHash(r->writer, r->fd, r->merkle, block, r->file_size);
+    } else {
+        merkleHashBlock(r->merkle, r->fd, block, r->file_size);
+    }
+}
+
+unsigned long long groupLeaves(const struct merkle *m, unsigned long long group) {
+    return MIN(MERKLE_GROUP_LEAVES, m->leaves - group * MERKLE_GROUP_LEAVES);
+}
+
+int groupReady(const struct receiver *r, unsigned long long group) {
+    // whether every block of group has arrived, which happens in order since cum_frag only moves forward
+    const struct merkle *m = r->merkle;
+    return r->cum_frag >= r->total_frag || (group * MERKLE_GROUP_LEAVES + groupLeaves(m, group)) * MERKLE_BLOCK_FRAGS <= r->cum_frag;
+}
+
+int groupRepaired(const struct merkle *m, unsigned long long group) {
+    for (unsigned long long i = group * MERKLE_GROUP_LEAVES; i < group * MERKLE_GROUP_LEAVES + groupLeaves(m, group); i++) {
+        if (m->missing[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void sendMerkleMsg(struct receiver *r, const char *msg, size_t len) {
+    sendMsg(r->sockfd, msg, len, (struct sockaddr *) &r->peer_addr, r->peer_addr_len);
+}
+
+void askGroup(struct receiver *r, unsigned long long group, struct timespec now) {
+    // "verify:<transfer_id>:<group>:<subtree root in hex>"
+    struct merkle *m = r->merkle;
+    unsigned char digest[SHA256_LEN];
+    merkleRoot(m->leaf + group * MERKLE_GROUP_LEAVES, groupLeaves(m, group), digest);
+    char msg[MAXBUFLEN];
+    int len = snprintf(msg, sizeof msg, "verify:%u:%llu:", r->transfer_id, group);
+    for (int i = 0; i < SHA256_LEN; i++) {
+        len += snprintf(msg + len, sizeof msg - len, "%02x", digest[i]);
+    }
+    sendMerkleMsg(r, msg, len + 1);
+    m->group_state[group] = GROUP_ASKED;
+    m->group_asked[group] = now;
+}
+
+void askRepairs(struct receiver *r, struct timespec now) {
+    // "resend:<transfer_id>:<frag_no>:<count>" for runs of fragments of bad blocks we don't have back
+    // yet, at most a window's worth at a time since the sender sends them all straight out
+    struct merkle *m = r->merkle;
+    unsigned int budget = r->window;
+    for (unsigned long long g = m->first_unverified; g < m->groups && budget > 0; g++) {
+        if (m->group_state[g] != GROUP_REPAIR) {
+            continue;
+        }
+        for (unsigned long long leaf = g * MERKLE_GROUP_LEAVES; leaf < g * MERKLE_GROUP_LEAVES + groupLeaves(m, g) && budget > 0; leaf++) {
+            for (unsigned int i = 0; i < MERKLE_BLOCK_FRAGS && budget > 0; ) {
+                if (!(m->missing[leaf] >> i & 1)) {
+                    i++;
+                    continue;
+                }
+                unsigned int run = 1;
+                while (i + run < MERKLE_BLOCK_FRAGS && run < budget && m->missing[leaf] >> (i + run) & 1) {
+                    run++;
+                }
+                char msg[MAXBUFLEN];
+                int len = snprintf(msg, sizeof msg, "resend:%u:%llu:%u", r->transfer_id, leaf * MERKLE_BLOCK_FRAGS + i + 1, run);
+                sendMerkleMsg(r, msg, len + 1);
+                i += run;
+                budget -= run;
+            }
+        }
+    }
+    m->repair_inflight = r->window - budget;
+    m->repair_asked = now;
+}
+
+int receiverRepairWanted(const struct receiver *r, unsigned long long frag_no) {
+    // whether frag_no is one we asked for again and haven't got yet
+    if (r->merkle == NULL || frag_no == 0 || frag_no > r->total_frag) {
+        return 0;
+    }
+    unsigned long long block = (frag_no - 1) / MERKLE_BLOCK_FRAGS;
+    return (r->merkle->missing[block] >> ((frag_no - 1) % MERKLE_BLOCK_FRAGS)) & 1;
+}
+
+int receiverRepairFrag(struct receiver *r, unsigned long long frag_no) {
+    // whether frag_no is one we asked for again, marks it back if so. the caller writes it
+    if (!receiverRepairWanted(r, frag_no)) {
+        return 0;
+    }
+    unsigned long long block = (frag_no - 1) / MERKLE_BLOCK_FRAGS;
+    r->merkle->missing[block] &= ~(1ULL << ((frag_no - 1) % MERKLE_BLOCK_FRAGS));
+    if (r->merkle->repair_inflight > 0) {
+        r->merkle->repair_inflight -= 1;
+    }
+    return 1;
+}
+
+void receiverRepairDone(struct receiver *r, unsigned long long frag_no) {
+    // after the caller wrote a repaired fragment: if that was the last one its block needed, hash it again
+    unsigned long long block = (frag_no - 1) / MERKLE_BLOCK_FRAGS;
+    if (r->merkle->missing[block] == 0) {
+        receiverHashBlock(r, block);
+    }
+}
+
+void receiverMerkleProgress(struct receiver *r, struct timespec now) {
+    // ask about groups that are all hashed, ask again about ones whose answer or repairs got lost,
+    // and once everything checks out, let the last ack go
+    struct merkle *m = r->merkle;
+    if (m == NULL || m->verified || m->failed) {
+        return;
+    }
+    while (m->first_unverified < m->groups && m->group_state[m->first_unverified] == GROUP_OK) {
+        m->first_unverified++;
+    }
+    int need_repairs = 0;
+    for (unsigned long long g = m->first_unverified; g < m->groups && groupReady(r, g); g++) {
+        unsigned long long first = g * MERKLE_GROUP_LEAVES;
+        int hashed = 1;
+        for (unsigned long long i = first; i < first + groupLeaves(m, g); i++) {
+            hashed &= atomic_load_explicit(&m->hashed[i], memory_order_acquire);
+        }
+        int repaired = groupRepaired(m, g);
+        if ((m->group_state[g] == GROUP_WAITING || m->group_state[g] == GROUP_REPAIR) && repaired && hashed) {
+            askGroup(r, g, now);
+        } else if (m->group_state[g] == GROUP_ASKED && get_time_diff(m->group_asked[g], now) >= MERKLE_RETRY_MS) {
+            askGroup(r, g, now);
+        }
+        need_repairs |= m->group_state[g] == GROUP_REPAIR && !repaired;
+    }
+    // next batch of repairs once the last one's in, or again if some of it got lost
+    if (need_repairs && (m->repair_inflight == 0 || get_time_diff(m->repair_asked, now) >= MERKLE_RETRY_MS)) {
+        askRepairs(r, now);
+    }
+
+    if (m->first_unverified == m->groups && r->cum_frag >= r->total_frag) {
+        unsigned char root[SHA256_LEN];
+        merkleRoot(m->leaf, m->leaves, root);
+        if (memcmp(root, m->root, SHA256_LEN) != 0) {
+            // every block matched the sender's leaves, so the leaves or the root were off and
+            // there's nothing left to ask for again. whoever runs the receiver drops the file
+            fprintf(stderr, "Error: merkle root from the handshake doesn't match the file's blocks\n");
+            m->failed = 1;
+            return;
+        }
+        m->verified = 1;
+        sendAck(r, 1, r->cum_frag, now); // the one we held back
+    }
+}
+
+int receiverMerkleFailed(const struct receiver *r) {
+    return r->merkle != NULL && r->merkle->failed;
+}
+
+double receiverMerkleTimeLeft(const struct receiver *r, struct timespec now) {
+    // ms until receiverMerkleProgress has something to do on its own: a hash the writer thread
+    // may have finished, or an answer or repair that may have got lost. MAX_TIMEOUT if nothing
+    const struct merkle *m = r->merkle;
+    double left = MAX_TIMEOUT;
+    if (m == NULL || m->verified || m->failed) {
+        return left;
+    }
+    for (unsigned long long g = m->first_unverified; g < m->groups && groupReady(r, g); g++) {
+        if (m->group_state[g] == GROUP_WAITING || (m->group_state[g] == GROUP_REPAIR && groupRepaired(m, g))) {
+            left = MIN(left, READ_AHEAD_RETRY_MS); // being hashed
+        } else if (m->group_state[g] == GROUP_REPAIR) {
+            left = MIN(left, MERKLE_RETRY_MS - get_time_diff(m->repair_asked, now));
+        } else if (m->group_state[g] == GROUP_ASKED) {
+            left = MIN(left, MERKLE_RETRY_MS - get_time_diff(m->group_asked[g], now));
+        }
+    }
+    return left;
+}
+
+void receiverOnTree(struct receiver *r, const char *buf, size_t len, struct timespec now) {
+    // "tree:<transfer_id>:<group>:<ok>:<count>:" then, if not ok, the sender's count leaves in binary
+    struct merkle *m = r->merkle;
+    char temp_buf[len + 1];
+    memcpy(temp_buf, buf, len);
+    temp_buf[len] = '\0';
+    unsigned int transfer_id, count;
+    unsigned long long group;
+    int ok, header_len = 0;
+    if (m == NULL || sscanf(temp_buf, "tree:%u:%llu:%d:%u:%n", &transfer_id, &group, &ok, &count, &header_len) != 4 || header_len == 0 ||
+            transfer_id != r->transfer_id || group >= m->groups || m->group_state[group] != GROUP_ASKED) {
+        return;
+    }
+    r->last_heard = now;
+    if (ok) {
+        m->group_state[group] = GROUP_OK;
+        receiverMerkleProgress(r, now);
+        return;
+    }
+    if (count != groupLeaves(m, group) || header_len + count * SHA256_LEN != len) {
+        return;
+    }
+
+    // ask again for every fragment of each block that doesn't match
+    unsigned long long first = group * MERKLE_GROUP_LEAVES;
+    for (unsigned int i = 0; i < count; i++) {
+        if (memcmp(m->leaf[first + i], buf + header_len + i * SHA256_LEN, SHA256_LEN) == 0) {
+            continue;
+        }
+        unsigned long long frags = MIN(MERKLE_BLOCK_FRAGS, r->total_frag - (first + i) * MERKLE_BLOCK_FRAGS);
+        m->missing[first + i] = frags == MERKLE_BLOCK_FRAGS ? ~0ULL : (1ULL << frags) - 1;
+        m->bad_blocks += 1;
+        printf("Block %llu failed verification, asking for it again\n", first + i);
+    }
+    m->group_state[group] = GROUP_REPAIR;
+    receiverMerkleProgress(r, now);
+}
+
+void senderOnVerify(struct sender *s, const char *buf, size_t len) {
+    // check the receiver's subtree root for a group against ours, send our leaves if it's wrong
+    char temp_buf[len + 1];
+    memcpy(temp_buf, buf, len);
+    temp_buf[len] = '\0';
+    unsigned int transfer_id;
+    unsigned long long group;
+    char hex[SHA256_LEN * 2 + 1];
+    if (s->merkle == NULL || sscanf(temp_buf, "verify:%u:%llu:%64s", &transfer_id, &group, hex) != 3 || transfer_id != s->transfer_id ||
+            group * MERKLE_GROUP_LEAVES >= s->merkle->leaves) {
+        return;
+    }
+    s->timeouts = 0; // the receiver's still there, it's just not done checking
+    unsigned long long first = group * MERKLE_GROUP_LEAVES;
+    unsigned int count = MIN(MERKLE_GROUP_LEAVES, s->merkle->leaves - first);
+    unsigned char digest[SHA256_LEN];
+    char digest_hex[SHA256_LEN * 2 + 1];
+    merkleRoot(s->merkle->leaf + first, count, digest);
+    for (int i = 0; i < SHA256_LEN; i++) {
+        snprintf(digest_hex + i * 2, 3, "%02x", digest[i]);
+    }
+    int ok = strcmp(hex, digest_hex) == 0;
+
+    char msg[MAXBUFLEN];
+    size_t msg_len = snprintf(msg, sizeof msg, "tree:%u:%llu:%d:%u:", s->transfer_id, group, ok, count);
+    if (!ok) {
+        memcpy(msg + msg_len, s->merkle->leaf[first], count * SHA256_LEN);
+        msg_len += count * SHA256_LEN;
+    }
+    senderSend(s, msg, msg_len);
+}
+
+void senderOnResend(struct sender *s, const char *buf, size_t len) {
+    // fragments the receiver asked for again, straight out, they were already counted in flight once
+    char temp_buf[len + 1];
+    memcpy(temp_buf, buf, len);
+    temp_buf[len] = '\0';
+    unsigned int transfer_id, count;
+    unsigned long long frag_no;
+    if (sscanf(temp_buf, "resend:%u:%llu:%u", &transfer_id, &frag_no, &count) != 3 || transfer_id != s->transfer_id ||
+            s->merkle == NULL || frag_no == 0 || count > MERKLE_BLOCK_FRAGS || frag_no + count - 1 > s->total_frag || frag_no + count > s->next_frag) {
+        return;
+    }
+    s->timeouts = 0;
+    while (count > 0) {
+        unsigned int sent = sendFragment(s, frag_no, count);
+        frag_no += sent;
+        count -= sent;
+        s->repaired_frags += sent;
+    }
+}
+
+int merkleMsg(const char *buf, unsigned int *transfer_id) {
+    // which merkle message buf is (MERKLE_VERIFY, MERKLE_TREE, MERKLE_RESEND), -1 if it isn't one
+    char tag[8];
+    if (sscanf(buf, "%7[a-z]:%u", tag, transfer_id) != 2) {
+        return -1;
+    }
+    if (strcmp(tag, "verify") == 0) {
+        return MERKLE_VERIFY;
+    } else if (strcmp(tag, "tree") == 0) {
+        return MERKLE_TREE;
+    } else if (strcmp(tag, "resend") == 0) {
+        return MERKLE_RESEND;
+    }
+    return -1;
+}
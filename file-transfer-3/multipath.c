@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "transfer.h"
+
+// multipath uploads: one window, one sequence of fragments, several sockets to send them on.
+// congestion control still runs over the whole thing, this only decides which path each
+// fragment takes and notices when one stops delivering. a path that loses PATH_DOWN_LOSSES in
+// a row without a single fragment getting through is down: whatever's in flight on it goes out
+// again on the others straight away instead of a hole per round trip, and it's left alone for
+// PATH_RETRY_MS before it gets one fragment at a time to see whether it's back
+
+void pathsInit(struct sender *s, struct path *paths, int num_paths) {
+    // RTTs carry over from the session's last transfer, everything else starts over
+    s->paths = paths;
+    s->num_paths = num_paths;
+    s->sockfd = paths[0].sockfd;
+    for (int i = 0; i < num_paths; i++) {
+        paths[i].state = PATH_UP;
+        paths[i].probing = 0;
+        paths[i].loss = 0;
+        paths[i].inflight = 0;
+        paths[i].losses_in_row = 0;
+        paths[i].sent = 0;
+        paths[i].lost = 0;
+    }
+    for (int i = 0; i < MAX_WINDOW; i++) {
+        s->window[i].path = NO_PATH;
+    }
+}
+
+int pathPick(const struct sender *s, int avoid) {
+    // the path that should get one more fragment there soonest: what's already queued on it
+    // plus this one, a round trip, and all of that again for each time it gets lost. one with
+    // nothing in flight goes first though, a path we stop sending on never gets a new RTT sample
+    // to make it look any better (or a loss to show it's gone). a retransmit stays off avoid,
+    // the path the lost copy went on, unless nothing else is up
+    int best = -1;
+    double best_cost = 0;
+    for (int pass = 0; pass < 2 && best == -1; pass++) {
+        for (int i = 0; i < s->num_paths; i++) {
+            const struct path *p = &s->paths[i];
+            if (p->state != PATH_UP || (pass == 0 && i == avoid) || (p->probing && p->inflight > 0)) {
+                continue;
+            }
+            double rtt = p->srtt > 0 ? p->srtt : s->estimatedRTT;
+            double cost = p->inflight == 0 ? 0 : (p->inflight + 1) * rtt / (1 - MIN(p->loss, 0.9));
+            if (best == -1 || cost < best_cost) {
+                best = i;
+                best_cost = cost;
+            }
+        }
+    }
+    return best == -1 ? 0 : best; // every socket's erroring, keep trying the first
+}
+
+int anotherPathUp(const struct sender *s, int p) {
+    for (int i = 0; i < s->num_paths; i++) {
+        if (i != p && s->paths[i].state == PATH_UP) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int pathSend(struct sender *s, int p, const void *msg, size_t len) {
+    // -1 if the socket wouldn't take it (address gone, no route), the path's failed then
+    struct path *path = &s->paths[p];
+    if (sendto(path->sockfd, msg, len, 0, (struct sockaddr *) &s->peer_addr, s->peer_addr_len) == -1) {
+        if (path->state == PATH_UP) {
+            fprintf(stderr, "path %s: sendto: %s\n", path->name, strerror(errno));
+            path->state = PATH_FAILED;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void pathLost(struct sender *s, int p, const struct frag_state *fs) {
+    struct path *path = &s->paths[p];
+    path->inflight -= 1;
+    path->lost += 1;
+    path->loss = (1 - PATH_LOSS_GAIN) * path->loss + PATH_LOSS_GAIN;
+    // a hole record is one datagram for lots of fragments, and a burst can go in one drop, so
+    // what went out at the same moment only counts once towards taking the path down
+    if (get_time_diff(path->last_loss, fs->sent_time) != 0) {
+        path->losses_in_row += 1;
+        path->last_loss = fs->sent_time;
+    }
+    // the last path standing stays up whatever it loses, there's nowhere else to send
+    if (path->state == PATH_UP && (path->losses_in_row >= PATH_DOWN_LOSSES || path->probing) && anotherPathUp(s, p)) {
+        path->state = PATH_FAILED;
+    }
+}
+
+void pathSent(struct sender *s, unsigned long long frag_no, int p) {
+    struct frag_state *fs = &s->window[frag_no % MAX_WINDOW];
+    if (fs->path != NO_PATH) { // going out again, so its last copy got lost as far as we know
+        pathLost(s, fs->path, fs);
+    }
+    fs->path = p;
+    s->paths[p].inflight += 1;
+    s->paths[p].sent += 1;
+}
+
+void pathAcked(struct sender *s, struct frag_state *fs, double rtt) {
+    // fs just got acked, rtt is its sample or < 0 if it didn't give one
+    if (fs->path == NO_PATH) {
+        return;
+    }
+    struct path *path = &s->paths[fs->path];
+    path->inflight -= 1;
+    if (!fs->retransmitted) { // only sent once, so this path got it there
+        path->losses_in_row = 0;
+        path->probing = 0;
+        path->loss *= 1 - PATH_LOSS_GAIN;
+        if (rtt >= 0) {
+            path->srtt = path->srtt > 0 ? 0.875 * path->srtt + 0.125 * rtt : rtt;
+        }
+    }
+    fs->path = NO_PATH;
+}
+
+void pathForget(struct sender *s, struct frag_state *fs) {
+    // the receiver threw fs away without it being anyone's fault, see senderRestart
+    if (fs->path != NO_PATH) {
+        s->paths[fs->path].inflight -= 1;
+        fs->path = NO_PATH;
+    }
+}
+
+void pathsCheck(struct sender *s, struct timespec now) {
+    // take paths that just failed out of use, and give ones that have been down a while another go
+    for (int i = 0; i < s->num_paths; i++) {
+        struct path *path = &s->paths[i];
+        if (path->state == PATH_FAILED) {
+            printf("PATH %s DOWN, moving %u fragments in flight on it\n", path->name, path->inflight);
+            path->state = PATH_DOWN;
+            path->probing = 0;
+            path->down_since = now;
+            for (unsigned long long f = s->base; f < s->next_frag && path->inflight > 0; f++) {
+                struct frag_state *fs = &s->window[f % MAX_WINDOW];
+                if (fs->path == i) {
+                    sendFragment(s, f, 1);
+                    fs->retransmitted = 1;
+                    s->rerouted_frags += 1;
+                }
+            }
+        } else if (path->state == PATH_DOWN && get_time_diff(path->down_since, now) >= PATH_RETRY_MS) {
+            printf("PATH %s retrying\n", path->name);
+            path->state = PATH_UP;
+            path->probing = 1;
+            path->losses_in_row = 0;
+        }
+    }
+}
@@ -0,0 +1,170 @@
+#include "transfer.h"
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+// path MTU discovery with our own datagrams instead of ICMP, which plenty of firewalls eat. the
+// client sends "probe:<size>:" padded out so the IP packet is size bytes, with DF set so nothing
+// on the way can fragment it, and the server answers "probeack:<size>:" padded to the same
+// length, so an answer means packets that big get through both ways. the biggest that does sets
+// the fragment size for the session's transfers (see sessionFragSize). the path can still shrink
+// in the middle of one, the sender notices the timeouts and splits fragments into parts
+
+unsigned int pmtuOverhead(int family) {
+    // IP and UDP headers, on top of what we put in a datagram
+    return family == AF_INET6 ? 48 : 28;
+}
+
+void pmtuAnswer(int sockfd, const char *buf, size_t len, const struct sockaddr *addr, socklen_t addr_len) {
+    // server side. no state, and never more back than what came in
+    unsigned int size;
+    char msg[MAXBUFLEN];
+    if (sscanf(buf, "probe:%u:", &size) != 1 || len > sizeof msg) {
+        return;
+    }
+    memset(msg, 0, len);
+    int n = snprintf(msg, len, "probeack:%u:", size);
+    if (n < 0 || (size_t) n >= len) { // too short to be a real probe
+        return;
+    }
+    sendMsg(sockfd, msg, len, addr, addr_len);
+}
+
+unsigned int routeMTU(const struct sockaddr *addr, socklen_t addr_len) {
+    // what the kernel thinks the path MTU is, from the interface or ICMP it's seen. MAX_PLPMTU if it won't say
+    int fd = socket(addr->sa_family, SOCK_DGRAM, 0);
+    int mtu = MAX_PLPMTU;
+    socklen_t optlen = sizeof mtu;
+    if (fd == -1 || connect(fd, addr, addr_len) == -1 ||
+        getsockopt(fd, addr->sa_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP, addr->sa_family == AF_INET6 ? IPV6_MTU : IP_MTU, &mtu, &optlen) == -1) {
+        mtu = MAX_PLPMTU;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return mtu;
+}
+
+void sendProbe(int sockfd, const struct sockaddr *addr, socklen_t addr_len, struct pmtu_probe *probe, struct timespec now) {
+    char msg[MAXBUFLEN];
+    size_t len = probe->size - pmtuOverhead(addr->sa_family);
+    memset(msg, 0, len);
+    snprintf(msg, len, "probe:%u:", probe->size);
+    probe->tries += 1;
+    probe->sent = now;
+    if (sendto(sockfd, msg, len, 0, addr, addr_len) == -1) {
+        if (errno != EMSGSIZE && !unreachable(errno)) {
+            perror("sendto");
+            exit(1);
+        }
+        probe->acked = errno == EMSGSIZE ? -1 : 0; // bigger than our own interface takes, no need to wait
+    }
+}
+
+void probeRound(int sockfd, const struct sockaddr *addr, socklen_t addr_len, struct pmtu_probe *probes, int n, double *timeout_ms) {
+    // sends every probe, again if it goes unanswered, until each is acked or has failed PMTU_PROBES
+    // times. a size below one that's been acked needn't be settled. the first answer gives an
+    // RTT, and the timeout comes down to a few of those
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < n; i++) {
+        sendProbe(sockfd, addr, addr_len, &probes[i], now);
+    }
+    while (1) {
+        unsigned int best = 0;
+        for (int i = 0; i < n; i++) {
+            best = probes[i].acked == 1 ? MAX(best, probes[i].size) : best;
+        }
+        double wait_ms = -1;
+        for (int i = 0; i < n; i++) {
+            if (probes[i].acked == 0 && probes[i].size > best) {
+                double left = *timeout_ms - get_time_diff(probes[i].sent, now);
+                wait_ms = wait_ms < 0 ? MAX(left, 0) : MIN(wait_ms, MAX(left, 0));
+            }
+        }
+        if (wait_ms < 0) { // all settled
+            return;
+        }
+
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        int ready = poll(&pfd, 1, (int) wait_ms + 1);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        char buf[MAXBUFLEN];
+        int numbytes = ready > 0 ? recv(sockfd, buf, MAXBUFLEN - 1, MSG_DONTWAIT) : -1;
+        unsigned int size;
+        if (numbytes > 0) {
+            buf[numbytes] = '\0';
+        }
+        // anything else is left over from an earlier transfer
+        if (numbytes > 0 && sscanf(buf, "probeack:%u:", &size) == 1 && numbytes + pmtuOverhead(addr->sa_family) == size) {
+            for (int i = 0; i < n; i++) {
+                if (probes[i].size == size && probes[i].acked == 0) {
+                    if (probes[i].tries == 1) {
+                        *timeout_ms = MIN(*timeout_ms, MAX(PMTU_PROBE_MIN_MS, 3 * get_time_diff(probes[i].sent, now)));
+                    }
+                    probes[i].acked = 1;
+                }
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            if (probes[i].acked == 0 && get_time_diff(probes[i].sent, now) >= *timeout_ms) {
+                if (probes[i].tries < PMTU_PROBES) {
+                    sendProbe(sockfd, addr, addr_len, &probes[i], now);
+                } else {
+                    probes[i].acked = -1;
+                }
+            }
+        }
+    }
+}
+
+unsigned int pmtuSearch(int sockfd, const struct sockaddr *addr, socklen_t addr_len, double timeout_ms) {
+    // biggest IP packet, BASE_PLPMTU to MAX_PLPMTU, that gets from sockfd to the server and back.
+    // 0 if even BASE_PLPMTU doesn't, most likely a server too old to answer probes. the first
+    // round tries the ends, which is all it takes on most paths, and each round after probes
+    // PMTU_LADDER sizes between what works and what doesn't at once
+    int v6 = addr->sa_family == AF_INET6;
+    int level = v6 ? IPPROTO_IPV6 : IPPROTO_IP, opt = v6 ? IPV6_MTU_DISCOVER : IP_MTU_DISCOVER;
+    int probe_mode = v6 ? IPV6_PMTUDISC_PROBE : IP_PMTUDISC_PROBE; // DF, and don't let what the kernel thinks stop us
+    int old_mode;
+    socklen_t optlen = sizeof old_mode;
+    if (getsockopt(sockfd, level, opt, &old_mode, &optlen) == -1 || setsockopt(sockfd, level, opt, &probe_mode, sizeof probe_mode) == -1) {
+        perror("setsockopt IP_MTU_DISCOVER");
+        return 0;
+    }
+
+    unsigned int top = MAX(MIN(routeMTU(addr, addr_len), MAX_PLPMTU), BASE_PLPMTU);
+    unsigned int good = 0, bad = top + 1; // biggest that got through, smallest that didn't
+    struct pmtu_probe probes[PMTU_LADDER];
+    int n = 0;
+    probes[n++] = (struct pmtu_probe) {BASE_PLPMTU, 0, {0, 0}, 0};
+    if (top > BASE_PLPMTU) {
+        probes[n++] = (struct pmtu_probe) {top, 0, {0, 0}, 0};
+    }
+    while (n > 0) {
+        probeRound(sockfd, addr, addr_len, probes, n, &timeout_ms);
+        for (int i = 0; i < n; i++) {
+            good = probes[i].acked == 1 ? MAX(good, probes[i].size) : good;
+        }
+        for (int i = 0; i < n; i++) { // one lost three times over below one that made it doesn't count
+            bad = probes[i].acked == -1 && probes[i].size > good ? MIN(bad, probes[i].size) : bad;
+        }
+        if (good == 0 || bad - good <= PMTU_STEP) {
+            break;
+        }
+        n = 0;
+        for (int i = 1; i <= PMTU_LADDER; i++) {
+            unsigned int size = good + (unsigned long) (bad - good) * i / (PMTU_LADDER + 1);
+            if (size > good && size < bad && (n == 0 || size > probes[n - 1].size)) {
+                probes[n++] = (struct pmtu_probe) {size, 0, {0, 0}, 0};
+            }
+        }
+    }
+
+    setsockopt(sockfd, level, opt, &old_mode, sizeof old_mode);
+    return good;
+}
@@ -0,0 +1,90 @@
+#include "transfer.h"
+#include <unistd.h>
+#include <errno.h>
+
+// read-ahead for a sender: a thread reads fragments in order into a ring, the send loop takes
+// them from there and never blocks on the disk for new data. same single-producer,
+// single-consumer setup as the writer, with the roles swapped: here the disk thread produces
+// and sleeps when the ring is full
+
+void *readerLoop(void *arg);
+
+struct reader *readerStart(const struct file_source *src, unsigned int frag_size, unsigned long long total_frag, off_t bytes) {
+    struct reader *r = malloc(sizeof(struct reader));
+    if (r == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for reader\n");
+        exit(1);
+    }
+    memset(r, 0, sizeof *r);
+    r->src = src;
+    r->frag_size = frag_size;
+    r->total_frag = total_frag;
+    r->slots = MAX(bytes / frag_size, MAX_WINDOW); // at least a full window's worth
+    r->bufs = malloc(r->slots * frag_size);
+    if (r->bufs == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for read-ahead buffers\n");
+        exit(1);
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->sleeping, 0);
+    atomic_init(&r->stop, 0);
+    sem_init(&r->wake, 0, 0);
+    if (pthread_create(&r->thread, NULL, readerLoop, r) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    return r;
+}
+
+const char *readerGet(struct reader *r, unsigned long long frag_no) {
+    // NULL if the reader hasn't got to frag_no yet. frag_no must not be released already
+    if (frag_no > atomic_load_explicit(&r->head, memory_order_acquire)) {
+        return NULL;
+    }
+    return r->bufs + ((frag_no - 1) % r->slots) * r->frag_size;
+}
+
+void readerRelease(struct reader *r, unsigned long long frags) {
+    // the sender is done with the next frags fragments, their slots can be read into again.
+    // store then load, like the writer, so a reader going to sleep can't miss this
+    atomic_fetch_add(&r->tail, frags);
+    if (atomic_load(&r->sleeping)) {
+        sem_post(&r->wake);
+    }
+}
+
+void readerStop(struct reader *r) {
+    atomic_store(&r->stop, 1);
+    sem_post(&r->wake);
+    pthread_join(r->thread, NULL);
+    sem_destroy(&r->wake);
+    free(r->bufs);
+    free(r);
+}
+
+void *readerLoop(void *arg) {
+    struct reader *r = arg;
+    unsigned long long head = 0;
+    while (head < r->total_frag && !atomic_load(&r->stop)) {
+        if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == r->slots) { // full
+            atomic_store(&r->sleeping, 1);
+            if (head - atomic_load(&r->tail) == r->slots && !atomic_load(&r->stop)) {
+                sem_wait(&r->wake);
+            }
+            atomic_store(&r->sleeping, 0);
+            continue;
+        }
+
+        off_t offset = (off_t) head * r->frag_size;
+        size_t size = MIN((off_t) r->frag_size, r->src->size - offset);
+        char *buf = r->bufs + (head % r->slots) * r->frag_size;
+        if (sourceRead(r->src, buf, size, offset) == -1) {
+            perror("pread");
+            exit(1);
+        }
+        head += 1;
+        atomic_store_explicit(&r->head, head, memory_order_release); // fragment head is ready
+    }
+    return NULL;
+}
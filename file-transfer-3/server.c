@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // for O_DIRECT
 #include <stdio.h>
 #include <stdlib.h>     
 #include <string.h>     
@@ -5,149 +6,981 @@
 #include <arpa/inet.h> 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <math.h>
+#include <stdint.h>
+#include "transfer.h"
 
-
-#define MAXBUFLEN 1500
-#define FRAG_SIZE 1000
+#define MAX_TRANSFERS 64 // uploads and downloads we serve at once
+#define RECENT_TRANSFERS 16 // finished uploads we still re-ack stragglers for
+#define MAX_BATCH 64 // datagrams handled per wakeup before we check timers again
+#define COOKIE_EPOCH_S 30 // cookies are good for this long to a bit under twice it
+#define COOKIE_HANDSHAKE_RATE 64 // new handshakes a second before we want cookies with them...
+#define COOKIE_BUSY_TRANSFERS (MAX_TRANSFERS / 2) // ...or once this many transfers are running
+#define COOKIE_RETRY_RATE 8 // most retries a second to one address and port, past that its handshakes are dropped
+#define RETRY_SOURCES 4096 // sources we count retries for, ones that hash to the same slot share a count
 
 // credits: some of this code is adapted from beej's handbook, mainly section 6.3
 
-struct packet {
-    unsigned int total_frag;
-    unsigned int frag_no;
-    unsigned int size;
-    char *filename;
-    char filedata[1000];
+// files being downloaded, mapped once and shared by every download of the same file
+struct cached_file {
+    char filename[MAX_FILENAME];
+    dev_t dev;
+    ino_t ino; // an upload replaces the file with a new inode, so later downloads map the new version
+    struct file_source src;
+    struct merkle *merkle; // built by the first download that asks for it
+    int refs;
+    struct cached_file *next;
+};
+
+struct cached_file *cache_list = NULL;
+
+struct transfer {
+    int in_use;
+    int is_get; // 1: client downloads from us (we run the sender), 0: client uploads (we run the receiver)
+    struct handshake hs; // negotiated values, resent if the client repeats its handshake
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
+    struct sender snd; // get only
+    struct cached_file *cache; // get only
+    struct receiver rcv; // ftp only
+    int out_fd; // ftp and mcast
+    int is_mcast; // upload to a multicast group we joined, rcv isn't used
+    struct mcast_receiver mrcv;
+    char part_filename[MAX_FILENAME + 8]; // ftp only, renamed over the real name once complete
+    int to_pipe; // ftp into a named pipe that was already there, written in order as it arrives instead
+    struct timespec started; // ftp only
+    // ftp only: source addresses acks may go to, the one it started from and any that answered a
+    // challenge since. data from anywhere else is taken but doesn't move the acks, see checkPath
+    struct sockaddr_storage paths[MAX_PATHS];
+    int num_paths;
+    struct timespec challenged; // when we last sent one
+    double grant_carry; // ftp only, bytes of rate limit share too small to make a whole fragment of window yet
+    int publishing; // ftp only, the writer thread's putting it under its real name and the last ack waits on that
+    atomic_int published; // set by the writer thread once it's there
 };
 
-struct ackpkt {
-    unsigned int ack_nack; // 1 for ack, 0 for nack
-    unsigned int frag_no;
+struct transfer transfers[MAX_TRANSFERS];
+
+// finished uploads, so a sender whose last ack got lost can still be acked
+struct finished_transfer {
+    unsigned int transfer_id;
+    unsigned long long total_frag;
 };
 
-size_t serializeAck(const struct ackpkt *ackpkt, char *dest_buf, size_t buf_size) {
-    // returns length of serialized data, including terminating null char
-    // serialized data will be null-terminated
-    return 1 + snprintf(dest_buf, buf_size, "%u:%u", ackpkt->ack_nack, ackpkt->frag_no);
+struct finished_transfer recent_transfers[RECENT_TRANSFERS];
+int recent_next = 0;
+
+// uploads go to disk through here unless the server runs with "inline", then it's NULL and
+// the event loop pwrites them itself
+struct writer *disk_writer = NULL;
+
+// how far ahead of the window downloads get read, in bytes
+off_t read_ahead = (off_t) READ_AHEAD_MB << 20;
+
+// "dedup": uploads are kept as recipes over a shared chunk store, and clients can skip chunks we have
+int dedup = 0;
+
+// "mcast=<group>": we also take uploads multicast to that group on our port
+int mcast = 0;
+
+// "direct": uploads go to disk with O_DIRECT in whole aligned blocks, so a big one doesn't fill
+// the page cache and stall everything else on the box in writeback. see writer.c
+int direct = 0;
+
+// address validation, like SYN cookies: a cookie is a hash of the client's address under a
+// secret only we know, so checking one takes no state. "cookies" asks for them on every new
+// transfer, otherwise only once handshakes come in faster than real clients send them
+int cookies_always = 0;
+unsigned char cookie_secret[32];
+long handshake_second; // new handshakes so far in this second
+unsigned int handshake_count;
+unsigned long long retries_sent, retries_dropped;
+struct retry_source {
+    unsigned long long key; // ip << 16 | port
+    long second;
+    unsigned int count;
+} retry_sources[RETRY_SOURCES];
+
+// "rate=<MB/s>" and "clientrate=<MB/s>": how fast uploads may come in, all of them together and
+// from each client (by ip), in bytes per ms. 0 for no limit. every RATE_TICK_MS the bandwidth that
+// came due is shared out between uploads as window, fairly between clients and then between
+// each client's uploads, so a small upload gets its share even next to a huge one
+double upload_rate = 0, client_rate = 0;
+struct timespec last_grant;
+
+// "idle=<s>": how long an upload's client can go quiet before we give up on it, close the file
+// and delete the .part. IDLE_TIMEOUT unless set
+double idle_ms = IDLE_TIMEOUT;
+
+struct cached_file *acquireFile(const char *filename) {
+    // returns NULL if the file can't be served
+    struct stat st;
+    if (stat(filename, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+
+    struct cached_file *current = cache_list;
+    while (current != NULL) {
+        if (strcmp(current->filename, filename) == 0 && current->dev == st.st_dev && current->ino == st.st_ino) {
+            current->refs += 1;
+            return current;
+        }
+        current = current->next;
+    }
+
+    struct cached_file *cf = malloc(sizeof(struct cached_file));
+    if (cf == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for cached_file\n");
+        exit(1);
+    }
+    memset(cf, 0, sizeof *cf);
+    strncpy(cf->filename, filename, MAX_FILENAME - 1);
+    cf->dev = st.st_dev;
+    cf->ino = st.st_ino;
+    cf->src.fd = open(filename, O_RDONLY);
+    if (cf->src.fd == -1) {
+        free(cf);
+        return NULL;
+    }
+    cf->src.size = st.st_size;
+    cf->src.recipe = recipeLoad(cf->src.fd); // uploaded to a dedup server, the file's in the chunk store
+    if (cf->src.recipe) {
+        cf->src.size = cf->src.recipe->size;
+    } else if (cf->src.size > 0 && (unsigned long long) cf->src.size <= SIZE_MAX) { // can't mmap an empty file, or one bigger than our address space
+        void *map = mmap(NULL, cf->src.size, PROT_READ, MAP_SHARED, cf->src.fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+        } else {
+            cf->src.map = map; // otherwise we fall back to pread on the fd
+        }
+    }
+    cf->refs = 1;
+    cf->next = cache_list;
+    cache_list = cf;
+    return cf;
 }
 
-void deserializePkt(const char *src_buf, size_t buf_size, struct packet *pkt) {
-    char temp_buf[buf_size + 1];
-    memcpy(temp_buf, src_buf, buf_size);
-    temp_buf[buf_size] = '\0'; // bc strtok needs null terminated
+void releaseFile(struct cached_file *cf) {
+    cf->refs -= 1;
+    if (cf->refs > 0) {
+        return;
+    }
 
-    char *field = strtok(temp_buf, ":");
-    pkt->total_frag = atoi(field);
-    field = strtok(NULL, ":");
-    pkt->frag_no = atoi(field);
-    field = strtok(NULL, ":");
-    pkt->size = atoi(field);
-    field = strtok(NULL, ":");
-    pkt->filename = strdup(field); // rmb to free this later
+    struct cached_file **link = &cache_list;
+    while (*link != cf) {
+        link = &(*link)->next;
+    }
+    *link = cf->next;
+
+    if (cf->src.map) {
+        munmap((void *) cf->src.map, cf->src.size);
+    }
+    manifestFree(cf->src.recipe);
+    merkleFree(cf->merkle);
+    close(cf->src.fd);
+    free(cf);
+}
 
-    size_t end_of_header = strlen(field) + 1; // bc strtok replaces colons with null char
-    memcpy(pkt->filedata, field + end_of_header, pkt->size);
+int validFilename(const char *filename) {
+    // clients only get to touch files in the directory we run in
+    return filename[0] != '\0' && strchr(filename, '/') == NULL && strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0;
 }
 
 int recvMsg(int sockfd, char *recv_buf, struct sockaddr_storage *client_addr_ptr, socklen_t *client_addr_len_ptr) {
     // here we also return the client addr info thru the pointers
+    // doesn't block, returns -1 if nothing is queued
     int numbytes;
-    numbytes = recvfrom(sockfd, recv_buf, MAXBUFLEN - 1, 0, (struct sockaddr *) client_addr_ptr, client_addr_len_ptr);
+    *client_addr_len_ptr = sizeof(struct sockaddr_storage);
+    numbytes = recvfrom(sockfd, recv_buf, MAXBUFLEN - 1, MSG_DONTWAIT, (struct sockaddr *) client_addr_ptr, client_addr_len_ptr);
 
     if (numbytes == -1) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return -1;
+        }
         perror("recvfrom");
         exit(1);
     }
 
+    recv_buf[numbytes] = '\0'; // handshakes and acks we know should be strings
     return numbytes;
 }
 
-void sendMsg(int sockfd, const char *msg, size_t len, struct sockaddr *client_addr_ptr, socklen_t client_addr_len) {
-    // msg may not be a string
-    int numbytes;
-    numbytes = sendto(sockfd, msg, len, 0, client_addr_ptr, client_addr_len);
+void sendReply(int sockfd, const char *tag, const struct handshake *hs, struct sockaddr *client_addr_ptr, socklen_t client_addr_len) {
+    char send_buf[MAXBUFLEN];
+    size_t send_len = serializeHandshake(tag, hs, send_buf, MAXBUFLEN);
+    printf(">>> replying with %s\n", send_buf);
+    sendMsg(sockfd, send_buf, send_len, client_addr_ptr, client_addr_len);
+}
 
-    if (numbytes == -1) {
-        perror("sendto");
-        exit(1);
+void sendNo(int sockfd, struct sockaddr *client_addr_ptr, socklen_t client_addr_len) {
+    char *send_buf = "no";
+    printf(">>> replying with no\n");
+    sendMsg(sockfd, send_buf, strlen(send_buf), client_addr_ptr, client_addr_len);
+}
+
+unsigned long long makeCookie(const struct sockaddr *addr, long epoch) {
+    // first 8 bytes of SHA-256(secret, client ip and port, epoch), never 0 since that means none
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) addr;
+    struct sha256 c;
+    unsigned char digest[SHA256_LEN];
+    sha256Init(&c);
+    sha256Update(&c, cookie_secret, sizeof cookie_secret);
+    sha256Update(&c, &sin->sin_addr, sizeof sin->sin_addr);
+    sha256Update(&c, &sin->sin_port, sizeof sin->sin_port);
+    sha256Update(&c, &epoch, sizeof epoch);
+    sha256Final(&c, digest);
+    unsigned long long cookie = 0;
+    for (int i = 0; i < 8; i++) {
+        cookie = cookie << 8 | digest[i];
     }
+    return cookie ? cookie : 1;
 }
 
-void recvFile(int sockfd, int verbose) {
+int sameAddr(const struct sockaddr *a, const struct sockaddr *b) {
+    // ipv4 only, like everything else here
+    const struct sockaddr_in *x = (const struct sockaddr_in *) a, *y = (const struct sockaddr_in *) b;
+    return x->sin_addr.s_addr == y->sin_addr.s_addr && x->sin_port == y->sin_port;
+}
 
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len = sizeof client_addr;
-    struct packet pkt = {0};
-    char recv_buf[MAXBUFLEN];
+long cookieEpoch(struct timespec now) {
+    return now.tv_sec / COOKIE_EPOCH_S;
+}
 
-    FILE *file = NULL;
-    char *recv_filename = NULL;
-    unsigned int expected_frag_no;
+int cookieValid(unsigned long long cookie, const struct sockaddr *addr, struct timespec now) {
+    // one from this epoch or the last
+    long epoch = cookieEpoch(now);
+    return cookie != 0 && (cookie == makeCookie(addr, epoch) || cookie == makeCookie(addr, epoch - 1));
+}
 
+int wantCookie(struct timespec now) {
+    // whether a new transfer has to come with a cookie, called once per handshake that'd start one
+    if (now.tv_sec != handshake_second) {
+        if (retries_sent > 0) {
+            printf(">>> asked %llu handshakes to retry with a cookie, dropped %llu more\n", retries_sent, retries_dropped);
+        }
+        handshake_second = now.tv_sec;
+        handshake_count = 0;
+        retries_sent = 0;
+        retries_dropped = 0;
+    }
+    handshake_count += 1;
+    int running = 0;
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        running += transfers[i].in_use;
+    }
+    return cookies_always || handshake_count > COOKIE_HANDSHAKE_RATE || running >= COOKIE_BUSY_TRANSFERS;
+}
 
-    while (1) {
-        recvMsg(sockfd, recv_buf, &client_addr, &client_addr_len);
+void sendRetry(int sockfd, unsigned int transfer_id, struct sockaddr *client_addr_ptr, socklen_t client_addr_len, struct timespec now) {
+    // no logging per retry, a flood of them is exactly when we can't afford it. a retry is shorter
+    // than the handshake that asked for it so there's nothing to amplify, but one source still
+    // only gets COOKIE_RETRY_RATE a second, a real client sends its handshake again on a timeout
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) client_addr_ptr;
+    unsigned long long key = (unsigned long long) sin->sin_addr.s_addr << 16 | sin->sin_port;
+    struct retry_source *rs = &retry_sources[((key * 0x9e3779b97f4a7c15ULL) >> 32) % RETRY_SOURCES];
+    if (rs->key != key || rs->second != now.tv_sec) {
+        rs->key = key;
+        rs->second = now.tv_sec;
+        rs->count = 0;
+    }
+    if (rs->count >= COOKIE_RETRY_RATE) {
+        retries_dropped += 1;
+        return;
+    }
+    rs->count += 1;
+    unsigned long long cookie = makeCookie(client_addr_ptr, cookieEpoch(now));
+    char send_buf[64];
+    int send_len = snprintf(send_buf, sizeof send_buf, "retry:%u:%llx", transfer_id, cookie);
+    sendMsg(sockfd, send_buf, send_len + 1, client_addr_ptr, client_addr_len);
+    retries_sent += 1;
+}
 
-        double rand_val = (double) rand() / RAND_MAX; // between 0 and 1
+int checkPath(int sockfd, struct transfer *t, struct sockaddr *addr_ptr, socklen_t addr_len, struct timespec now) {
+    // 1 if an upload's data from addr can move its acks there. a multipath client's other paths, or
+    // a NAT that rebound it, show up as a new address, but so would anyone who knows the transfer
+    // id and wants our acks sent somewhere. the new address gets a challenge with a cookie made for
+    // it instead, only whoever's really there can send it back
+    for (int i = 0; i < t->num_paths; i++) {
+        if (sameAddr(addr_ptr, (struct sockaddr *) &t->paths[i])) {
+            return 1;
+        }
+    }
+    if (get_time_diff(t->challenged, now) >= PATH_CHALLENGE_MS) { // it sends data faster than it could answer
+        t->challenged = now;
+        char send_buf[64];
+        int send_len = snprintf(send_buf, sizeof send_buf, "challenge:%u:%llx", t->hs.transfer_id, makeCookie(addr_ptr, cookieEpoch(now)));
+        sendMsg(sockfd, send_buf, send_len + 1, addr_ptr, addr_len);
+    }
+    return 0;
+}
 
-        deserializePkt(recv_buf, MAXBUFLEN, &pkt);
+void onPathResponse(struct transfer *t, const struct sockaddr *addr_ptr, socklen_t addr_len, unsigned long long cookie, struct timespec now) {
+    // addr answered a challenge, so it's really the client's. acks go there from now on, it's the
+    // last we heard from
+    if (!cookieValid(cookie, addr_ptr, now)) {
+        return;
+    }
+    for (int i = 0; i < t->num_paths; i++) {
+        if (sameAddr(addr_ptr, (struct sockaddr *) &t->paths[i])) {
+            return;
+        }
+    }
+    memcpy(&t->paths[t->num_paths % MAX_PATHS], addr_ptr, addr_len); // the oldest goes when it's full
+    t->num_paths += t->num_paths < MAX_PATHS;
+    memcpy(&t->rcv.peer_addr, addr_ptr, addr_len);
+    t->rcv.peer_addr_len = addr_len;
+}
 
-        if (rand_val <= 0.01) { 
-            printf("DROP PACKET: fragment %u\n", pkt.frag_no);
+void fairShare(double budget, const double *want, double *got, int n) {
+    // max-min fair: split the budget evenly, whoever wants less than its share gets what it wants,
+    // and the rest is split again between the others. budget can be INFINITY
+    int hungry = 0;
+    for (int i = 0; i < n; i++) {
+        got[i] = 0;
+        hungry += want[i] > 0;
+    }
+    while (hungry > 0 && budget > 0) {
+        double share = budget / hungry;
+        int satisfied = 0;
+        for (int i = 0; i < n; i++) {
+            if (got[i] < want[i] && want[i] - got[i] <= share) {
+                budget -= want[i] - got[i];
+                got[i] = want[i];
+                hungry -= 1;
+                satisfied = 1;
+            }
+        }
+        if (!satisfied) { // everyone left wants more than the share, so that's what they get
+            for (int i = 0; i < n; i++) {
+                if (got[i] < want[i]) {
+                    got[i] += share;
+                }
+            }
+            break;
+        }
+    }
+}
+
+void grantUploads(struct timespec now) {
+    // hand out the bandwidth that came due since last time as window. an upload only asks for
+    // what its window has room for, so one that's slow or done doesn't hold on to the rest's share
+    double ms = MIN(get_time_diff(last_grant, now), 2 * RATE_TICK_MS); // and nobody saves up while idle
+    last_grant = now;
+
+    struct transfer *up[MAX_TRANSFERS];
+    int client_of[MAX_TRANSFERS]; // index into the client arrays
+    double want[MAX_TRANSFERS], got[MAX_TRANSFERS];
+    double client_want[MAX_TRANSFERS], client_got[MAX_TRANSFERS];
+    int n = 0, clients = 0;
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        struct transfer *t = &transfers[i];
+        if (!t->in_use || t->is_get || t->is_mcast || !t->rcv.rate_limited) {
             continue;
         }
+        up[n] = t;
+        want[n] = MAX((double) receiverWants(&t->rcv) * t->rcv.frag_size - t->grant_carry, 0);
+        client_of[n] = clients;
+        for (int j = 0; j < n; j++) {
+            if (((struct sockaddr_in *) &up[j]->client_addr)->sin_addr.s_addr == ((struct sockaddr_in *) &t->client_addr)->sin_addr.s_addr) {
+                client_of[n] = client_of[j];
+                break;
+            }
+        }
+        if (client_of[n] == clients) {
+            client_want[clients++] = 0;
+        }
+        client_want[client_of[n]] += want[n];
+        n++;
+    }
 
-        if (!recv_filename) { // first packet, get the filename and open the file
-            recv_filename = strdup(pkt.filename);
-            expected_frag_no = 1;
-            file = fopen(recv_filename, "wb"); // will overwrite if exists, and create if not
-            if (!file) {
-                perror("fopen");
-                exit(1);
+    // first between clients, each capped at its own limit
+    for (int c = 0; c < clients; c++) {
+        client_want[c] = MIN(client_want[c], client_rate > 0 ? client_rate * ms : INFINITY);
+    }
+    fairShare(upload_rate > 0 ? upload_rate * ms : INFINITY, client_want, client_got, clients);
+
+    // then each client's share between its uploads
+    for (int c = 0; c < clients; c++) {
+        double w[MAX_TRANSFERS], g[MAX_TRANSFERS];
+        int k = 0;
+        for (int i = 0; i < n; i++) {
+            if (client_of[i] == c) {
+                w[k++] = want[i];
+            }
+        }
+        fairShare(client_got[c], w, g, k);
+        k = 0;
+        for (int i = 0; i < n; i++) {
+            if (client_of[i] == c) {
+                got[i] = g[k++];
             }
-            printf(">>> Receiving file: %s\n", recv_filename);
         }
+    }
 
-        fwrite(pkt.filedata, 1, pkt.size, file);
-        if (verbose) {
-            printf("Received fragment %u/%u (%d file bytes)\n", pkt.frag_no, pkt.total_frag, pkt.size);
+    for (int i = 0; i < n; i++) {
+        struct transfer *t = up[i];
+        double bytes = got[i] + t->grant_carry;
+        unsigned long long frags = (unsigned long long) (bytes / t->rcv.frag_size);
+        t->grant_carry = bytes - (double) frags * t->rcv.frag_size;
+        receiverGrant(&t->rcv, frags, now);
+    }
+}
+
+struct transfer *findTransfer(unsigned int transfer_id) {
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        if (transfers[i].in_use && transfers[i].hs.transfer_id == transfer_id) {
+            return &transfers[i];
         }
+    }
+    return NULL;
+}
 
-        // send ack/nack
-        if (pkt.frag_no == expected_frag_no) {
-            struct ackpkt ack = {1, expected_frag_no};
-            char msg[MAXBUFLEN];
-            size_t msg_len = serializeAck(&ack, msg, MAXBUFLEN);
-            sendMsg(sockfd, msg, msg_len, (struct sockaddr *) &client_addr, client_addr_len);
+struct transfer *allocTransfer() {
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        if (!transfers[i].in_use) {
+            memset(&transfers[i], 0, sizeof transfers[i]);
+            transfers[i].in_use = 1;
+            return &transfers[i];
+        }
+    }
+    return NULL;
+}
+
+void finishTransfer(struct transfer *t, int completed) {
+    if (t->is_get) {
+        if (completed) {
+            printf(">>> Finished sending file: %s (%u timeout retransmits, %u fast retransmits, %llu hole fragments, %llu resent for bad blocks)\n", t->hs.filename,
+                   t->snd.retransmits, t->snd.fast_retransmits, t->snd.hole_frags, t->snd.repaired_frags);
+        } else {
+            printf(">>> Gave up sending file: %s, client stopped responding\n", t->hs.filename);
+        }
+        senderClose(&t->snd);
+        releaseFile(t->cache);
+    } else if (!completed) {
+        if (t->is_mcast) {
+            printf(">>> Gave up on multicast file: %s, sender went quiet with %llu of %llu fragments\n", t->hs.filename, t->mrcv.received, t->mrcv.total_frag);
+        } else if (receiverMerkleFailed(&t->rcv)) {
+            printf(">>> Gave up receiving file: %s, its blocks don't match the merkle root from the handshake\n", t->hs.filename);
         } else {
-            struct ackpkt nack = {0, expected_frag_no};
-            char msg[MAXBUFLEN];
-            size_t msg_len = serializeAck(&nack, msg, MAXBUFLEN);
-            sendMsg(sockfd, msg, msg_len, (struct sockaddr *) &client_addr, client_addr_len);
+            printf(">>> Gave up receiving file: %s, client went quiet with %llu of %llu fragments\n", t->hs.filename, t->rcv.cum_frag, t->rcv.total_frag);
         }
+        if (t->is_mcast ? disk_writer != NULL : t->rcv.writer != NULL) { // after the writes still queued for it
+            writerClose(disk_writer, t->out_fd, NULL, NULL, NULL);
+        } else if (t->rcv.uring) {
+            uringClose(io_ring, t->out_fd, NULL, NULL);
+        } else {
+            close(t->out_fd);
+        }
+        if (!t->to_pipe) {
+            unlink(t->part_filename); // gone from the directory now, the writer thread can still finish with it
+        }
+        if (t->is_mcast) {
+            mcastReceiverClose(&t->mrcv);
+        } else {
+            manifestFree(t->rcv.dedup);
+            if (t->rcv.writer && t->rcv.merkle) { // blocks of it may still be on the ring to hash
+                writerFree(disk_writer, t->rcv.merkle);
+            } else {
+                merkleFree(t->rcv.merkle);
+            }
+            free(t->rcv.order_buf);
+        }
+    } else if (t->rcv.hold_last) {
+        // complete, but not under its real name yet. the server loop comes back here once the
+        // writer thread says it is, after the writes still queued for it
+        if (!t->publishing && dedup) {
+            writerStore(disk_writer, t->out_fd, t->part_filename, t->hs.filename, &t->published);
+        } else if (!t->publishing) {
+            writerClose(disk_writer, t->out_fd, t->part_filename, t->hs.filename, &t->published);
+        }
+        t->publishing = 1;
+        return;
+    } else {
+        // the real name only ever points at a complete file, and downloads still mapping
+        // the old version keep their inode
+        if (t->to_pipe) { // everything's been written to it already
+            close(t->out_fd);
+        } else if (t->publishing) { // the writer thread's already put it there
+        } else if (dedup) {
+            close(t->out_fd);
+            dedupStore(t->part_filename, t->hs.filename);
+        } else if (disk_writer) { // multicast, after the writes still queued for it
+            writerClose(disk_writer, t->out_fd, t->part_filename, t->hs.filename, NULL);
+        } else if (io_ring) { // same, they're on the ring
+            uringClose(io_ring, t->out_fd, t->part_filename, t->hs.filename);
+        } else {
+            close(t->out_fd);
+            if (rename(t->part_filename, t->hs.filename) == -1) {
+                perror("rename");
+            }
+        }
+        if (t->is_mcast) {
+            printf(">>> Finished multicast file: %s (%llu fragments, %llu nacks sent, %llu held back for repairs already coming, %llu repairs we didn't need)\n",
+                   t->hs.filename, t->mrcv.total_frag, t->mrcv.nacks_sent, t->mrcv.nacks_suppressed, t->mrcv.dup_frags);
+            mcastReceiverClose(&t->mrcv);
+        } else {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            printf(">>> Finished receiving file: %s (%llu fragments, %llu of them holes, %llu from the chunk store, %llu acks, %.3f s)\n", t->hs.filename,
+                   t->rcv.total_frag, t->rcv.hole_frags, t->rcv.stored_frags, t->rcv.acks_sent, get_time_diff(t->started, now) / 1000);
+        }
+        if (t->rcv.merkle) {
+            printf(">>> Verified %s against its merkle root, %llu bad blocks sent again\n", t->hs.filename, t->rcv.merkle->bad_blocks);
+        }
+        manifestFree(t->rcv.dedup);
+        merkleFree(t->rcv.merkle); // every block's hashed by now, nothing on the writer ring points at it
+        free(t->rcv.order_buf);
 
-        expected_frag_no += 1;
+        recent_transfers[recent_next].transfer_id = t->hs.transfer_id;
+        recent_transfers[recent_next].total_frag = t->rcv.total_frag;
+        recent_next = (recent_next + 1) % RECENT_TRANSFERS;
+    }
+    if (io_ring) {
+        unsigned long long datagrams, sent, enters;
+        uringStats(io_ring, &datagrams, &sent, &enters);
+        printf(">>> io_uring so far: %llu datagrams in, %llu out, %llu io_uring_enter calls\n", datagrams, sent, enters);
+    }
+    if (disk_writer && disk_writer->direct) { // the writer thread's counters, near enough
+        printf(">>> direct writes so far: %llu blocks, %llu of them partial\n", disk_writer->direct_writes, disk_writer->partial_writes);
+    }
+    t->in_use = 0;
+}
 
-        if (pkt.frag_no == pkt.total_frag) {
-            printf(">>> Finished receiving file\n");
-            break;
+int openPart(const char *filename) {
+    // will overwrite if exists, and create if not. read too, to hash blocks back
+    int fd = -1;
+    if (direct) {
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (fd == -1 && errno == EINVAL) { // tmpfs and the like
+            printf(">>> %s can't be opened O_DIRECT here, its blocks go through the page cache\n", filename);
         }
     }
+    if (fd == -1) {
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    return fd;
+}
+
+void startUpload(int sockfd, struct handshake *hs, struct sockaddr *client_addr_ptr, socklen_t client_addr_len, int rcvbuf) {
+    struct transfer *t = allocTransfer();
+    if (t == NULL) {
+        sendNo(sockfd, client_addr_ptr, client_addr_len);
+        return;
+    }
+
+    // a named pipe there already means someone's waiting to read the file as it comes in, say
+    // an untar. there's no taking back what's written to it, so no part file, and it has to be
+    // open on the other end or we'd have nobody to write to
+    struct stat st;
+    t->to_pipe = stat(hs->filename, &st) == 0 && S_ISFIFO(st.st_mode);
+    if (t->to_pipe) {
+        t->out_fd = open(hs->filename, O_WRONLY | O_NONBLOCK);
+    } else {
+        snprintf(t->part_filename, sizeof t->part_filename, "%s.part", hs->filename);
+        t->out_fd = openPart(t->part_filename);
+    }
+    if (t->out_fd == -1) {
+        perror("open");
+        t->in_use = 0;
+        sendNo(sockfd, client_addr_ptr, client_addr_len);
+        return;
+    }
+    // we know the size up front from the handshake, so set it now (sparse until written). a
+    // stream's is 0 and just grows
+    if (!t->to_pipe && ftruncate(t->out_fd, hs->file_size) == -1) {
+        perror("ftruncate");
+    }
+
+    // negotiate down to what both sides can do, the frag size is kept since early data already uses it
+    hs->window = MIN(hs->window, MAX_WINDOW);
+    hs->rcvbuf = rcvbuf;
+    hs->flags &= SUPPORTED_FEATURES;
+    if (!dedup) {
+        hs->flags &= ~FEATURE_DEDUP;
+    }
+    if (hs->flags & FEATURE_STREAM) { // all of these need the whole file up front
+        hs->flags &= ~(FEATURE_SPARSE | FEATURE_DEDUP | FEATURE_MERKLE);
+    }
+    if (t->to_pipe) { // and these read back what we wrote
+        hs->flags &= ~(FEATURE_DEDUP | FEATURE_MERKLE);
+    }
 
-    fclose(file);
-    free(pkt.filename);
-    free(recv_filename);
+    t->is_get = 0;
+    t->hs = *hs;
+    memcpy(&t->client_addr, client_addr_ptr, client_addr_len);
+    t->client_addr_len = client_addr_len;
+    receiverInit(&t->rcv, sockfd, client_addr_ptr, client_addr_len, hs, t->out_fd);
+    t->rcv.idle_ms = idle_ms;
+    memcpy(&t->paths[0], client_addr_ptr, client_addr_len);
+    t->num_paths = 1;
+    clock_gettime(CLOCK_MONOTONIC, &t->started);
+    if (upload_rate > 0 || client_rate > 0) {
+        t->rcv.rate_limited = 1;
+        t->rcv.credit = INITIAL_WINDOW; // the early data it sent with the handshake
+    }
+    t->rcv.writer = disk_writer;
+    t->rcv.uring = hs->flags & FEATURE_MERKLE ? NULL : io_ring; // blocks get read back to hash, so write them ourselves
+    if (t->to_pipe) { // in order, from here
+        t->rcv.writer = NULL;
+        t->rcv.uring = NULL;
+        receiverOrdered(&t->rcv);
+    }
+    // the writer thread renames it, or chunks it into the store, once it's all here. until that's
+    // done a get wouldn't find it, so the client doesn't hear it's finished until then
+    t->rcv.hold_last = disk_writer && !t->to_pipe;
+
+    sendReply(sockfd, "yes", hs, client_addr_ptr, client_addr_len);
+    printf(">>> Receiving file: %s%s%s\n", hs->filename, hs->flags & FEATURE_STREAM ? " (streamed, size unknown)" : "", t->to_pipe ? " into a pipe" : "");
+
+    if (receiverDone(&t->rcv)) { // empty file, nothing more to wait for
+        finishTransfer(t, 1);
+    }
+}
+
+void startMcast(int sockfd, const struct mcast_announce *a, struct sockaddr *sender_addr_ptr, socklen_t sender_addr_len) {
+    // first announcement of a multicast upload. nobody to say no to, if we can't take it we just don't
+    struct transfer *t = allocTransfer();
+    if (t == NULL) {
+        return;
+    }
+    snprintf(t->part_filename, sizeof t->part_filename, "%s.part", a->filename);
+    t->out_fd = openPart(t->part_filename);
+    if (t->out_fd == -1) {
+        perror("open");
+        t->in_use = 0;
+        return;
+    }
+    if (ftruncate(t->out_fd, a->file_size) == -1) {
+        perror("ftruncate");
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    t->is_get = 0;
+    t->is_mcast = 1;
+    t->hs.transfer_id = a->transfer_id; // so findTransfer and the recent list work like for any upload
+    t->hs.frag_size = a->frag_size;
+    t->hs.file_size = a->file_size;
+    strncpy(t->hs.filename, a->filename, MAX_FILENAME - 1);
+    memcpy(&t->client_addr, sender_addr_ptr, sender_addr_len);
+    t->client_addr_len = sender_addr_len;
+    mcastReceiverInit(&t->mrcv, sockfd, sender_addr_ptr, sender_addr_len, a, t->out_fd, now);
+    t->mrcv.writer = disk_writer;
+    t->rcv.total_frag = t->mrcv.total_frag; // for the recent list
+    printf(">>> Receiving multicast file: %s (%lld bytes)\n", a->filename, a->file_size);
+
+    if (mcastDone(&t->mrcv)) {
+        finishTransfer(t, 1);
+    }
+}
+
+void startDownload(int sockfd, struct handshake *hs, struct sockaddr *client_addr_ptr, socklen_t client_addr_len, enum cc_algo cc) {
+    struct cached_file *cf = acquireFile(hs->filename);
+    if (cf == NULL) {
+        sendNo(sockfd, client_addr_ptr, client_addr_len);
+        return;
+    }
+    struct transfer *t = allocTransfer();
+    if (t == NULL) {
+        releaseFile(cf);
+        sendNo(sockfd, client_addr_ptr, client_addr_len);
+        return;
+    }
+
+    // the client is the receiver here, so its window and buffer are the limits
+    hs->window = MIN(hs->window, MAX_WINDOW);
+    hs->flags &= SUPPORTED_FEATURES & ~(FEATURE_DEDUP | FEATURE_STREAM); // clients don't keep a chunk store, and we know the size
+    hs->file_size = cf->src.size;
+    if (hs->flags & FEATURE_MERKLE && cf->merkle == NULL) {
+        cf->merkle = merkleBuild(&cf->src, hs->frag_size);
+    }
+    if (hs->flags & FEATURE_MERKLE && cf->merkle->frag_size != hs->frag_size) {
+        hs->flags &= ~FEATURE_MERKLE; // blocks are made of fragments, a tree for another size doesn't help
+    }
+    if (hs->flags & FEATURE_MERKLE) {
+        memcpy(hs->root, cf->merkle->root, SHA256_LEN);
+    }
+
+    t->is_get = 1;
+    t->hs = *hs;
+    t->cache = cf;
+    memcpy(&t->client_addr, client_addr_ptr, client_addr_len);
+    t->client_addr_len = client_addr_len;
+    senderInit(&t->snd, sockfd, client_addr_ptr, client_addr_len, hs, &cf->src, cc);
+    senderSetLimits(&t->snd, hs);
+    senderReadAhead(&t->snd, read_ahead);
+    t->snd.merkle = hs->flags & FEATURE_MERKLE ? cf->merkle : NULL;
+
+    sendReply(sockfd, "yes", hs, client_addr_ptr, client_addr_len);
+    printf(">>> Sending file: %s (%d downloads of it running)\n", hs->filename, cf->refs);
+
+    // first window goes out right behind the "yes"
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    senderFill(&t->snd, now);
+    if (senderDone(&t->snd)) {
+        finishTransfer(t, 1);
+    }
+}
+
+void handleHandshake(int sockfd, const char *recv_buf, int numbytes, struct sockaddr *client_addr_ptr, socklen_t client_addr_len, int rcvbuf, enum cc_algo cc, struct timespec now) {
+    // "ftp:..." or "get:...". this is what a flood is made of, so nothing gets logged or set up
+    // until the cookie checks out (or we're not busy enough to ask for one)
+    struct handshake hs;
+    int is_get = 0;
+    if (deserializeHandshake(recv_buf, numbytes, "ftp", &hs) == -1) {
+        if (deserializeHandshake(recv_buf, numbytes, "get", &hs) == -1) {
+            return; // malformed, not worth an answer
+        }
+        is_get = 1;
+    }
+
+    // client didn't get our "yes" and sent the handshake again. only to where the transfer was
+    // started from, which had shown it gets our packets, or anyone could have it sent anywhere
+    struct transfer *t = findTransfer(hs.transfer_id);
+    if (t != NULL && sameAddr(client_addr_ptr, (struct sockaddr *) &t->client_addr)) {
+        sendReply(sockfd, "yes", &t->hs, client_addr_ptr, client_addr_len);
+        return;
+    }
+    for (int i = 0; i < RECENT_TRANSFERS; i++) {
+        if (recent_transfers[i].transfer_id != 0 && recent_transfers[i].transfer_id == hs.transfer_id) {
+            return; // late duplicate of a handshake we already served
+        }
+    }
+
+    // nothing's set up for this client until it shows it gets our packets, if we're busy enough to ask.
+    // its early data is dropped meanwhile, it sends it again with the cookie
+    if (!cookieValid(hs.cookie, client_addr_ptr, now) && wantCookie(now)) {
+        sendRetry(sockfd, hs.transfer_id, client_addr_ptr, client_addr_len, now);
+        return;
+    }
+    if (t != NULL) { // someone else's transfer id, it can pick another
+        sendNo(sockfd, client_addr_ptr, client_addr_len);
+        return;
+    }
+    printf(">>> received message %d bytes long\n", numbytes);
+    printf("%s\n", recv_buf);
+
+    // reply depending on if it's a handshake we can do or not
+    hs.cookie = makeCookie(client_addr_ptr, cookieEpoch(now)); // a fresh one with the "yes", for its next transfer
+    if (hs.version != PROTOCOL_VERSION || hs.frag_size == 0 || hs.frag_size > MAX_FRAG_SIZE || hs.file_size < 0 || !validFilename(hs.filename)) {
+        sendNo(sockfd, client_addr_ptr, client_addr_len);
+    } else if (is_get) {
+        startDownload(sockfd, &hs, client_addr_ptr, client_addr_len, cc);
+    } else {
+        startUpload(sockfd, &hs, client_addr_ptr, client_addr_len, rcvbuf);
+    }
+}
+
+void handleMsg(int sockfd, const char *recv_buf, int numbytes, struct sockaddr *client_addr_ptr, socklen_t client_addr_len, int rcvbuf, enum cc_algo cc) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (isDataPkt(recv_buf)) { // fragment of an upload
+        struct packet pkt;
+        if (deserializePkt(recv_buf, numbytes, &pkt) == -1) {
+            return;
+        }
+        struct transfer *t = findTransfer(pkt.transfer_id);
+        if (t == NULL || t->is_get) {
+            // data fragment from a transfer we already finished, our last ack got lost
+            // so ack the whole file again or the sender keeps retransmitting.
+            // anything else is early data whose handshake got lost, the client will resend both
+            for (int i = 0; i < RECENT_TRANSFERS; i++) {
+                if (recent_transfers[i].transfer_id != 0 && recent_transfers[i].transfer_id == pkt.transfer_id) {
+                    struct ackpkt ack = {1, recent_transfers[i].total_frag, pkt.transfer_id, 0, MAX_WINDOW};
+                    char msg[MAXBUFLEN];
+                    size_t msg_len = serializeAck(&ack, msg, MAXBUFLEN);
+                    sendMsg(sockfd, msg, msg_len, client_addr_ptr, client_addr_len);
+                }
+            }
+            return;
+        }
+
+        double rand_val = (double) rand() / RAND_MAX; // between 0 and 1
+        if (rand_val <= 0.01) { 
+            printf("DROP PACKET: fragment %llu\n", pkt.frag_no);
+            traceEvent(TRACE_DROP, pkt.transfer_id, pkt.frag_no, 1, 0, 0, 0);
+            return;
+        }
+
+        if (t->is_mcast) {
+            mcastOnData(&t->mrcv, &pkt, now);
+            if (mcastDone(&t->mrcv)) {
+                finishTransfer(t, 1);
+            }
+            return;
+        }
+        // a multipath client sends from several addresses, acks go back on the one we heard from last
+        // so a path that dies takes the acks with it only until data comes in on another. as long
+        // as that one's shown it really is the client's
+        if (checkPath(sockfd, t, client_addr_ptr, client_addr_len, now)) {
+            memcpy(&t->rcv.peer_addr, client_addr_ptr, client_addr_len);
+            t->rcv.peer_addr_len = client_addr_len;
+        }
+        receiverOnData(&t->rcv, &pkt, now);
+        if (receiverDone(&t->rcv)) {
+            finishTransfer(t, 1);
+        }
+        return;
+    }
+
+    if (strncmp(recv_buf, "ftp:", 4) == 0 || strncmp(recv_buf, "get:", 4) == 0) { // first, it's the one that has to be cheap
+        handleHandshake(sockfd, recv_buf, numbytes, client_addr_ptr, client_addr_len, rcvbuf, cc, now);
+        return;
+    }
+    if (strncmp(recv_buf, "probe:", 6) == 0) { // client looking for the path MTU
+        pmtuAnswer(sockfd, recv_buf, numbytes, client_addr_ptr, client_addr_len);
+        return;
+    }
+
+    struct mcast_announce announce;
+    if (mcast && deserializeAnnounce(recv_buf, numbytes, &announce) == 0) { // multicast sender saying what it's sending
+        struct transfer *t = findTransfer(announce.transfer_id);
+        if (t != NULL && t->is_mcast) {
+            mcastOnAnnounce(&t->mrcv, &announce, now);
+            return;
+        }
+        for (int i = 0; i < RECENT_TRANSFERS; i++) {
+            if (recent_transfers[i].transfer_id != 0 && recent_transfers[i].transfer_id == announce.transfer_id) {
+                return; // got all of it already, the sender's lingering for others
+            }
+        }
+        if (t == NULL && announce.frag_size > 0 && announce.frag_size <= MAX_FRAG_SIZE && announce.file_size >= 0 && validFilename(announce.filename)) {
+            startMcast(sockfd, &announce, client_addr_ptr, client_addr_len);
+        }
+        return;
+    }
+    if (mcast && strncmp(recv_buf, "mrepair:", 8) == 0) {
+        unsigned int transfer_id;
+        struct transfer *t = sscanf(recv_buf, "mrepair:%u", &transfer_id) == 1 ? findTransfer(transfer_id) : NULL;
+        if (t != NULL && t->is_mcast) {
+            mcastOnRepair(&t->mrcv, recv_buf, numbytes, now);
+        }
+        return;
+    }
+
+    unsigned int transfer_id;
+    unsigned long long cookie;
+    if (sscanf(recv_buf, "response:%u:%llx", &transfer_id, &cookie) == 2) { // new source address of an upload, answering our challenge
+        struct transfer *t = findTransfer(transfer_id);
+        if (t != NULL && !t->is_get && !t->is_mcast) {
+            onPathResponse(t, client_addr_ptr, client_addr_len, cookie, now);
+        }
+        return;
+    }
+
+    struct chunk_query query;
+    if (deserializeChunkQuery(recv_buf, numbytes, &query) == 0) { // uploader asking which chunks we have
+        struct transfer *t = findTransfer(query.transfer_id);
+        if (t != NULL && !t->is_get && t->hs.flags & FEATURE_DEDUP) {
+            receiverOnChunkQuery(&t->rcv, &query);
+        }
+        return;
+    }
+
+    int merkle_msg = merkleMsg(recv_buf, &transfer_id);
+    if (merkle_msg != -1) { // checking blocks against the merkle tree, either direction
+        struct transfer *t = findTransfer(transfer_id);
+        if (t == NULL) {
+            return;
+        }
+        if (merkle_msg == MERKLE_VERIFY && t->is_get) {
+            senderOnVerify(&t->snd, recv_buf, numbytes);
+        } else if (merkle_msg == MERKLE_RESEND && t->is_get) {
+            senderOnResend(&t->snd, recv_buf, numbytes);
+        } else if (merkle_msg == MERKLE_TREE && !t->is_get) {
+            receiverOnTree(&t->rcv, recv_buf, numbytes, now);
+            if (receiverDone(&t->rcv)) {
+                finishTransfer(t, 1);
+            }
+        }
+        return;
+    }
+
+    struct ackpkt ack;
+    if (deserializeAck(recv_buf, numbytes, &ack) == 0) { // ack from a client downloading
+        struct transfer *t = findTransfer(ack.transfer_id);
+        if (t == NULL || !t->is_get) {
+            return;
+        }
+        senderOnAck(&t->snd, &ack, now);
+        senderFill(&t->snd, now);
+        if (senderDone(&t->snd)) {
+            finishTransfer(t, 1);
+        }
+        return;
+    }
+
+    printf(">>> received message %d bytes long\n", numbytes);
+    printf("%s\n", recv_buf);
+    sendNo(sockfd, client_addr_ptr, client_addr_len);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: server <server port number>\n");
+    if (argc < 2) {
+        fprintf(stderr, "Usage: server <server port number> [reno|bbr] [threaded|inline] [readahead=<MB>] [uring|poll] [dedup] [direct] [cookies] [rate=<MB/s>] [clientrate=<MB/s>] [idle=<s>] [mcast=<group>] [mcastif=<addr>] [trace=<file>]\n");
         exit(1);
     }
-
+    // options after the port, in any order
+    enum cc_algo cc = CC_RENO; // congestion control for downloads
+    int threaded = 1; // uploads written by a separate disk thread
+    int read_ahead_mb;
+    int use_uring = 1; // io_uring engine if the kernel has it, poll otherwise
+    struct ip_mreq mreq = {{0}, {htonl(INADDR_ANY)}}; // multicast group to join, on which interface
+    char addr_str[64];
+    for (int i = 2; i < argc; i++) {
+        if (parseCC(argv[i]) != -1) {
+            cc = parseCC(argv[i]);
+        } else if (strcmp(argv[i], "threaded") == 0 || strcmp(argv[i], "inline") == 0) {
+            threaded = strcmp(argv[i], "threaded") == 0;
+        } else if (sscanf(argv[i], "readahead=%d", &read_ahead_mb) == 1 && read_ahead_mb >= 0) {
+            read_ahead = (off_t) read_ahead_mb << 20;
+        } else if (strcmp(argv[i], "uring") == 0 || strcmp(argv[i], "poll") == 0) {
+            use_uring = strcmp(argv[i], "uring") == 0;
+        } else if (strcmp(argv[i], "dedup") == 0) {
+            dedup = 1;
+        } else if (strcmp(argv[i], "direct") == 0) {
+            direct = 1;
+        } else if (strcmp(argv[i], "cookies") == 0) {
+            cookies_always = 1;
+        } else if (sscanf(argv[i], "rate=%lf", &upload_rate) == 1 && upload_rate > 0) {
+            upload_rate *= 1000; // MB/s to bytes per ms
+        } else if (sscanf(argv[i], "clientrate=%lf", &client_rate) == 1 && client_rate > 0) {
+            client_rate *= 1000;
+        } else if (sscanf(argv[i], "idle=%lf", &idle_ms) == 1 && idle_ms > 0) {
+            idle_ms *= 1000;
+        } else if (sscanf(argv[i], "mcast=%63s", addr_str) == 1 && inet_pton(AF_INET, addr_str, &mreq.imr_multiaddr) == 1 &&
+                   IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr))) {
+            mcast = 1;
+        } else if (sscanf(argv[i], "mcastif=%63s", addr_str) == 1 && inet_pton(AF_INET, addr_str, &mreq.imr_interface) == 1) {
+            // joins on that interface instead of whichever the kernel picks, 127.0.0.1 to try it on one box
+        } else if (strncmp(argv[i], "trace=", 6) == 0) {
+            if (tracer != NULL || traceStart(argv[i] + 6) == -1) { // every transfer we run goes in it, by transfer id
+                exit(1);
+            }
+            atexit(traceStop);
+        } else {
+            fprintf(stderr, "Unknown option %s, expected reno, bbr, threaded, inline, readahead=<MB>, uring, poll, dedup, direct, cookies, rate=<MB/s>, clientrate=<MB/s>, idle=<s>, mcast=<group>, mcastif=<addr> or trace=<file>\n", argv[i]);
+            exit(1);
+        }
+    }
     srand(time(NULL)); // seed rng
+    int random_fd = open("/dev/urandom", O_RDONLY);
+    if (random_fd == -1 || read(random_fd, cookie_secret, sizeof cookie_secret) != sizeof cookie_secret) {
+        perror("/dev/urandom");
+        exit(1);
+    }
+    close(random_fd);
+    signal(SIGPIPE, SIG_IGN); // a pipe we're writing an upload into can lose its reader, that's write's EPIPE to handle
 
     // POPULATE ADDRINFOS
     int status;
@@ -174,6 +1007,11 @@ int main(int argc, char *argv[]) {
             perror("socket");
             continue; 
         }
+        // every receiver of a group listens on the same port, which takes this when they share a box
+        int yes = 1;
+        if (mcast && setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) == -1) {
+            perror("setsockopt");
+        }
         // bind socket descriptor to port
         if (bind(sockfd, curr->ai_addr, curr->ai_addrlen) == -1) {
             close(sockfd);
@@ -191,34 +1029,148 @@ int main(int argc, char *argv[]) {
     // don't need it anymore
     freeaddrinfo(servinfo);
 
+    if (mcast && setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq) == -1) {
+        perror("setsockopt IP_ADD_MEMBERSHIP");
+        exit(1);
+    }
+
     // START ACCEPTING DATA 
     printf(">>> begin listening...\n");
 
+    int rcvbuf = 0; // advertised in the handshake so the client doesn't overrun our socket buffer
+    socklen_t optlen = sizeof rcvbuf;
+    getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen);
+
+    if (dedup) {
+        if (mkdir(CHUNK_DIR, 0755) == -1 && errno != EEXIST) {
+            perror("mkdir");
+            exit(1);
+        }
+        if (use_uring) { // finished uploads get chunked after their last write, the ring can't run that
+            printf(">>> dedup stores uploads from the writer thread, using poll\n");
+            use_uring = 0;
+        }
+    }
+    if (direct && (use_uring || !threaded)) { // it's the writer thread that packs the blocks
+        printf(">>> direct writes go through the writer thread, using poll\n");
+        use_uring = 0;
+        threaded = 1;
+    }
+    if (use_uring && (io_ring = uringStart(sockfd)) == NULL) {
+        printf(">>> io_uring not available, using poll\n");
+    }
+    // the ring does the disk writes itself, the writer thread is only for the poll path
+    struct writer writer;
+    if (threaded && io_ring == NULL) {
+        writerStart(&writer, direct);
+        disk_writer = &writer;
+    }
+
+    if (upload_rate > 0 || client_rate > 0) {
+        printf(">>> uploads limited to %.1f MB/s in all, %.1f MB/s per client (0 for no limit)\n", upload_rate / 1000, client_rate / 1000);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &last_grant);
+
+    // one thread serves every transfer: wait for a datagram, a download's RTO or paced send,
+    // an upload's delayed ack, merkle check or idle timeout, or handing out window to rate limited uploads,
+    // whichever is first
     while (1) {
-        // initial handshake
-        int numbytes;
-        char recv_buf[MAXBUFLEN];
-        struct sockaddr_storage client_addr;
-        socklen_t client_addr_len = sizeof client_addr;
-        numbytes = recvMsg(sockfd, recv_buf, &client_addr, &client_addr_len);
-        recv_buf[numbytes] = '\0'; // initial message we know should be string
-
-        printf(">>> received message %d bytes long\n", numbytes);
-        printf("%s\n", recv_buf);
-
-        // reply depending on if it's ftp or not
-        if (strcmp("ftp", recv_buf) == 0) {
-            char *send_buf = "yes";
-            printf(">>> replying with yes\n");
-            sendMsg(sockfd, send_buf, strlen(send_buf), (struct sockaddr *) &client_addr, client_addr_len);
-            recvFile(sockfd, 0);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int poll_ms = -1; // nothing to time out, block until a datagram shows up
+        for (int i = 0; i < MAX_TRANSFERS; i++) {
+            struct transfer *t = &transfers[i];
+            double left;
+            if (t->in_use && t->is_get) {
+                left = senderWaitTime(&t->snd, now);
+            } else if (t->in_use && t->publishing) {
+                left = PUBLISH_POLL_MS;
+            } else if (t->in_use && t->is_mcast) {
+                left = mcastTimeLeft(&t->mrcv, now);
+            } else if (t->in_use && t->rcv.rate_limited) {
+                left = MIN(receiverTimeLeft(&t->rcv, now), RATE_TICK_MS - get_time_diff(last_grant, now));
+            } else if (t->in_use) {
+                left = receiverTimeLeft(&t->rcv, now); // delayed ack, merkle check, or the client's gone quiet
+            } else {
+                continue;
+            }
+            int left_ms = left <= 0 ? 0 : (int) left + 1; // round up so we don't wake just before it fires
+            if (poll_ms == -1 || left_ms < poll_ms) {
+                poll_ms = left_ms;
+            }
+        }
+
+        if (io_ring) {
+            // sends and writes queued since last time go in with the same syscall that waits
+            uringWait(io_ring, poll_ms);
+            char recv_buf[MAXBUFLEN];
+            struct sockaddr_storage client_addr;
+            socklen_t client_addr_len;
+            int numbytes;
+            while ((numbytes = uringRecv(io_ring, recv_buf, &client_addr, &client_addr_len)) != -1) {
+                handleMsg(sockfd, recv_buf, numbytes, (struct sockaddr *) &client_addr, client_addr_len, rcvbuf, cc);
+            }
         } else {
-            char *send_buf = "no";
-            printf(">>> replying with no\n");
-            sendMsg(sockfd, send_buf, strlen(send_buf), (struct sockaddr *) &client_addr, client_addr_len);
+            struct pollfd pfd = {sockfd, POLLIN, 0};
+            if (poll(&pfd, 1, poll_ms) == -1) {
+                perror("poll");
+                exit(1);
+            }
+
+            for (int n = 0; n < MAX_BATCH; n++) {
+                char recv_buf[MAXBUFLEN];
+                struct sockaddr_storage client_addr;
+                socklen_t client_addr_len;
+                int numbytes = recvMsg(sockfd, recv_buf, &client_addr, &client_addr_len);
+                if (numbytes == -1) {
+                    break;
+                }
+                handleMsg(sockfd, recv_buf, numbytes, (struct sockaddr *) &client_addr, client_addr_len, rcvbuf, cc);
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((upload_rate > 0 || client_rate > 0) && get_time_diff(last_grant, now) >= RATE_TICK_MS) {
+            grantUploads(now);
+        }
+        for (int i = 0; i < MAX_TRANSFERS; i++) {
+            struct transfer *t = &transfers[i];
+            if (!t->in_use) {
+                continue;
+            }
+            if (t->is_mcast) {
+                if (mcastOnTimer(&t->mrcv, now) == -1) {
+                    finishTransfer(t, 0);
+                }
+                continue;
+            }
+            if (t->publishing) { // nothing to do but wait for the writer thread
+                if (atomic_load_explicit(&t->published, memory_order_acquire)) {
+                    t->rcv.hold_last = 0;
+                    sendAck(&t->rcv, 1, t->rcv.total_frag, now); // the one we held back
+                    finishTransfer(t, 1);
+                }
+                continue;
+            }
+            if (!t->is_get) {
+                if (receiverOnTimer(&t->rcv, now) == -1) {
+                    finishTransfer(t, 0);
+                } else if (receiverMerkleFailed(&t->rcv)) { // the client hears no instead of the last ack
+                    sendNo(t->rcv.sockfd, (struct sockaddr *) &t->rcv.peer_addr, t->rcv.peer_addr_len);
+                    finishTransfer(t, 0);
+                } else if (receiverDone(&t->rcv)) { // the last block checked out
+                    finishTransfer(t, 1);
+                }
+                continue;
+            }
+            if (senderTimeLeft(&t->snd, now) <= 0 && senderOnTimeout(&t->snd, now) == -1) {
+                finishTransfer(t, 0);
+                continue;
+            }
+            senderFill(&t->snd, now); // paced fragments that came due while we slept
         }
     }
 
     close(sockfd);
     return 0;
-}
\ No newline at end of file
+}
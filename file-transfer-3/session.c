@@ -0,0 +1,818 @@
+#define _GNU_SOURCE // for ppoll
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include "transfer.h"
+
+// client side as a library: a session is one socket to one server (or multicast group), looked
+// up and set up once, and any number of uploads and downloads over it. later transfers start
+// from the RTT and ssthresh earlier ones measured instead of from scratch, which is most of
+// the cost of a small file. uploads can go out over several sockets at once, see sessionPaths.
+// deliver is a thin command line over this
+
+// credits: some of this code is adapted from beej's handbook, mainly section 6.3
+
+// NOTE: perhaps in the future pass the expected length to receive into recvMsg
+int recvMsg(int sockfd, void *recv_buf, double timeout_ms) {
+    // will return -1 on timeout
+
+    // set timeout
+    struct timeval timeout_struct;
+    timeout_struct.tv_sec = (long) (timeout_ms / 1000);
+    timeout_struct.tv_usec = ((long) (timeout_ms * 1000)) % 1000000;
+    if (timeout_struct.tv_sec == 0 && timeout_struct.tv_usec == 0) {
+        timeout_struct.tv_usec = 1; // a zero timeout would block forever
+    }
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout_struct, sizeof(timeout_struct)) < 0) {
+        perror("setsockopt");
+        exit(1);
+    }
+    // printf("set the timeout to: %.6f\n", timeout_ms);
+    // receive the data
+    int numbytes;
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_len = sizeof serv_addr;
+
+    numbytes = recvfrom(sockfd, recv_buf, MAXBUFLEN - 1, 0, (struct sockaddr *) &serv_addr, &serv_addr_len);
+    if (numbytes == -1) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) { // timeout
+            return -1;
+        }
+        perror("recvfrom");
+        exit(1);
+    }
+
+    ((char *) recv_buf)[numbytes] = '\0';
+    return numbytes;
+}
+
+int sessionRecv(struct session *sess, void *recv_buf, double timeout_ms) {
+    // recvMsg from whichever of the session's sockets has something first. the server answers a
+    // multipath upload on whichever path its data last came in on, so that could be any of them
+    sess->recv_path = 0;
+    if (sess->num_paths <= 1) {
+        return recvMsg(sess->sockfd, recv_buf, timeout_ms);
+    }
+    struct pollfd fds[MAX_PATHS];
+    for (int i = 0; i < sess->num_paths; i++) {
+        fds[i].fd = sess->paths[i].sockfd;
+        fds[i].events = POLLIN;
+    }
+    struct timespec timeout;
+    timeout.tv_sec = (time_t) (timeout_ms / 1000);
+    timeout.tv_nsec = (long) ((timeout_ms - timeout.tv_sec * 1000.0) * 1000000);
+    int ready = ppoll(fds, sess->num_paths, &timeout, NULL);
+    if (ready == -1 && errno != EINTR) {
+        perror("ppoll");
+        exit(1);
+    }
+    for (int i = 0; i < sess->num_paths && ready > 0; i++) {
+        if (fds[i].revents & POLLIN) {
+            sess->recv_path = i;
+            return recvMsg(fds[i].fd, recv_buf, 0);
+        }
+    }
+    return -1;
+}
+
+void fillHandshake(int sockfd, const char *filename, off_t file_size, struct handshake *hs) {
+    // what we'd like, the server answers with what it can actually do
+    memset(hs, 0, sizeof *hs);
+    hs->version = PROTOCOL_VERSION;
+    hs->frag_size = FRAG_SIZE;
+    hs->window = MAX_WINDOW;
+    socklen_t optlen = sizeof hs->rcvbuf;
+    getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &hs->rcvbuf, &optlen);
+    hs->flags = SUPPORTED_FEATURES & ~FEATURE_STREAM; // only when the caller says so
+    hs->file_size = file_size;
+    hs->transfer_id = (unsigned int) rand();
+    strncpy(hs->filename, filename, MAX_FILENAME - 1);
+}
+
+unsigned int sessionFragSize(struct session *sess) {
+    // biggest fragments the path takes, looking for its MTU first if we haven't lately. with
+    // several paths it's the smallest of theirs, a path that doesn't answer is probably down and
+    // doesn't count. FRAG_SIZE if we're not to look, or the server doesn't answer probes
+    if (sess->no_pmtu) {
+        return FRAG_SIZE;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!sess->pmtu_searched || get_time_diff(sess->pmtu_time, now) >= PMTU_RAISE_MS) {
+        double timeout_ms = sess->warm ? MIN(sess->estimatedRTT + 4 * sess->devRTT + ACK_DELAY_MS, MAX_TIMEOUT) : 100;
+        unsigned int plpmtu = 0;
+        for (int i = 0; i < MAX(sess->num_paths, 1); i++) {
+            int sockfd = sess->num_paths > 0 ? sess->paths[i].sockfd : sess->sockfd;
+            unsigned int found = pmtuSearch(sockfd, sess->ai->ai_addr, sess->ai->ai_addrlen, timeout_ms);
+            if (found > 0 && (plpmtu == 0 || found < plpmtu)) {
+                plpmtu = found;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &sess->pmtu_time);
+        printf("Path MTU search took %.3f ms: ", get_time_diff(now, sess->pmtu_time));
+        if (plpmtu > 0) {
+            printf("%u bytes\n", plpmtu);
+        } else {
+            printf("server didn't answer, fragments stay %d bytes\n", FRAG_SIZE);
+        }
+        sess->plpmtu = plpmtu;
+        sess->pmtu_searched = 1;
+    }
+    if (sess->plpmtu == 0) {
+        return FRAG_SIZE;
+    }
+    return MIN(sess->plpmtu - pmtuOverhead(sess->ai->ai_family) - PKT_HEADER_MAX, MAX_FRAG_SIZE);
+}
+
+unsigned long long retryCookie(const char *buf, unsigned int transfer_id) {
+    // the cookie if this is the server asking us to retry the handshake with one, 0 if not
+    unsigned int id;
+    unsigned long long cookie;
+    if (sscanf(buf, "retry:%u:%llx", &id, &cookie) != 2 || id != transfer_id) {
+        return 0;
+    }
+    return cookie;
+}
+
+void sendHandshake(int sockfd, const char *tag, const struct handshake *hs, struct addrinfo *ai) {
+    char send_buf[MAXBUFLEN];
+    size_t send_len = serializeHandshake(tag, hs, send_buf, MAXBUFLEN);
+    sendMsg(sockfd, send_buf, send_len, ai->ai_addr, ai->ai_addrlen);
+}
+
+void sendChunkQuery(int sockfd, struct addrinfo *ai, const struct sender *s, const struct manifest *m, unsigned long long index) {
+    // query index covers chunks [index * CHUNKS_PER_QUERY, + CHUNKS_PER_QUERY)
+    struct chunk_query q;
+    q.transfer_id = s->transfer_id;
+    q.total = m->count;
+    q.first = index * CHUNKS_PER_QUERY;
+    q.offset = m->chunks[q.first].offset;
+    q.count = MIN(m->count - q.first, CHUNKS_PER_QUERY);
+    memcpy(q.chunks, m->chunks + q.first, q.count * sizeof(struct chunk));
+
+    char send_buf[MAXBUFLEN];
+    size_t send_len = serializeChunkQuery(&q, send_buf, MAXBUFLEN);
+    sendMsg(sockfd, send_buf, send_len, ai->ai_addr, ai->ai_addrlen);
+}
+
+int queryChunks(struct session *sess, struct sender *s) {
+    // before sending the rest of the file, find out which of its chunks the server already has.
+    // all of it has to be answered before a dup record goes out since the server finds chunks by
+    // offset, so this runs to the end with up to a window of queries out, and acks for the early
+    // data that arrive meanwhile go to the sender as usual. -1 if the server stopped answering
+    int sockfd = sess->sockfd;
+    struct addrinfo *ai = sess->ai;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct manifest *m = manifestBuild(s->src->fd, s->src->size, 0);
+    unsigned long long queries = (m->count + CHUNKS_PER_QUERY - 1) / CHUNKS_PER_QUERY;
+    char *answered = calloc(MAX(queries, 1), 1);
+    if (answered == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for chunk queries\n");
+        exit(1);
+    }
+    for (unsigned long long i = 0; i < m->count; i++) {
+        m->chunks[i].have = 0; // until the server says so
+    }
+
+    unsigned long long lo = 0, next = 0; // queries before lo are answered, before next have been sent
+    int timeouts = 0;
+    while (lo < queries) {
+        for (; next < queries && next < lo + s->max_window; next++) {
+            sendChunkQuery(sockfd, ai, s, m, next);
+        }
+
+        char recv_buf[MAXBUFLEN];
+        int numbytes = sessionRecv(sess, recv_buf, s->timeout_ms);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (numbytes == -1) { // resend whatever's still unanswered
+            if (++timeouts > MAX_TIMEOUTS) {
+                fprintf(stderr, "Server stopped responding, giving up.\n");
+                free(answered);
+                manifestFree(m);
+                return -1;
+            }
+            for (unsigned long long i = lo; i < next; i++) {
+                if (!answered[i]) {
+                    sendChunkQuery(sockfd, ai, s, m, i);
+                }
+            }
+            continue;
+        }
+
+        struct chunk_answer answer;
+        struct ackpkt ack;
+        if (deserializeChunkAnswer(recv_buf, numbytes, &answer) == 0 && answer.transfer_id == s->transfer_id &&
+                answer.first % CHUNKS_PER_QUERY == 0 && answer.first / CHUNKS_PER_QUERY < next) {
+            timeouts = 0;
+            unsigned long long index = answer.first / CHUNKS_PER_QUERY;
+            for (unsigned int i = 0; i < answer.count && answer.first + i < m->count; i++) {
+                m->chunks[answer.first + i].have = (answer.have >> i) & 1;
+            }
+            answered[index] = 1;
+            while (lo < queries && answered[lo]) {
+                lo++;
+            }
+        } else if (deserializeAck(recv_buf, numbytes, &ack) == 0 && ack.transfer_id == s->transfer_id) {
+            senderOnAck(s, &ack, now);
+        }
+    }
+    free(answered);
+
+    unsigned long long have = 0;
+    off_t have_bytes = 0;
+    for (unsigned long long i = 0; i < m->count; i++) {
+        have += m->chunks[i].have;
+        have_bytes += m->chunks[i].have ? m->chunks[i].len : 0;
+    }
+    printf("Server already has %llu of %llu chunks (%lld of %lld bytes), asking took %.3f ms\n", have, m->count,
+           (long long) have_bytes, (long long) s->src->size, get_time_diff(start, now));
+    s->dedup = m;
+    return 0;
+}
+
+int uploadFile(struct session *sess, int fd, const char *filename) {
+    // -1 if the server said no or stopped answering. anything but a regular file is streamed,
+    // read as it comes without knowing how big it'll be
+    int sockfd = sess->sockfd;
+    struct addrinfo *ai = sess->ai;
+    enum cc_algo cc = sess->cc;
+    struct file_source src = {0};
+    src.fd = fd;
+    struct stat st;
+    fstat(src.fd, &st);
+    src.size = st.st_size;
+    src.stream = !S_ISREG(st.st_mode);
+    int fd_flags = fcntl(fd, F_GETFL);
+    if (src.stream && fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK) == -1) { // so an idle pipe doesn't hold up acks
+        perror("fcntl");
+        exit(1);
+    }
+
+    struct handshake hs;
+    fillHandshake(sockfd, filename, src.stream ? 0 : src.size, &hs);
+    hs.frag_size = sessionFragSize(sess); // before anything's cut up by it
+    hs.cookie = sess->cookie;
+    struct merkle *tree = NULL;
+    if (src.stream) { // nothing else works without the whole file in hand
+        hs.flags = FEATURE_STREAM;
+    } else {
+        tree = merkleBuild(&src, hs.frag_size); // the server checks what it got against its root
+        memcpy(hs.root, tree->root, SHA256_LEN);
+    }
+
+    struct sender snd;
+    senderInit(&snd, sockfd, ai->ai_addr, ai->ai_addrlen, &hs, &src, cc);
+    snd.verbose = sess->verbose;
+    snd.merkle = tree;
+    if (sess->num_paths > 1) {
+        pathsInit(&snd, sess->paths, sess->num_paths);
+    }
+    senderReadAhead(&snd, sess->read_ahead);
+    if (sess->warm) { // same path as the last transfer, start where it left off
+        snd.estimatedRTT = sess->estimatedRTT;
+        snd.devRTT = sess->devRTT;
+        senderSetTimeout(&snd, MIN(snd.estimatedRTT + 4 * snd.devRTT + ACK_DELAY_MS, MAX_TIMEOUT));
+        snd.ssthresh = sess->ssthresh;
+    }
+
+    if (src.stream) {
+        printf("Streaming %s, size unknown until it ends\n", filename);
+    } else {
+        printf("File %s is %lld bytes long, %llu fragments of %u bytes\n", filename, (long long) src.size, snd.total_frag, snd.frag_size);
+    }
+
+    // 0-RTT: the handshake goes out followed right away by the first window of data,
+    // the server answers "yes" and acks it all in the same round trip
+    int accepted = 0;
+    int failed = 0;
+    int hs_retransmitted = 0;
+    struct timespec hs_time, xfer_start, now;
+    clock_gettime(CLOCK_MONOTONIC, &xfer_start);
+    hs_time = xfer_start;
+    sendHandshake(sockfd, "ftp", &hs, ai);
+
+    // begin transmission
+    while (!senderDone(&snd) || !accepted) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        senderFill(&snd, now);
+
+        char recv_buf[MAXBUFLEN];
+        int numbytes = -1;
+        double wait_ms = senderWaitTime(&snd, now);
+        if (wait_ms > 0) {
+            numbytes = sessionRecv(sess, recv_buf, wait_ms);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (numbytes == -1) { // timeout
+            if (senderTimeLeft(&snd, now) > 0) {
+                continue; // just woke up to send the next paced fragment
+            }
+            if (!accepted) { // handshake (or the reply) got lost, it has to go out again along with the data
+                printf("INITIAL MESSAGE TIMEOUT: waited %.6f ms\n", snd.timeout_ms);
+                hs_retransmitted = 1;
+                sendHandshake(sockfd, "ftp", &hs, ai);
+            }
+            if (senderOnTimeout(&snd, now) == -1) {
+                fprintf(stderr, "Server stopped responding, giving up.\n");
+                failed = 1;
+                break;
+            }
+            continue;
+        }
+
+        if (strcmp(recv_buf, "no") == 0) {
+            if (accepted) { // instead of the last ack
+                printf("Server threw the file away, it didn't match our merkle root.\n");
+            } else {
+                printf("Server cannot accept file transfer right now.\n");
+            }
+            failed = 1;
+            break;
+        }
+        unsigned long long cookie = accepted ? 0 : retryCookie(recv_buf, hs.transfer_id);
+        if (cookie != 0) { // busy server, it threw away the early data too
+            printf("Server asked us to retry with a cookie.\n");
+            hs.cookie = cookie;
+            hs_time = now;
+            sendHandshake(sockfd, "ftp", &hs, ai);
+            senderRestart(&snd, now);
+            continue;
+        }
+
+        struct handshake reply;
+        if (deserializeHandshake(recv_buf, numbytes, "yes", &reply) == 0) {
+            if (accepted || reply.transfer_id != hs.transfer_id) {
+                continue;
+            }
+            accepted = 1;
+            sess->cookie = reply.cookie;
+
+            double rtt = get_time_diff(hs_time, now);
+            if (hs_retransmitted) { // if first message required retransmissions, then the RTT we measured isn't rlly valid
+                printf("Round-Trip Time (likely invalid, required retransmissions): %.6f milliseconds\n", rtt);
+            } else {
+                printf("Round-Trip Time: %.6f milliseconds\n", rtt);
+                senderRTTSample(&snd, rtt);
+            }
+
+            senderSetLimits(&snd, &reply);
+            if (!(snd.flags & FEATURE_MERKLE)) {
+                snd.merkle = NULL;
+            }
+            if (src.stream && !(snd.flags & FEATURE_STREAM)) {
+                printf("Server cannot take a stream of unknown size.\n");
+                failed = 1;
+                break;
+            }
+            printf("A file transfer can start. (window %u, features 0x%x)\n", snd.max_window, reply.flags);
+            if (snd.flags & FEATURE_DEDUP && queryChunks(sess, &snd) == -1) {
+                failed = 1;
+                break;
+            }
+            continue;
+        }
+
+        unsigned int transfer_id;
+        int merkle_msg = merkleMsg(recv_buf, &transfer_id);
+        if (merkle_msg == MERKLE_VERIFY) { // server checking blocks it has, the last ack waits on these
+            senderOnVerify(&snd, recv_buf, numbytes);
+            continue;
+        } else if (merkle_msg == MERKLE_RESEND) {
+            senderOnResend(&snd, recv_buf, numbytes);
+            continue;
+        }
+
+        unsigned long long challenge;
+        if (sscanf(recv_buf, "challenge:%u:%llx", &transfer_id, &challenge) == 2) {
+            // data went out from an address the server hasn't seen us on, it wants to know that's
+            // really us before it sends acks there. answer from that same address
+            if (transfer_id == hs.transfer_id) {
+                char send_buf[64];
+                int send_len = snprintf(send_buf, sizeof send_buf, "response:%u:%llx", transfer_id, challenge);
+                if (snd.paths) {
+                    pathSend(&snd, sess->recv_path, send_buf, send_len + 1);
+                } else {
+                    sendMsg(sockfd, send_buf, send_len + 1, ai->ai_addr, ai->ai_addrlen);
+                }
+            }
+            continue;
+        }
+
+        struct ackpkt ack_nack;
+        if (deserializeAck(recv_buf, numbytes, &ack_nack) == -1 || ack_nack.transfer_id != hs.transfer_id) {
+            continue;
+        }
+        accepted = 1; // acks imply the server took the handshake, even if its "yes" got lost
+        senderOnAck(&snd, &ack_nack, now);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = get_time_diff(xfer_start, now);
+    sess->stats.busy_ms += elapsed;
+    if (src.stream) {
+        fcntl(fd, F_SETFL, fd_flags);
+        src.size = snd.stream_bytes;
+    }
+    if (failed) {
+        senderClose(&snd);
+        merkleFree(tree);
+        return -1;
+    }
+    printf("Finished transmitting file.\n");
+    if (src.stream) {
+        printf("Streamed %lld bytes, %llu fragments\n", (long long) src.size, snd.total_frag - 1);
+    }
+    printf("%s: %.3f ms, %.2f MB/s, %u timeout retransmits, %u fast retransmits, %llu fragments sent as holes\n", ccName(cc), elapsed,
+           elapsed > 0 ? src.size / (elapsed * 1000) : 0, snd.retransmits, snd.fast_retransmits, snd.hole_frags);
+    if (snd.read_stalls > 0) {
+        printf("window was open but read-ahead hadn't caught up %llu times\n", snd.read_stalls);
+    }
+    if (snd.stored_frags > 0) {
+        printf("%llu fragments the server already had went as dup records\n", snd.stored_frags);
+    }
+    if (snd.rwnd_stalls > 0) {
+        printf("held back by the server's receive window %llu times\n", snd.rwnd_stalls);
+    }
+    if (snd.probes > 0) {
+        printf("%llu zero window probes\n", snd.probes);
+    }
+    if (snd.repaired_frags > 0) {
+        printf("%llu fragments sent again because their block failed verification\n", snd.repaired_frags);
+    }
+    for (int i = 0; snd.paths && i < snd.num_paths; i++) {
+        const struct path *p = &snd.paths[i];
+        printf("path %s: %llu fragments sent, %llu lost, srtt %.3f ms%s\n", p->name, p->sent, p->lost, p->srtt,
+               p->state == PATH_UP ? "" : ", down");
+    }
+    if (snd.rerouted_frags > 0) {
+        printf("%llu fragments moved off paths that went down\n", snd.rerouted_frags);
+    }
+    if (snd.split_frags > 0) { // the path MTU went down, find out what it is now before the next transfer
+        printf("%llu fragments sent in parts\n", snd.split_frags);
+        sess->pmtu_searched = 0;
+    }
+
+    sess->stats.bytes += src.size;
+    sess->stats.retransmits += snd.retransmits + snd.fast_retransmits;
+    sess->warm = 1;
+    sess->estimatedRTT = snd.estimatedRTT;
+    sess->devRTT = snd.devRTT;
+    sess->ssthresh = snd.ssthresh;
+
+    senderClose(&snd);
+    merkleFree(tree);
+    return 0;
+}
+
+int mcastSendFile(struct session *sess, int fd, const char *filename) {
+    // upload to every server listening on the group at once. there's no handshake, servers start
+    // on our announcement, and we're done once nobody's nacked anything for a while
+    int sockfd = sess->sockfd;
+    struct file_source src = {0};
+    src.fd = fd;
+    struct stat st;
+    fstat(src.fd, &st);
+    if (!S_ISREG(st.st_mode)) { // late joiners need fragments from the start, we'd have to keep all of it
+        fprintf(stderr, "Can only multicast regular files, not streams.\n");
+        return -1;
+    }
+    src.size = st.st_size;
+    if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &sess->mcast_if, sizeof sess->mcast_if) == -1) {
+        perror("setsockopt IP_MULTICAST_IF");
+        exit(1);
+    }
+
+    struct mcast_sender m;
+    mcastSenderInit(&m, sockfd, sess->ai->ai_addr, sess->ai->ai_addrlen, &src, filename, sess->rate_mb);
+    printf("Multicasting %s, %lld bytes, %llu fragments at %.1f MB/s\n", filename, (long long) src.size, m.total_frag, sess->rate_mb);
+
+    struct timespec xfer_start, now;
+    clock_gettime(CLOCK_MONOTONIC, &xfer_start);
+    now = xfer_start;
+    while (!mcastSenderDone(&m, now)) {
+        mcastSenderStep(&m, now);
+
+        char recv_buf[MAXBUFLEN];
+        int numbytes = -1;
+        double wait_ms = mcastSenderTimeLeft(&m, now);
+        if (wait_ms > 0) {
+            numbytes = recvMsg(sockfd, recv_buf, MIN(wait_ms, MCAST_LINGER_MS));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (numbytes != -1 && strncmp(recv_buf, "mnack:", 6) == 0) {
+            mcastSenderOnNack(&m, recv_buf, numbytes, now);
+        }
+    }
+
+    double elapsed = get_time_diff(xfer_start, now) - MCAST_LINGER_MS;
+    printf("Finished multicasting file.\n");
+    printf("%.3f ms before lingering, %llu fragments sent once, %llu repairs for %llu nacks\n", elapsed, m.total_frag, m.repairs_sent, m.nacks);
+    sess->stats.busy_ms += get_time_diff(xfer_start, now);
+    sess->stats.bytes += src.size;
+    mcastSenderClose(&m);
+    return 0;
+}
+
+int downloadFile(struct session *sess, const char *filename) {
+    // we ask with "get", the server answers "yes" with the file size and starts sending. -1 if it
+    // said no or stopped answering
+    int sockfd = sess->sockfd;
+    struct addrinfo *ai = sess->ai;
+    struct handshake hs;
+    fillHandshake(sockfd, filename, 0, &hs);
+    hs.frag_size = sessionFragSize(sess);
+    hs.cookie = sess->cookie;
+
+    char recv_buf[MAXBUFLEN];
+    double timeout_ms = sess->warm ? MIN(sess->estimatedRTT + 4 * sess->devRTT + ACK_DELAY_MS, MAX_TIMEOUT) : 100;
+    int timeouts = 0;
+    struct handshake reply;
+    struct timespec xfer_start, now;
+    clock_gettime(CLOCK_MONOTONIC, &xfer_start);
+
+    while (1) { // keep retransmitting if timeout
+        sendHandshake(sockfd, "get", &hs, ai);
+        int numbytes = recvMsg(sockfd, recv_buf, timeout_ms);
+
+        if (numbytes == -1) { // timeout
+            printf("INITIAL MESSAGE TIMEOUT: waited %.6f ms\n", timeout_ms);
+            timeout_ms = MIN(timeout_ms * 2, MAX_TIMEOUT);
+            if (++timeouts > MAX_TIMEOUTS) {
+                fprintf(stderr, "Server stopped responding, giving up.\n");
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(recv_buf, "no") == 0) {
+            printf("Server cannot send that file.\n");
+            return -1;
+        }
+        unsigned long long cookie = retryCookie(recv_buf, hs.transfer_id);
+        if (cookie != 0) { // busy server, ask again with it. the RTT sample starts over too
+            printf("Server asked us to retry with a cookie.\n");
+            hs.cookie = cookie;
+            clock_gettime(CLOCK_MONOTONIC, &xfer_start);
+            continue;
+        }
+        if (deserializeHandshake(recv_buf, numbytes, "yes", &reply) == 0 && reply.transfer_id == hs.transfer_id) {
+            sess->cookie = reply.cookie;
+            break;
+        }
+        // data that beat the "yes" here, the server will resend it
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timeouts == 0) { // the reply's as good an RTT sample as any
+        double rtt = get_time_diff(xfer_start, now);
+        sess->estimatedRTT = sess->warm ? 0.875 * sess->estimatedRTT + 0.125 * rtt : rtt;
+        sess->devRTT = sess->warm ? sess->devRTT : rtt / 2;
+        sess->ssthresh = sess->warm ? sess->ssthresh : MAX_WINDOW;
+        sess->warm = 1;
+    }
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    if (ftruncate(fd, reply.file_size) == -1) {
+        perror("ftruncate");
+    }
+
+    struct receiver rcv;
+    receiverInit(&rcv, sockfd, ai->ai_addr, ai->ai_addrlen, &reply, fd);
+    rcv.verbose = sess->verbose;
+    int threaded = sess->threaded;
+    struct writer writer;
+    if (threaded) { // so a slow disk doesn't hold up our acks
+        writerStart(&writer, 0);
+        rcv.writer = &writer;
+    }
+    printf("A file transfer can start. File %s is %lld bytes long, %llu fragments of %u bytes\n", filename, reply.file_size, rcv.total_frag, rcv.frag_size);
+
+    struct timespec last_data = xfer_start;
+    int failed = 0;
+    while (!receiverDone(&rcv)) {
+        if (receiverMerkleFailed(&rcv)) {
+            failed = 1;
+            break;
+        }
+        // wake up for a delayed ack or merkle check if one is waiting
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double wait_ms = receiverTimeLeft(&rcv, now);
+        int numbytes = -1;
+        if (wait_ms > 0) {
+            numbytes = recvMsg(sockfd, recv_buf, wait_ms);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (numbytes == -1) {
+            receiverOnTimer(&rcv, now);
+            if (get_time_diff(last_data, now) >= MAX_TIMEOUT) {
+                fprintf(stderr, "Server stopped sending, giving up.\n");
+                failed = 1;
+                break;
+            }
+            continue;
+        }
+
+        struct packet pkt;
+        unsigned int transfer_id;
+        if (isDataPkt(recv_buf) && deserializePkt(recv_buf, numbytes, &pkt) == 0) {
+            last_data = now;
+            receiverOnData(&rcv, &pkt, now);
+        } else if (merkleMsg(recv_buf, &transfer_id) == MERKLE_TREE) {
+            last_data = now;
+            receiverOnTree(&rcv, recv_buf, numbytes, now);
+        }
+    }
+
+    if (threaded) {
+        writerStop(&writer); // wait for the disk to catch up
+    }
+    close(fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sess->stats.busy_ms += get_time_diff(xfer_start, now);
+    if (failed) {
+        if (receiverMerkleFailed(&rcv)) { // we have every byte the server sent, but not the file it meant
+            unlink(filename);
+        }
+        merkleFree(rcv.merkle);
+        return -1;
+    }
+    sess->stats.bytes += reply.file_size;
+    printf("Finished receiving file.\n");
+    printf("%.3f ms, %llu acks sent, %llu fragments were holes\n", get_time_diff(xfer_start, now), rcv.acks_sent, rcv.hole_frags);
+    if (rcv.merkle) {
+        printf("verified against the merkle root, %llu bad blocks fetched again\n", rcv.merkle->bad_blocks);
+        merkleFree(rcv.merkle);
+    }
+    if (threaded) {
+        printf("%llu fragments written in %llu pwritev calls\n", writer.frags_written, writer.pwritevs);
+    }
+    if (rcv.part_frags > 0) { // the server had to split them, the path MTU went down
+        printf("%llu fragments came in parts\n", rcv.part_frags);
+        sess->pmtu_searched = 0;
+    }
+    return 0;
+}
+
+int sessionOpen(struct session *s, const char *host, const char *port) {
+    // looks the server (or group) up and gets a socket for it, -1 if we can't. options have their
+    // defaults after this, set any others before the first transfer
+    memset(s, 0, sizeof *s);
+    s->cc = CC_RENO;
+    s->threaded = 1;
+    s->read_ahead = (off_t) READ_AHEAD_MB << 20;
+    s->rate_mb = MCAST_RATE_MB;
+    s->mcast_if.s_addr = htonl(INADDR_ANY);
+
+    // POPULATE ADDRINFOS
+    int status;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    // no need for us to use inet_pton since getaddrinfo accepts a string ip address (or hostname)
+    if ((status = getaddrinfo(host, port, &hints, &s->servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+        return -1;
+    }
+
+    // loop thru and get first socket we can
+    for (s->ai = s->servinfo; s->ai != NULL; s->ai = s->ai->ai_next) {
+        s->sockfd = socket(s->ai->ai_family, s->ai->ai_socktype, s->ai->ai_protocol);
+        if (s->sockfd == -1) {
+            perror("socket");
+            continue;
+        }
+        break;
+    }
+    if (s->ai == NULL) {
+        fprintf(stderr, "client failed to bind socket\n");
+        freeaddrinfo(s->servinfo);
+        return -1;
+    }
+
+    // a multicast group as the address means every server that joined it
+    s->is_mcast = IN_MULTICAST(ntohl(((struct sockaddr_in *) s->ai->ai_addr)->sin_addr.s_addr));
+    // for transfer ids. time and pid alone collide for clients started together: pids p and p^1
+    // either side of a second boundary get the same seed
+    unsigned int seed = time(NULL) ^ getpid();
+    int random_fd = open("/dev/urandom", O_RDONLY);
+    if (random_fd != -1) {
+        if (read(random_fd, &seed, sizeof seed) != sizeof seed) {
+            seed = time(NULL) ^ getpid();
+        }
+        close(random_fd);
+    }
+    srand(seed);
+    return 0;
+}
+
+int sessionSend(struct session *s, const char *filename) {
+    // upload filename under the same name, 0 once the server has all of it
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        s->stats.files += 1;
+        s->stats.failed += 1;
+        return -1;
+    }
+    int result = sessionSendFd(s, fd, filename);
+    close(fd);
+    return result;
+}
+
+int sessionSendFd(struct session *s, int fd, const char *name) {
+    // upload what fd reads as name. a pipe (stdin from tar, say) is
+    // streamed as it's written, the server finds out the size at the end
+    int result = s->is_mcast ? mcastSendFile(s, fd, name) : uploadFile(s, fd, name);
+    s->stats.files += 1;
+    s->stats.failed += result == -1;
+    return result;
+}
+
+int sessionGet(struct session *s, const char *filename) {
+    // download filename into the current directory, 0 once we have all of it
+    int result = -1;
+    if (s->is_mcast) {
+        fprintf(stderr, "Can only upload (ftp) to a multicast group.\n");
+    } else {
+        result = downloadFile(s, filename);
+    }
+    s->stats.files += 1;
+    s->stats.failed += result == -1;
+    return result;
+}
+
+const struct session_stats *sessionStats(const struct session *s) {
+    return &s->stats;
+}
+
+int sessionPaths(struct session *s, const char *list) {
+    // spread uploads over several local addresses or interfaces, list is comma separated. the
+    // session's socket is bound to the first and each of the others gets one of its own. an
+    // entry that isn't an address is taken as an interface name. -1 if any of them won't bind
+    if (s->is_mcast) {
+        fprintf(stderr, "Multipath needs a server, not a multicast group.\n");
+        return -1;
+    }
+    char buf[MAX_PATHS * 64];
+    strncpy(buf, list, sizeof buf - 1);
+    buf[sizeof buf - 1] = '\0';
+    char *save;
+    for (char *name = strtok_r(buf, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        if (s->num_paths == MAX_PATHS) {
+            fprintf(stderr, "At most %d paths.\n", MAX_PATHS);
+            return -1;
+        }
+        struct path *p = &s->paths[s->num_paths];
+        memset(p, 0, sizeof *p);
+        strncpy(p->name, name, sizeof p->name - 1);
+        p->sockfd = s->num_paths == 0 ? s->sockfd : socket(s->ai->ai_family, s->ai->ai_socktype, s->ai->ai_protocol);
+        if (p->sockfd == -1) {
+            perror("socket");
+            return -1;
+        }
+        s->num_paths += 1; // so sessionClose gets it whatever happens next
+
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof local);
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (inet_pton(AF_INET, name, &local.sin_addr) != 1 &&
+                setsockopt(p->sockfd, SOL_SOCKET, SO_BINDTODEVICE, name, strlen(name)) == -1) {
+            fprintf(stderr, "path %s: not an address, and SO_BINDTODEVICE: %s\n", name, strerror(errno));
+            return -1;
+        }
+        if (bind(p->sockfd, (struct sockaddr *) &local, sizeof local) == -1) {
+            fprintf(stderr, "path %s: bind: %s\n", name, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void sessionClose(struct session *s) {
+    freeaddrinfo(s->servinfo);
+    close(s->sockfd);
+    for (int i = 1; i < s->num_paths; i++) {
+        close(s->paths[i].sockfd);
+    }
+}
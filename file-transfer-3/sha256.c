@@ -0,0 +1,107 @@
+#include "transfer.h"
+
+// plain SHA-256 (FIPS 180-4), what chunks are named by in the dedup store. nothing here
+// needs to be fast, the disk and the network are slower
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256Block(struct sha256 *c, const unsigned char *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 | (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = c->h[0], b = c->h[1], d = c->h[3], e = c->h[4], f = c->h[5], g = c->h[6], h = c->h[7];
+    uint32_t cc = c->h[2];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = cc;
+        cc = b;
+        b = a;
+        a = t1 + t2;
+    }
+    c->h[0] += a;
+    c->h[1] += b;
+    c->h[2] += cc;
+    c->h[3] += d;
+    c->h[4] += e;
+    c->h[5] += f;
+    c->h[6] += g;
+    c->h[7] += h;
+}
+
+void sha256Init(struct sha256 *c) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(c->h, init, sizeof init);
+    c->len = 0;
+    c->buf_len = 0;
+}
+
+void sha256Update(struct sha256 *c, const void *data, size_t len) {
+    const unsigned char *p = data;
+    c->len += len;
+    if (c->buf_len > 0) { // top up the partial block from last time first
+        size_t take = MIN(len, 64 - c->buf_len);
+        memcpy(c->buf + c->buf_len, p, take);
+        c->buf_len += take;
+        p += take;
+        len -= take;
+        if (c->buf_len < 64) {
+            return;
+        }
+        sha256Block(c, c->buf);
+        c->buf_len = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) {
+        sha256Block(c, p);
+    }
+    memcpy(c->buf, p, len);
+    c->buf_len = len;
+}
+
+void sha256Final(struct sha256 *c, unsigned char *digest) {
+    // digest is SHA256_LEN bytes
+    uint64_t bits = c->len * 8;
+    unsigned char pad[72] = {0x80};
+    size_t pad_len = (c->buf_len < 56 ? 56 : 120) - c->buf_len;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = bits >> (56 - i * 8);
+    }
+    sha256Update(c, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = c->h[i] >> 24;
+        digest[i * 4 + 1] = c->h[i] >> 16;
+        digest[i * 4 + 2] = c->h[i] >> 8;
+        digest[i * 4 + 3] = c->h[i];
+    }
+}
+
+void sha256(const void *data, size_t len, unsigned char *digest) {
+    struct sha256 c;
+    sha256Init(&c);
+    sha256Update(&c, data, len);
+    sha256Final(&c, digest);
+}
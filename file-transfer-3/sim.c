@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "transfer.h"
+
+// discrete-event simulator: the same sender and receiver deliver and server run, talking over a
+// simulated link on a virtual clock instead of sockets. time jumps straight to the next thing that
+// happens (a datagram arriving, an RTO, an ack timer, the next paced send), so hours of transfer
+// over a slow lossy path take seconds, and the same seed always gives the same run
+
+struct sim_link sim;
+
+unsigned long long simRandom(struct sim_link *l) {
+    // xorshift64*, rand() is left to bbr
+    l->rng ^= l->rng >> 12;
+    l->rng ^= l->rng << 25;
+    l->rng ^= l->rng >> 27;
+    return l->rng * 0x2545f4914f6cdd1dULL;
+}
+
+int simLost(struct sim_link *l, double p) {
+    return p > 0 && (simRandom(l) >> 11) * (1.0 / (1ULL << 53)) < p;
+}
+
+void simPush(struct sim_queue *q, const void *msg, size_t len, struct timespec arrive) {
+    if (q->len == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 256;
+        struct sim_datagram *grown = malloc(cap * sizeof *grown);
+        if (grown == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for simulated link\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < q->len; i++) { // unwrap it while we're at it
+            grown[i] = q->q[(q->head + i) % q->cap];
+        }
+        free(q->q);
+        q->q = grown;
+        q->head = 0;
+        q->cap = cap;
+    }
+    struct sim_datagram *d = &q->q[(q->head + q->len) % q->cap];
+    d->arrive = arrive;
+    d->len = len;
+    memcpy(d->buf, msg, len);
+    q->len += 1;
+}
+
+struct sim_datagram *simArrived(struct sim_queue *q, struct timespec now) {
+    // the next datagram that's got to the other end by now, NULL if none has
+    if (q->len == 0 || get_time_diff(q->q[q->head].arrive, now) < 0) {
+        return NULL;
+    }
+    struct sim_datagram *d = &q->q[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->len -= 1;
+    return d; // good until the next simPush
+}
+
+void simSend(int sockfd, const void *msg, size_t len) {
+    // sendMsg's hook. data waits its turn at the bottleneck, or is dropped if the queue's full
+    struct sim_link *l = &sim;
+    if (sockfd == SIM_RECEIVER_FD) {
+        l->acks_sent += 1;
+        if (simLost(l, l->ack_loss)) {
+            l->acks_lost += 1;
+            return;
+        }
+        simPush(&l->acks, msg, len, add_time_ms(l->now, l->delay_ms));
+        return;
+    }
+
+    l->data_sent += 1;
+    if (simLost(l, l->loss)) {
+        l->lost += 1;
+        return;
+    }
+    double queued_ms = MAX(get_time_diff(l->now, l->busy_until), 0);
+    if (queued_ms * l->bw + len > l->queue_bytes) {
+        l->queue_drops += 1;
+        return;
+    }
+    l->busy_until = add_time_ms(queued_ms > 0 ? l->busy_until : l->now, len / l->bw);
+    simPush(&l->data, msg, len, add_time_ms(l->busy_until, l->delay_ms));
+}
+
+int main(int argc, char *argv[]) {
+    double size_mb = 100, bw_mbit = 100, rtt_ms = 200, loss_pct = 0, ack_loss_pct = 0, queue_kb = -1;
+    unsigned int frag_size = FRAG_SIZE;
+    unsigned long long seed = 1;
+    enum cc_algo cc = CC_RENO;
+    int verbose = 0;
+    for (int i = 1; i < argc; i++) {
+        if (parseCC(argv[i]) != -1) {
+            cc = parseCC(argv[i]);
+            continue;
+        }
+        if (strcmp(argv[i], "verbose") == 0) {
+            verbose = 1;
+            continue;
+        }
+        int ok = (sscanf(argv[i], "size=%lf", &size_mb) == 1 && size_mb > 0) ||
+                 (sscanf(argv[i], "bw=%lf", &bw_mbit) == 1 && bw_mbit > 0) ||
+                 (sscanf(argv[i], "rtt=%lf", &rtt_ms) == 1 && rtt_ms >= 0) ||
+                 (sscanf(argv[i], "loss=%lf", &loss_pct) == 1 && loss_pct >= 0 && loss_pct < 100) ||
+                 (sscanf(argv[i], "ackloss=%lf", &ack_loss_pct) == 1 && ack_loss_pct >= 0 && ack_loss_pct < 100) ||
+                 (sscanf(argv[i], "queue=%lf", &queue_kb) == 1 && queue_kb > 0) ||
+                 (sscanf(argv[i], "frag=%u", &frag_size) == 1 && frag_size > 0 && frag_size <= MAX_FRAG_SIZE) ||
+                 (sscanf(argv[i], "seed=%llu", &seed) == 1 && seed != 0);
+        if (!ok) {
+            fprintf(stderr, "Usage: sim [reno|bbr] [size=<MB>] [bw=<Mbit/s>] [rtt=<ms>] [loss=<%%>] [ackloss=<%%>] [queue=<KB>] [frag=<bytes>] [seed=<n>] [verbose]\n");
+            return 1;
+        }
+    }
+
+    memset(&sim, 0, sizeof sim);
+    sim.bw = bw_mbit * 1e6 / 8 / 1000;
+    sim.delay_ms = rtt_ms / 2;
+    sim.queue_bytes = queue_kb > 0 ? queue_kb * 1024 : MAX(sim.bw * rtt_ms, MAXBUFLEN); // a BDP by default
+    sim.loss = loss_pct / 100;
+    sim.ack_loss = ack_loss_pct / 100;
+    sim.rng = seed;
+    sim.now.tv_sec = 1;
+    sim.busy_until = sim.now;
+    srand(seed);
+    send_hook = simSend;
+
+    // the file is a mapping nothing ever touches, reads of it are the zero page. no sparse
+    // feature, so the zeros still go as data, and the receiver writes them to /dev/null
+    struct file_source src;
+    memset(&src, 0, sizeof src);
+    src.size = (off_t) (size_mb * (1 << 20));
+    src.map = mmap(NULL, src.size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    int out_fd = open("/dev/null", O_WRONLY);
+    if (src.map == MAP_FAILED || out_fd == -1) {
+        perror("sim setup");
+        exit(1);
+    }
+
+    // both ends as if the handshake just went through: no features, the whole window
+    struct handshake hs;
+    memset(&hs, 0, sizeof hs);
+    hs.version = PROTOCOL_VERSION;
+    hs.frag_size = frag_size;
+    hs.window = MAX_WINDOW;
+    hs.rcvbuf = MAX_WINDOW * MAXBUFLEN * 2;
+    hs.file_size = src.size;
+    hs.transfer_id = 1;
+    struct sockaddr_storage nowhere;
+    memset(&nowhere, 0, sizeof nowhere);
+    nowhere.ss_family = AF_INET;
+
+    struct sender snd;
+    senderInit(&snd, SIM_SENDER_FD, (struct sockaddr *) &nowhere, sizeof nowhere, &hs, &src, cc);
+    snd.timer_start = snd.delivered_time = snd.next_send_time = sim.now; // senderInit read the real clock
+    if (cc == CC_BBR) {
+        bbrInit(&snd, sim.now);
+    }
+    senderSetLimits(&snd, &hs);
+    senderRTTSample(&snd, rtt_ms); // what the handshake would've measured
+    snd.verbose = verbose;
+    struct receiver rcv;
+    receiverInit(&rcv, SIM_RECEIVER_FD, (struct sockaddr *) &nowhere, sizeof nowhere, &hs, out_fd);
+    rcv.last_heard = sim.now; // receiverInit read the real clock too
+    rcv.verbose = verbose;
+
+    // every timeout and fast retransmit gets printed, and a long lossy run has a lot of them
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    if (!verbose) {
+        dup2(out_fd, STDOUT_FILENO);
+    }
+
+    struct timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    struct timespec start = sim.now;
+    unsigned long long events = 0;
+    int failed = 0;
+    while (!senderDone(&snd)) {
+        senderFill(&snd, sim.now);
+
+        // on to whatever happens next
+        double wait_ms = MIN(senderWaitTime(&snd, sim.now), receiverTimeLeft(&rcv, sim.now));
+        if (sim.data.len > 0) {
+            wait_ms = MIN(wait_ms, get_time_diff(sim.now, sim.data.q[sim.data.head].arrive));
+        }
+        if (sim.acks.len > 0) {
+            wait_ms = MIN(wait_ms, get_time_diff(sim.now, sim.acks.q[sim.acks.head].arrive));
+        }
+        if (wait_ms > 0) {
+            sim.now = add_time_ms(sim.now, MAX(wait_ms, 1e-6)); // at least a nanosecond, or rounding could keep us here
+        }
+        events += 1;
+
+        struct sim_datagram *d;
+        while ((d = simArrived(&sim.data, sim.now)) != NULL) {
+            struct packet pkt;
+            if (deserializePkt(d->buf, d->len, &pkt) == 0) {
+                receiverOnData(&rcv, &pkt, sim.now);
+            }
+        }
+        if (receiverTimeLeft(&rcv, sim.now) <= 0) {
+            receiverOnTimer(&rcv, sim.now);
+        }
+        while ((d = simArrived(&sim.acks, sim.now)) != NULL) {
+            struct ackpkt ack;
+            if (deserializeAck(d->buf, d->len, &ack) == 0) {
+                senderOnAck(&snd, &ack, sim.now);
+            }
+        }
+        if (senderTimeLeft(&snd, sim.now) <= 0 && senderOnTimeout(&snd, sim.now) == -1) {
+            failed = 1;
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    // everything but the last line comes out the same for the same arguments, diff away
+    double sim_ms = get_time_diff(start, sim.now);
+    printf("%s, %.1f MB in %u byte fragments over %.1f Mbit/s, %.1f ms rtt, %.1f KB queue, %.2f%% loss, %.2f%% ack loss, seed %llu\n",
+           ccName(cc), size_mb, frag_size, bw_mbit, rtt_ms, sim.queue_bytes / 1024, loss_pct, ack_loss_pct, seed);
+    if (failed) {
+        printf("sender gave up after %d timeouts in a row, %llu of %llu fragments acked\n", MAX_TIMEOUTS, snd.base - 1, snd.total_frag);
+    }
+    printf("%.3f s simulated, %.2f MB/s (%.1f%% of the link)\n", sim_ms / 1000, src.size / sim_ms / 1000,
+           sim_ms > 0 ? 100 * src.size / sim_ms / sim.bw : 0);
+    printf("%llu data packets (%llu lost, %llu dropped at the queue), %llu acks (%llu lost)\n",
+           sim.data_sent, sim.lost, sim.queue_drops, sim.acks_sent, sim.acks_lost);
+    printf("%u timeout retransmits, %u fast retransmits, final cwnd %.1f, srtt %.3f ms, rto %.3f ms\n",
+           snd.retransmits, snd.fast_retransmits, snd.cwnd, snd.estimatedRTT, snd.timeout_ms);
+    printf("%llu events in %.3f s real\n", events, get_time_diff(wall_start, wall_end) / 1000);
+
+    senderClose(&snd);
+    munmap((void *) src.map, src.size);
+    close(out_fd);
+    free(sim.data.q);
+    free(sim.acks.q);
+    return failed;
+}
@@ -0,0 +1,57 @@
+#!/bin/bash
+# clients that vanish mid-upload: the server should give up on each once it's been idle=<s>
+# without hearing from it, close the file, delete the .part and free the transfer slot.
+# fills every slot (MAX_TRANSFERS) with an abandoned upload, then checks another one gets in
+# once they've timed out. run from file-transfer-3 after make
+SLOTS=64
+IDLE=10 # longer than a live but rate limited client goes between probes while they all start
+dir=$(pwd)
+work=$(mktemp -d)
+trap 'kill $server_pid 2>/dev/null; rm -rf "$work"' EXIT
+mkdir -p "$work/server" "$work/client"
+for i in $(seq 1 $SLOTS); do
+    head -c 1000000 /dev/urandom > "$work/client/big$i.bin"
+done
+head -c 100000 /dev/urandom > "$work/client/small.bin"
+
+port=$((20000 + RANDOM % 10000))
+cd "$work/server"
+stdbuf -oL "$dir/server_dir/server" $port rate=0.01 idle=$IDLE > server.log 2>&1 &
+server_pid=$!
+sleep 0.3
+fds=$(ls /proc/$server_pid/fd | wc -l)
+
+# uploads slowed to a crawl by the rate limit, so they're all still going when we kill them
+cd "$work/client"
+pids=""
+for i in $(seq 1 $SLOTS); do
+    echo "ftp big$i.bin" > cmd$i
+    "$dir/client_dir/deliver" 127.0.0.1 $port < cmd$i > /dev/null 2>&1 &
+    pids="$pids $!"
+done
+parts() {
+    ls "$work/server" | grep -c "part$"
+}
+for try in $(seq 1 80); do
+    [ "$(parts)" -eq $SLOTS ] && break
+    sleep 0.1
+done
+{ kill -9 $pids; wait $pids; } 2>/dev/null
+
+fail() {
+    echo "FAIL: $1"
+    tail -5 "$work/server/server.log"
+    exit 1
+}
+[ "$(parts)" -eq $SLOTS ] || fail "only $(parts) of $SLOTS uploads got started"
+echo "ftp small.bin" | timeout 10 "$dir/client_dir/deliver" 127.0.0.1 $port > /dev/null 2>&1
+[ -e "$work/server/small.bin" ] && fail "upload got in with every slot taken"
+
+sleep $((IDLE + 2))
+gave_up=$(grep -c "Gave up receiving file: big" "$work/server/server.log")
+[ "$gave_up" -eq $SLOTS ] || fail "gave up on $gave_up of $SLOTS abandoned uploads"
+[ "$(parts)" -eq 0 ] || fail "$(parts) .part files still there"
+[ "$(ls /proc/$server_pid/fd | wc -l)" -eq $fds ] || fail "server still has files open"
+echo "ftp small.bin" | timeout 10 "$dir/client_dir/deliver" 127.0.0.1 $port > /dev/null 2>&1
+cmp -s "$work/client/small.bin" "$work/server/small.bin" || fail "upload after the timeouts didn't get through"
+echo "abandon: OK"
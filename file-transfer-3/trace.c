@@ -0,0 +1,160 @@
+#include "transfer.h"
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+// event trace: every data packet, ack, timeout and RTO change as a 32 byte record, for working
+// out afterwards why a transfer went slow. a thread's first event gives it a ring of its own and
+// after that tracing is a clock read and a few stores. a flusher thread writes out every ring
+// each TRACE_FLUSH_MS, so the file is never more than that behind even if we get killed. if the
+// flusher gets that far behind, events are counted and dropped rather than held up for
+
+struct tracer *tracer = NULL;
+
+_Thread_local struct trace_ring *my_ring = NULL;
+
+void *traceLoop(void *arg);
+
+int traceStart(const char *filename) {
+    // -1 if the file can't be written
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open trace");
+        return -1;
+    }
+    struct trace_header header = {.record_size = sizeof(struct trace_record), .pid = getpid()};
+    memcpy(header.magic, TRACE_MAGIC, sizeof header.magic);
+    if (write(fd, &header, sizeof header) != sizeof header) {
+        perror("write trace");
+        close(fd);
+        return -1;
+    }
+
+    struct tracer *t = malloc(sizeof(struct tracer));
+    if (t == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for tracer\n");
+        exit(1);
+    }
+    t->fd = fd;
+    t->rings = NULL;
+    pthread_mutex_init(&t->lock, NULL);
+    atomic_init(&t->stop, 0);
+    if (pthread_create(&t->thread, NULL, traceLoop, t) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    tracer = t;
+    return 0;
+}
+
+struct trace_ring *traceRing(struct tracer *t) {
+    // this thread's ring, on its first event
+    struct trace_ring *ring = malloc(sizeof(struct trace_ring));
+    if (ring != NULL) {
+        ring->records = malloc(TRACE_RING_SIZE * sizeof(struct trace_record));
+    }
+    if (ring == NULL || ring->records == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for trace ring\n");
+        exit(1);
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    pthread_mutex_lock(&t->lock);
+    ring->next = t->rings;
+    t->rings = ring;
+    pthread_mutex_unlock(&t->lock);
+    my_ring = ring;
+    return ring;
+}
+
+void traceEvent(enum trace_event event, unsigned int transfer_id, unsigned long long frag_no, unsigned int count, unsigned int flags, unsigned int a, unsigned int b) {
+    struct tracer *t = tracer;
+    if (t == NULL) {
+        return;
+    }
+    struct trace_ring *ring = my_ring ? my_ring : traceRing(t);
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct trace_record *rec = &ring->records[head % TRACE_RING_SIZE];
+    rec->time_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    rec->frag_no = frag_no;
+    rec->transfer_id = transfer_id;
+    rec->count = count;
+    rec->event = event;
+    rec->flags = flags;
+    rec->a = a;
+    rec->b = b;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void traceDrain(struct tracer *t) {
+    // everything in every ring out to the file, a write per contiguous stretch
+    pthread_mutex_lock(&t->lock);
+    for (struct trace_ring *ring = t->rings; ring != NULL; ring = ring->next) {
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (tail < head) {
+            unsigned long n = MIN(head - tail, TRACE_RING_SIZE - tail % TRACE_RING_SIZE); // up to the wrap
+            const char *buf = (const char *) &ring->records[tail % TRACE_RING_SIZE];
+            size_t len = n * sizeof(struct trace_record);
+            while (len > 0) {
+                ssize_t written = write(t->fd, buf, len);
+                if (written == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (written == -1) {
+                    perror("write trace");
+                    exit(1);
+                }
+                buf += written;
+                len -= written;
+            }
+            tail += n;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+void *traceLoop(void *arg) {
+    struct tracer *t = arg;
+    struct timespec tick = {0, TRACE_FLUSH_MS * 1000000};
+    while (!atomic_load(&t->stop)) {
+        nanosleep(&tick, NULL);
+        traceDrain(t);
+    }
+    traceDrain(t);
+    return NULL;
+}
+
+void traceStop(void) {
+    // writes out the rest and closes the file. safe to call when not tracing, so it can go to atexit
+    struct tracer *t = tracer;
+    if (t == NULL) {
+        return;
+    }
+    tracer = NULL;
+    atomic_store(&t->stop, 1);
+    pthread_join(t->thread, NULL);
+    unsigned long long dropped = 0;
+    while (t->rings != NULL) {
+        struct trace_ring *ring = t->rings;
+        t->rings = ring->next;
+        dropped += atomic_load(&ring->dropped);
+        free(ring->records);
+        free(ring);
+    }
+    if (dropped > 0) {
+        fprintf(stderr, "trace: %llu events dropped, the flusher couldn't keep up\n", dropped);
+    }
+    close(t->fd);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+    my_ring = NULL;
+}
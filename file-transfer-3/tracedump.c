@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "transfer.h"
+
+// turns traces from deliver's and server's trace=<file> into CSV, or a gnuplot script for a
+// time-sequence plot. several traces get merged by time, they're all on CLOCK_MONOTONIC so a
+// client's and a server's from the same box line up. times are ms from the first event
+
+struct dump_record {
+    struct trace_record rec;
+    int trace; // which file, index into argv
+};
+
+const char *event_names[TRACE_EVENTS] = {"send", "recv", "ack_send", "ack_recv", "timeout", "rto", "drop"};
+
+int loadTrace(const char *filename, int trace, struct dump_record **records, size_t *len, size_t *cap) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    struct trace_header header;
+    if (fread(&header, sizeof header, 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof header.magic) != 0 ||
+        header.record_size < sizeof(struct trace_record)) {
+        fprintf(stderr, "%s isn't a trace\n", filename);
+        fclose(f);
+        return -1;
+    }
+    char buf[256];
+    if (header.record_size > sizeof buf) {
+        fprintf(stderr, "%s has %u byte records, too new for us\n", filename, header.record_size);
+        fclose(f);
+        return -1;
+    }
+    // a trace cut off mid-record (the process got killed) just ends early
+    while (fread(buf, header.record_size, 1, f) == 1) {
+        if (((struct trace_record *) buf)->event >= TRACE_EVENTS) { // from a newer build, nothing we can say about it
+            continue;
+        }
+        if (*len == *cap) {
+            *cap = *cap ? *cap * 2 : 4096;
+            *records = realloc(*records, *cap * sizeof **records);
+            if (*records == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed for trace records\n");
+                exit(1);
+            }
+        }
+        memcpy(&(*records)[*len].rec, buf, sizeof(struct trace_record));
+        (*records)[*len].trace = trace;
+        *len += 1;
+    }
+    fclose(f);
+    return 0;
+}
+
+int byTime(const void *x, const void *y) {
+    const struct dump_record *a = x, *b = y;
+    if (a->rec.time_ns != b->rec.time_ns) {
+        return a->rec.time_ns < b->rec.time_ns ? -1 : 1;
+    }
+    return a->trace - b->trace; // each file's already in order, keep it that way
+}
+
+const char *kindName(const struct trace_record *r) {
+    if (r->event == TRACE_ACK_SEND || r->event == TRACE_ACK_RECV) {
+        return r->flags & TRACE_NACK ? "nack" : "ack";
+    }
+    return r->flags & TRACE_DUP ? "dup" : r->flags & TRACE_HOLE ? "hole" : "data";
+}
+
+void printCSV(const struct dump_record *records, size_t len, char **names, uint64_t start) {
+    // one row per event, columns that don't apply to it left empty
+    printf("time_ms,trace,transfer,event,frag,frags,kind,retransmit,bytes,path,cwnd,inflight,rwnd,delay_ms,rto_ms,srtt_ms\n");
+    for (size_t i = 0; i < len; i++) {
+        const struct trace_record *r = &records[i].rec;
+        printf("%.3f,%s,%u,%s,", (r->time_ns - start) / 1e6, names[records[i].trace], r->transfer_id, event_names[r->event]);
+        switch (r->event) {
+        case TRACE_SEND:
+            printf("%llu,%u,%s,%d,%u,%u,,,,,,\n", (unsigned long long) r->frag_no, r->count, kindName(r), (r->flags & TRACE_RETRANSMIT) != 0, r->a, r->b);
+            break;
+        case TRACE_RECV:
+            printf("%llu,%u,%s,,%u,,,,,,,\n", (unsigned long long) r->frag_no, r->count, kindName(r), r->a);
+            break;
+        case TRACE_ACK_SEND:
+            printf("%llu,,%s,,,,,,%u,%.3f,,\n", (unsigned long long) r->frag_no, kindName(r), r->a, r->b / 1000.0);
+            break;
+        case TRACE_ACK_RECV:
+            printf("%llu,,%s,,,,%.3f,%u,%u,,,\n", (unsigned long long) r->frag_no, kindName(r), r->a / 1000.0, r->count, r->b);
+            break;
+        case TRACE_TIMEOUT:
+            printf("%llu,,,,,,,%u,,,%.3f,\n", (unsigned long long) r->frag_no, r->count, r->a / 1000.0);
+            break;
+        case TRACE_RTO:
+            printf(",,,,,,,,,,%.3f,%.3f\n", r->a / 1000.0, r->b / 1000.0);
+            break;
+        default: // TRACE_DROP
+            printf("%llu,,,,,,,,,,,\n", (unsigned long long) r->frag_no);
+            break;
+        }
+    }
+}
+
+void printBlock(const char *name, const struct dump_record *records, size_t len, uint64_t start, int event, int want_flag, int flag) {
+    // a gnuplot datablock of (ms, frag, a, b, count) for every record of event with flag set (or not)
+    printf("$%s << EOD\n", name);
+    for (size_t i = 0; i < len; i++) {
+        const struct trace_record *r = &records[i].rec;
+        if (r->event == event && ((r->flags & flag) != 0) == want_flag) {
+            printf("%.3f %llu %u %u %u\n", (r->time_ns - start) / 1e6, (unsigned long long) r->frag_no, r->a, r->b, r->count);
+        }
+    }
+    printf("EOD\n");
+}
+
+void printPlot(const struct dump_record *records, size_t len, char **names, int num_traces, uint64_t start) {
+    // fragments against time on top, what the sender's window and RTO were doing underneath
+    printf("# time-sequence plot of");
+    for (int i = 0; i < num_traces; i++) {
+        printf(" %s", names[i]);
+    }
+    printf(", made by tracedump. gnuplot -p it, or set a terminal and output first\n");
+    printBlock("sent", records, len, start, TRACE_SEND, 0, TRACE_RETRANSMIT);
+    printBlock("resent", records, len, start, TRACE_SEND, 1, TRACE_RETRANSMIT);
+    printBlock("acked", records, len, start, TRACE_ACK_RECV, 0, TRACE_NACK);
+    printBlock("nacked", records, len, start, TRACE_ACK_RECV, 1, TRACE_NACK);
+    printBlock("dropped", records, len, start, TRACE_DROP, 0, 0);
+    printBlock("timeout", records, len, start, TRACE_TIMEOUT, 0, 0);
+    printBlock("rto", records, len, start, TRACE_RTO, 0, 0);
+    printf("set multiplot layout 2,1\n"
+           "set xlabel \"ms\"\n"
+           "set key left top\n"
+           "set title \"fragments\"\n"
+           "set ylabel \"fragment\"\n"
+           "plot $sent using 1:2 with dots lc rgb \"#3060c0\" title \"sent\", \\\n"
+           "     $acked using 1:2 with steps lc rgb \"#20a020\" title \"acked\", \\\n"
+           "     $resent using 1:2 with points pt 7 ps 0.4 lc rgb \"red\" title \"resent\", \\\n"
+           "     $nacked using 1:2 with points pt 1 ps 0.6 lc rgb \"orange\" title \"nack\", \\\n"
+           "     $dropped using 1:2 with points pt 2 ps 0.8 lc rgb \"black\" title \"dropped\", \\\n"
+           "     $timeout using 1:2 with points pt 6 ps 1.2 lc rgb \"magenta\" title \"timeout\"\n"
+           "set title \"sender\"\n"
+           "set ylabel \"fragments\"\n"
+           "set y2label \"ms\"\n"
+           "set ytics nomirror\n"
+           "set y2tics\n"
+           "plot $acked using 1:($3/1000) with steps title \"cwnd\", \\\n"
+           "     $acked using 1:5 with steps title \"in flight\", \\\n"
+           "     $rto using 1:($3/1000) axes x1y2 with steps title \"RTO\", \\\n"
+           "     $rto using 1:($4/1000) axes x1y2 with steps title \"smoothed RTT\"\n"
+           "unset multiplot\n");
+}
+
+int main(int argc, char *argv[]) {
+    int plot = 0, first = 1;
+    long long transfer = -1;
+    for (; first < argc; first++) {
+        if (strcmp(argv[first], "csv") == 0 || strcmp(argv[first], "plot") == 0) {
+            plot = strcmp(argv[first], "plot") == 0;
+        } else if (sscanf(argv[first], "transfer=%lld", &transfer) != 1) {
+            break;
+        }
+    }
+    if (first == argc) {
+        fprintf(stderr, "Usage: tracedump [csv|plot] [transfer=<id>] <trace file>...\n");
+        return 1;
+    }
+
+    struct dump_record *records = NULL;
+    size_t len = 0, cap = 0;
+    for (int i = first; i < argc; i++) {
+        if (loadTrace(argv[i], i - first, &records, &len, &cap) == -1) {
+            return 1;
+        }
+    }
+    if (transfer != -1) { // the rest of a server's traffic is just noise
+        size_t kept = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (records[i].rec.transfer_id == transfer) {
+                records[kept++] = records[i];
+            }
+        }
+        len = kept;
+    }
+    qsort(records, len, sizeof *records, byTime);
+
+    uint64_t start = len > 0 ? records[0].rec.time_ns : 0;
+    if (plot) {
+        printPlot(records, len, argv + first, argc - first, start);
+    } else {
+        printCSV(records, len, argv + first, start);
+    }
+    free(records);
+    return 0;
+}
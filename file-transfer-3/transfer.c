@@ -0,0 +1,1220 @@
+#define _GNU_SOURCE // for SEEK_DATA and SEEK_HOLE
+#include "transfer.h"
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+// credits: some of this code is adapted from beej's handbook, mainly section 6.3
+
+size_t serializePkt(const struct packet *pkt, char *dest_buf, size_t buf_size) {
+    // note here we write the numbers as their corresponding ascii chars, not as binary numbers
+    // snprintf writes a terminating null, but memcpy overwrites that with the first byte of filedata
+    if (pkt->hole_frags > 0) { // nothing but the header
+        return 1 + snprintf(dest_buf, buf_size, "%s:%llu:%llu:%u:%u", pkt->from_store ? "dup" : "hole", pkt->total_frag, pkt->frag_no, pkt->hole_frags, pkt->transfer_id);
+    }
+    int header_len;
+    if (pkt->frag_len > 0) { // a part, filedata is only its bytes
+        header_len = snprintf(dest_buf, buf_size, "part:%llu:%llu:%u:%u:%u:%u:", pkt->total_frag, pkt->frag_no, pkt->frag_len, pkt->part_offset, pkt->size, pkt->transfer_id);
+    } else {
+        header_len = snprintf(dest_buf, buf_size, "%llu:%llu:%u:%u:", pkt->total_frag, pkt->frag_no, pkt->size, pkt->transfer_id);
+    }
+
+    if (header_len < 0 || (size_t) header_len >= buf_size) {
+        fprintf(stderr, "Error: header_len error when serializing packet\n");
+        return 0;
+    }
+
+    size_t total_size = header_len + pkt->size;
+    if (total_size > buf_size) {
+        fprintf(stderr, "Error: packet too big for serialization\n");
+        return 0;
+    }
+
+    memcpy(dest_buf + header_len, pkt->filedata, pkt->size);
+    return total_size;
+}
+
+int deserializePkt(const char *src_buf, size_t buf_size, struct packet *pkt) {
+    // returns -1 if the header is malformed
+    char temp_buf[buf_size + 1];
+    memcpy(temp_buf, src_buf, buf_size);
+    temp_buf[buf_size] = '\0'; // bc sscanf needs null terminated
+
+    pkt->hole_frags = 0;
+    pkt->frag_len = 0;
+    pkt->part_offset = 0;
+    pkt->from_store = strncmp(temp_buf, "dup:", 4) == 0;
+    if (strncmp(temp_buf, "hole:", 5) == 0 || pkt->from_store) {
+        pkt->size = 0;
+        if (sscanf(strchr(temp_buf, ':'), ":%llu:%llu:%u:%u", &pkt->total_frag, &pkt->frag_no, &pkt->hole_frags, &pkt->transfer_id) != 4 || pkt->hole_frags == 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    int header_len = 0;
+    if (strncmp(temp_buf, "part:", 5) == 0) {
+        // parts start on a PART_UNIT and only the last one can end off one, so the receiver can
+        // keep track of what it has in units
+        if (sscanf(temp_buf, "part:%llu:%llu:%u:%u:%u:%u:%n", &pkt->total_frag, &pkt->frag_no, &pkt->frag_len, &pkt->part_offset,
+                   &pkt->size, &pkt->transfer_id, &header_len) != 6 || header_len == 0 || pkt->frag_len == 0 || pkt->frag_len > MAX_FRAG_SIZE ||
+            pkt->size == 0 || pkt->part_offset % PART_UNIT != 0 || pkt->size > pkt->frag_len - MIN(pkt->part_offset, pkt->frag_len) ||
+            (pkt->size % PART_UNIT != 0 && pkt->part_offset + pkt->size != pkt->frag_len)) {
+            return -1;
+        }
+    } else if (sscanf(temp_buf, "%llu:%llu:%u:%u:%n", &pkt->total_frag, &pkt->frag_no, &pkt->size, &pkt->transfer_id, &header_len) != 4 || header_len == 0) {
+        return -1;
+    }
+    if (pkt->size > MAX_FRAG_SIZE || header_len + pkt->size > buf_size) {
+        return -1;
+    }
+    memcpy(pkt->filedata, src_buf + header_len, pkt->size);
+    return 0;
+}
+
+size_t serializeAck(const struct ackpkt *ackpkt, char *dest_buf, size_t buf_size) {
+    // returns length of serialized data, including terminating null char
+    // serialized data will be null-terminated
+    return 1 + snprintf(dest_buf, buf_size, "%s:%u:%llu:%u:%u", ackpkt->ack_nack ? "ack" : "nack", ackpkt->transfer_id, ackpkt->frag_no, ackpkt->delay_us, ackpkt->rwnd);
+}
+
+int deserializeAck(const char *src_buf, size_t buf_size, struct ackpkt *ackpkt) {
+    // returns -1 if this isn't an ack/nack
+    char temp_buf[buf_size + 1];
+    memcpy(temp_buf, src_buf, buf_size);
+    temp_buf[buf_size] = '\0'; // should be unnecessary bc the serialized ack packet is null-terminated
+
+    char tag[8];
+    if (sscanf(temp_buf, "%7[^:]:%u:%llu:%u:%u", tag, &ackpkt->transfer_id, &ackpkt->frag_no, &ackpkt->delay_us, &ackpkt->rwnd) != 5) {
+        return -1;
+    }
+    if (strcmp(tag, "ack") == 0) {
+        ackpkt->ack_nack = 1;
+    } else if (strcmp(tag, "nack") == 0) {
+        ackpkt->ack_nack = 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+size_t serializeHandshake(const char *tag, const struct handshake *hs, char *dest_buf, size_t buf_size) {
+    // filename goes last so everything after the last numeric field is the name. the merkle root
+    // is "-" from whoever doesn't have the file
+    static const unsigned char no_root[SHA256_LEN];
+    char root[SHA256_LEN * 2 + 1] = "-";
+    if (memcmp(hs->root, no_root, SHA256_LEN) != 0) {
+        for (int i = 0; i < SHA256_LEN; i++) {
+            snprintf(root + i * 2, 3, "%02x", hs->root[i]);
+        }
+    }
+    return snprintf(dest_buf, buf_size, "%s:%u:%u:%u:%u:%u:%lld:%u:%llx:%s:%s", tag, hs->version, hs->frag_size, hs->window,
+        hs->rcvbuf, hs->flags, hs->file_size, hs->transfer_id, hs->cookie, root, hs->filename);
+}
+
+int deserializeHandshake(const char *src_buf, size_t buf_size, const char *tag, struct handshake *hs) {
+    // returns -1 if this isn't a handshake with the given tag
+    char temp_buf[buf_size + 1];
+    memcpy(temp_buf, src_buf, buf_size);
+    temp_buf[buf_size] = '\0';
+
+    char recv_tag[8], root[SHA256_LEN * 2 + 1];
+    int name_start = 0;
+    memset(hs, 0, sizeof *hs);
+    if (sscanf(temp_buf, "%7[^:]:%u:%u:%u:%u:%u:%lld:%u:%llx:%64[-0-9a-f]:%n", recv_tag, &hs->version, &hs->frag_size, &hs->window,
+            &hs->rcvbuf, &hs->flags, &hs->file_size, &hs->transfer_id, &hs->cookie, root, &name_start) != 10 || name_start == 0) {
+        return -1;
+    }
+    if (strcmp(recv_tag, tag) != 0) {
+        return -1;
+    }
+    if (strlen(root) == SHA256_LEN * 2) {
+        for (int i = 0; i < SHA256_LEN; i++) {
+            sscanf(root + i * 2, "%2hhx", &hs->root[i]);
+        }
+    }
+    strncpy(hs->filename, temp_buf + name_start, MAX_FILENAME - 1);
+    return 0;
+}
+
+int isDataPkt(const char *buf) {
+    // data packets start with a number, everything else starts with a word like "ftp" or "ack"
+    return (buf[0] >= '0' && buf[0] <= '9') || strncmp(buf, "hole:", 5) == 0 || strncmp(buf, "dup:", 4) == 0 || strncmp(buf, "part:", 5) == 0;
+}
+
+void (*send_hook)(int sockfd, const void *msg, size_t len) = NULL;
+
+int unreachable(int err) {
+    // sendto errors that only mean the route or interface to this one address went away (a
+    // blackhole route gives EINVAL). UDP, so that's just another lost datagram, not a reason to
+    // drop every other transfer too. one path of a multipath client going down looks like this
+    return err == ENETUNREACH || err == EHOSTUNREACH || err == ENETDOWN || err == EHOSTDOWN || err == EINVAL || err == EPERM;
+}
+
+void sendMsg(int sockfd, const void *msg, size_t len, const struct sockaddr *addr, socklen_t addr_len) {
+    // msg may not be a string
+    if (send_hook) { // simulated link
+        send_hook(sockfd, msg, len);
+        return;
+    }
+    if (io_ring) { // goes out with the rest of the batch
+        uringSendMsg(io_ring, sockfd, msg, len, addr, addr_len);
+        return;
+    }
+    int numbytes;
+    numbytes = sendto(sockfd, msg, len, 0, addr, addr_len);
+
+    if (numbytes == -1 && unreachable(errno)) {
+        perror("sendto, dropped");
+    } else if (numbytes == -1) {
+        perror("sendto");
+        exit(1);
+    }
+}
+
+double get_time_diff(struct timespec start, struct timespec end) {
+    // in milliseconds
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+struct timespec add_time_ms(struct timespec t, double ms) {
+    long ns = t.tv_nsec + (long) (ms * 1e6);
+    t.tv_sec += ns / 1000000000L;
+    t.tv_nsec = ns % 1000000000L;
+    if (t.tv_nsec < 0) {
+        t.tv_sec -= 1;
+        t.tv_nsec += 1000000000L;
+    }
+    return t;
+}
+
+unsigned long long totalFrags(long long file_size, unsigned int frag_size) {
+    // file_size / frag_size would truncate towards 0, add frag_size - 1 to ceil
+    return (file_size + (frag_size - 1)) / frag_size;
+}
+
+int sourceRead(const struct file_source *src, char *buf, size_t len, off_t offset) {
+    // pread for a file that might be stored as chunks, -1 on failure
+    if (src->recipe) {
+        return storeRead(src->recipe, buf, len, offset);
+    }
+    return pread(src->fd, buf, len, offset) == (ssize_t) len ? 0 : -1;
+}
+
+int parseCC(const char *name) {
+    // returns -1 if we don't know the controller
+    if (strcmp(name, "reno") == 0) {
+        return CC_RENO;
+    } else if (strcmp(name, "bbr") == 0) {
+        return CC_BBR;
+    }
+    return -1;
+}
+
+const char *ccName(enum cc_algo cc) {
+    return cc == CC_BBR ? "bbr" : "reno";
+}
+
+/* Timeout calculation
+EstimatedRTT = (1-0.125) * EstimatedRTT + (0.125) * SampleRTT
+DevRTT = (1-0.25) * DevRTT + (0.25) * |SampleRTT - EstimatedRTT|
+initial DevRTT will be half of first EstimatedRTT
+timeout = EstimatedRTT + 4 * DevRTT
+initial timeout = 1 sec?
+karn's alg: exponential backoff on retransmission
+cap the timeout at 30s
+the receiver can hold an ack back up to ACK_DELAY_MS, so that goes on top of the timeout,
+and the delay it reports in the ack comes off the sample
+*/
+
+void updateRTT(struct sender *s, double sampleRTT) {
+    s->estimatedRTT = (1 - 0.125) * s->estimatedRTT + (0.125) * sampleRTT;
+    if (sampleRTT - s->estimatedRTT > 0) {
+        s->devRTT = (1 - 0.25) * s->devRTT + (0.25) * (sampleRTT - s->estimatedRTT);
+    } else {
+        s->devRTT = (1 - 0.25) * s->devRTT + (0.25) * (s->estimatedRTT - sampleRTT);
+    }
+}
+
+void senderInit(struct sender *s, int sockfd, const struct sockaddr *addr, socklen_t addr_len, const struct handshake *hs, const struct file_source *src, enum cc_algo cc) {
+    memset(s, 0, sizeof *s);
+    s->sockfd = sockfd;
+    memcpy(&s->peer_addr, addr, addr_len);
+    s->peer_addr_len = addr_len;
+    s->src = src;
+    s->frag_size = hs->frag_size;
+    s->total_frag = totalFrags(src->size, hs->frag_size);
+    if (src->stream) { // we find out how many when the pipe runs dry
+        s->total_frag = UNKNOWN_FRAGS;
+        s->stream_buf = malloc((size_t) MAX_WINDOW * hs->frag_size);
+        if (s->stream_buf == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for stream buffer\n");
+            exit(1);
+        }
+    }
+    s->transfer_id = hs->transfer_id;
+    s->max_window = MAX_WINDOW;
+    s->rwnd = MAX_WINDOW; // until an ack says otherwise
+
+    s->base = 1;
+    s->next_frag = 1;
+    s->cwnd = INITIAL_WINDOW;
+    s->ssthresh = MAX_WINDOW;
+
+    s->timeout_ms = 100; // initial timeout 0.1 sec
+    s->estimatedRTT = 100;
+    s->devRTT = 50;
+    clock_gettime(CLOCK_MONOTONIC, &s->timer_start);
+
+    s->cc = cc;
+    s->delivered_time = s->next_send_time = s->timer_start;
+    if (cc == CC_BBR) {
+        bbrInit(s, s->timer_start);
+    }
+}
+
+void senderLimitWindow(struct sender *s) {
+    // stay inside what the receiver can buffer. the kernel charges a datagram for the buffer it
+    // sits in, which for a jumbo one is the next power of 2 up, not just its length. split
+    // fragments are several small datagrams each
+    unsigned int len = s->split ? PART_SIZE + PART_HEADER_MAX : s->frag_size + PKT_HEADER_MAX;
+    unsigned int datagrams = s->split ? (s->frag_size + PART_SIZE - 1) / PART_SIZE : 1;
+    unsigned int truesize = 1024;
+    while (truesize < len) {
+        truesize *= 2;
+    }
+    unsigned int rcvbuf_frags = s->rcvbuf / ((truesize + 256) * datagrams); // 256 more for the kernel's bookkeeping
+    s->max_window = MAX(MIN(MIN(s->rcv_window, rcvbuf_frags), MAX_WINDOW), 1);
+    s->cwnd = MIN(s->cwnd, s->max_window);
+}
+
+void senderSetLimits(struct sender *s, const struct handshake *reply) {
+    s->rcv_window = reply->window;
+    s->rcvbuf = reply->rcvbuf;
+    senderLimitWindow(s);
+    s->flags = reply->flags; // early data went out before this, so it only used what every receiver understands
+}
+
+void senderSetTimeout(struct sender *s, double timeout_ms) {
+    if (timeout_ms != s->timeout_ms) {
+        traceEvent(TRACE_RTO, s->transfer_id, 0, 0, 0, timeout_ms * 1000, s->estimatedRTT * 1000);
+    }
+    s->timeout_ms = timeout_ms;
+}
+
+void senderRTTSample(struct sender *s, double sampleRTT) {
+    // a sample from outside the data path, i.e. the handshake round trip
+    updateRTT(s, sampleRTT);
+    s->exp_backoff = 0;
+    senderSetTimeout(s, MIN(s->estimatedRTT + 4 * s->devRTT + ACK_DELAY_MS, MAX_TIMEOUT));
+}
+
+int isZero(const char *buf, size_t len) {
+    // OR whole words together a block at a time, gcc vectorizes the inner loop, and bail out
+    // at the first block with anything in it since most fragments aren't zero
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        unsigned long acc = 0;
+        for (int j = 0; j < 8; j++) {
+            unsigned long word;
+            memcpy(&word, buf + i + j * 8, 8); // buf isn't necessarily aligned
+            acc |= word;
+        }
+        if (acc != 0) {
+            return 0;
+        }
+    }
+    for (; i < len; i++) {
+        if (buf[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int inHole(struct sender *s, off_t offset, off_t len) {
+    // whether [offset, offset + len) is a hole in a sparse source, so it doesn't even need reading.
+    // one SEEK_DATA/SEEK_HOLE pair per extent, not per fragment
+    if (s->src->recipe) { // chunks don't have holes, all-zero ones still get caught by the zero check
+        return 0;
+    }
+    if (offset >= s->seek_checked) {
+        off_t data = lseek(s->src->fd, offset, SEEK_DATA);
+        if (data == -1 && errno == ENXIO) { // nothing but hole up to EOF
+            s->hole_start = offset;
+            s->hole_end = s->seek_checked = s->src->size;
+        } else if (data == -1) { // filesystem can't tell us, the zero check still catches them
+            s->seek_checked = s->src->size;
+        } else if (data > offset) {
+            s->hole_start = offset;
+            s->hole_end = s->seek_checked = data;
+        } else { // data here, no need to ask again until the next hole
+            off_t hole = lseek(s->src->fd, offset, SEEK_HOLE);
+            s->seek_checked = hole > offset ? hole : s->src->size;
+        }
+    }
+    return offset >= s->hole_start && offset + len <= s->hole_end;
+}
+
+int streamFill(struct sender *s) {
+    // reads as much of next_frag as the pipe has without blocking, 1 once it's all there. the
+    // last one can be short, and once the pipe's done the one after it is the empty end marker
+    unsigned int slot = s->next_frag % MAX_WINDOW;
+    char *buf = s->stream_buf + (size_t) slot * s->frag_size;
+    while (!s->stream_eof && s->stream_fill < s->frag_size) {
+        ssize_t n = read(s->src->fd, buf + s->stream_fill, s->frag_size - s->stream_fill);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1) {
+            perror("read");
+            exit(1);
+        } else if (n == 0) {
+            s->stream_eof = 1;
+        }
+        s->stream_fill += n;
+    }
+    s->stream_len[slot] = s->stream_fill;
+    if (s->stream_eof && s->stream_fill == 0) {
+        s->total_frag = s->next_frag;
+    }
+    return 1;
+}
+
+const char *fragmentData(struct sender *s, unsigned long long frag_no, char *buf, unsigned int *size) {
+    // points into the mapping if there is one, otherwise preads into buf. NULL if the fragment is all zeros
+    if (s->src->stream) { // the only copy left is ours
+        *size = s->stream_len[frag_no % MAX_WINDOW];
+        return s->stream_buf + (size_t) (frag_no % MAX_WINDOW) * s->frag_size;
+    }
+    off_t offset = (off_t) (frag_no - 1) * s->frag_size;
+    *size = MIN((off_t) s->frag_size, s->src->size - offset);
+
+    if (s->flags & FEATURE_SPARSE && inHole(s, offset, *size)) {
+        return NULL;
+    }
+    const char *data = buf;
+    if (s->src->map) {
+        data = s->src->map + offset;
+    } else if (s->reader && frag_no >= s->next_frag) { // new data comes from read-ahead, retransmits are read again
+        data = readerGet(s->reader, frag_no);
+    } else if (sourceRead(s->src, buf, *size, offset) == -1) {
+        perror("pread");
+        exit(1);
+    }
+    if (s->flags & FEATURE_SPARSE && isZero(data, *size)) {
+        return NULL;
+    }
+    return data;
+}
+
+int fragmentReady(struct sender *s, unsigned long long frag_no) {
+    // whether we can send frag_no without waiting on the disk (or whatever's writing the pipe)
+    if (s->src->stream) {
+        return frag_no < s->next_frag || (frag_no == s->next_frag && streamFill(s));
+    }
+    return s->reader == NULL || frag_no < s->next_frag || readerGet(s->reader, frag_no) != NULL;
+}
+
+int sendRecord(struct sender *s, int p, const void *msg, size_t len) {
+    // one datagram of data out on path p, or the next best if that one won't take it. returns the
+    // path it went on
+    if (s->paths == NULL) {
+        sendMsg(s->sockfd, msg, len, (struct sockaddr *) &s->peer_addr, s->peer_addr_len);
+        return 0;
+    }
+    for (int tries = 1; pathSend(s, p, msg, len) == -1 && tries < s->num_paths; tries++) {
+        p = pathPick(s, p);
+    }
+    return p;
+}
+
+int sendParts(struct sender *s, const struct packet *pkt, int p) {
+    // pkt's fragment as PART_SIZE parts, small enough to get through whatever the path's MTU
+    // dropped to. returns the path they went on
+    struct packet part = {.total_frag = pkt->total_frag, .frag_no = pkt->frag_no, .transfer_id = pkt->transfer_id, .frag_len = pkt->size};
+    char send_buf[MAXBUFLEN];
+    for (unsigned int offset = 0; offset < pkt->size; offset += PART_SIZE) {
+        part.part_offset = offset;
+        part.size = MIN(PART_SIZE, pkt->size - offset);
+        memcpy(part.filedata, pkt->filedata + offset, part.size);
+        p = sendRecord(s, p, send_buf, serializePkt(&part, send_buf, MAXBUFLEN));
+    }
+    return p;
+}
+
+unsigned int sendFragment(struct sender *s, unsigned long long frag_no, unsigned int max_frags) {
+    // (re)reads the fragment from the source, so we don't have to buffer anything in flight.
+    // if it's all zeros, the following ones (up to max_frags in total) that are too go in the
+    // same hole record, same for fragments the receiver has in its chunk store and a dup record.
+    // returns how many fragments went out
+    struct packet pkt;
+    pkt.total_frag = s->total_frag == UNKNOWN_FRAGS ? 0 : s->total_frag;
+    pkt.frag_no = frag_no;
+    pkt.transfer_id = s->transfer_id;
+    pkt.hole_frags = 0;
+    pkt.from_store = 0;
+    pkt.frag_len = 0;
+    pkt.part_offset = 0;
+
+    const char *data = fragmentData(s, frag_no, pkt.filedata, &pkt.size);
+    if (data == NULL) {
+        char scratch[MAX_FRAG_SIZE];
+        unsigned int size;
+        pkt.hole_frags = 1;
+        while (pkt.hole_frags < max_frags && fragmentReady(s, frag_no + pkt.hole_frags) &&
+               fragmentData(s, frag_no + pkt.hole_frags, scratch, &size) == NULL) {
+            pkt.hole_frags += 1;
+        }
+        s->hole_frags += pkt.hole_frags;
+    } else if (s->flags & FEATURE_DEDUP && manifestCovers(s->dedup, (off_t) (frag_no - 1) * s->frag_size, pkt.size)) {
+        pkt.from_store = 1;
+        pkt.hole_frags = 1;
+        while (pkt.hole_frags < max_frags && fragmentReady(s, frag_no + pkt.hole_frags) &&
+               manifestCovers(s->dedup, (off_t) (frag_no + pkt.hole_frags - 1) * s->frag_size,
+                              MIN((off_t) s->frag_size, s->src->size - (off_t) (frag_no + pkt.hole_frags - 1) * s->frag_size))) {
+            pkt.hole_frags += 1;
+        }
+        s->stored_frags += pkt.hole_frags;
+    } else if (data != pkt.filedata) {
+        memcpy(pkt.filedata, data, pkt.size);
+    }
+
+    unsigned int sent = pkt.hole_frags > 0 ? pkt.hole_frags : 1;
+    // a retransmit goes some other way than the copy that got lost if it can
+    int p = s->paths ? pathPick(s, s->window[frag_no % MAX_WINDOW].path) : 0;
+    if (s->split && pkt.hole_frags == 0 && pkt.size > PART_SIZE) {
+        p = sendParts(s, &pkt, p);
+        s->split_frags += 1;
+    } else {
+        char send_buf[MAXBUFLEN];
+        size_t send_len = serializePkt(&pkt, send_buf, MAXBUFLEN);
+        p = sendRecord(s, p, send_buf, send_len);
+    }
+    for (unsigned int i = 0; s->paths && i < sent; i++) {
+        pathSent(s, frag_no + i, p);
+    }
+    if (tracer) {
+        unsigned int flags = (frag_no < s->next_frag ? TRACE_RETRANSMIT : 0) | (pkt.from_store ? TRACE_DUP : pkt.hole_frags > 0 ? TRACE_HOLE : 0);
+        traceEvent(TRACE_SEND, s->transfer_id, frag_no, sent, flags, pkt.hole_frags > 0 ? 0 : pkt.size, s->paths ? s->window[frag_no % MAX_WINDOW].path : 0);
+    }
+    if (s->verbose && pkt.hole_frags > 0) {
+        printf("Sent %s %llu-%llu/%llu\n", pkt.from_store ? "dup" : "hole", pkt.frag_no, pkt.frag_no + pkt.hole_frags - 1, pkt.total_frag);
+    } else if (s->verbose) {
+        printf("Sent packet %llu/%llu (%u file bytes)\n", pkt.frag_no, pkt.total_frag, pkt.size);
+    }
+    return sent;
+}
+
+void retransmitFragment(struct sender *s, unsigned long long frag_no) {
+    // a hole can cover everything after it that's in flight too, the receiver ignores what it already has
+    unsigned int sent = sendFragment(s, frag_no, s->next_frag - frag_no);
+    for (unsigned int i = 0; i < sent; i++) {
+        s->window[(frag_no + i) % MAX_WINDOW].retransmitted = 1;
+    }
+}
+
+unsigned int sendWindow(const struct sender *s) {
+    // most we can have in flight: what congestion control allows, and what the receiver can take
+    return MIN(MIN((unsigned int) s->cwnd, s->max_window), s->rwnd);
+}
+
+int windowOpen(const struct sender *s) {
+    return s->next_frag <= s->total_frag && s->next_frag < s->base + sendWindow(s);
+}
+
+void senderFill(struct sender *s, struct timespec now) {
+    // fill up the window with new fragments, no faster than the pacing rate if there is one
+    if (s->paths) {
+        pathsCheck(s, now);
+    }
+    if (s->split && get_time_diff(s->split_since, now) >= PMTU_RAISE_MS) { // see if whole fragments get through again
+        s->split = 0;
+        senderLimitWindow(s);
+    }
+    if (s->src->map && s->read_ahead > 0) {
+        // get the kernel reading the next stretch of the mapping in the background, half of it at a time
+        off_t want = MIN((off_t) (s->next_frag - 1) * s->frag_size + s->read_ahead, s->src->size);
+        if (want - s->advised_to >= s->read_ahead / 2 || (want == s->src->size && s->advised_to < want)) {
+            off_t start = s->advised_to & ~((off_t) sysconf(_SC_PAGESIZE) - 1); // madvise wants it page aligned
+            madvise((void *) (s->src->map + start), want - start, MADV_WILLNEED);
+            s->advised_to = want;
+        }
+    }
+
+    while (windowOpen(s)) {
+        if (s->pacing_rate > 0 && get_time_diff(s->next_send_time, now) < 0) {
+            break; // not our turn yet
+        }
+        if (!fragmentReady(s, s->next_frag)) { // read-ahead is behind, look again in READ_AHEAD_RETRY_MS instead of blocking
+            s->read_stalls += 1;
+            break;
+        }
+
+        if (s->next_frag == s->base) {
+            // pipe is empty, restart the delivery clock so time spent idle doesn't count against the rate
+            s->delivered_time = now;
+            s->timer_start = now;
+        }
+        // a hole record can cover the rest of the open window in one packet
+        unsigned int room = MIN(s->base + sendWindow(s), s->total_frag + 1) - s->next_frag; // < MAX_WINDOW
+        unsigned int sent = sendFragment(s, s->next_frag, room);
+        for (unsigned int i = 0; i < sent; i++) {
+            struct frag_state *fs = &s->window[(s->next_frag + i) % MAX_WINDOW];
+            fs->sent_time = now;
+            fs->retransmitted = 0;
+            fs->delivered = s->delivered;
+            fs->delivered_time = s->delivered_time;
+        }
+        s->next_frag += sent;
+        if (s->reader) {
+            readerRelease(s->reader, sent);
+        }
+        if (s->src->stream) { // next read goes in the next slot
+            s->stream_bytes += s->stream_fill;
+            s->stream_fill = 0;
+        }
+
+        if (s->pacing_rate > 0) {
+            // don't let a long sleep build up credit for more than a quantum's worth of burst
+            struct timespec earliest = add_time_ms(now, -PACING_QUANTUM_MS);
+            if (get_time_diff(s->next_send_time, earliest) > 0) {
+                s->next_send_time = earliest;
+            }
+            s->next_send_time = add_time_ms(s->next_send_time, 1 / s->pacing_rate);
+        }
+    }
+    if (s->next_frag <= s->total_frag && s->next_frag >= s->base + s->rwnd && s->rwnd < MIN((unsigned int) s->cwnd, s->max_window)) {
+        s->rwnd_stalls += 1;
+    }
+}
+
+double senderTimeLeft(const struct sender *s, struct timespec now) {
+    // ms until the RTO fires, <= 0 means it already has
+    return s->timeout_ms - get_time_diff(s->timer_start, now);
+}
+
+double senderWaitTime(const struct sender *s, struct timespec now) {
+    // ms until the sender next needs to run, either for the RTO or because pacing lets the next
+    // fragment out. if that isn't read yet, pacing has to wait for it too or we'd spin
+    double left = senderTimeLeft(s, now);
+    int stalled = (s->reader && readerGet(s->reader, s->next_frag) == NULL) ||
+                  (s->src->stream && !s->stream_eof && s->stream_fill < s->frag_size); // pipe's empty for now
+    if (windowOpen(s) && stalled) {
+        left = MIN(left, READ_AHEAD_RETRY_MS);
+    } else if (s->pacing_rate > 0 && windowOpen(s)) {
+        left = MIN(left, get_time_diff(now, s->next_send_time));
+    }
+    return left;
+}
+
+void senderProbe(struct sender *s) {
+    // fragment 0 with nothing in it. every receiver takes it for a duplicate and acks it with
+    // the window it has now, and there's nothing in it to write
+    struct packet pkt = {.total_frag = s->total_frag == UNKNOWN_FRAGS ? 0 : s->total_frag, .frag_no = 0, .size = 0, .transfer_id = s->transfer_id};
+    char send_buf[MAXBUFLEN];
+    sendRecord(s, s->paths ? pathPick(s, -1) : 0, send_buf, serializePkt(&pkt, send_buf, MAXBUFLEN));
+}
+
+int senderOnTimeout(struct sender *s, struct timespec now) {
+    // retransmit the oldest unacked fragment, returns -1 if the peer seems to be gone
+    if (s->base == s->next_frag && s->base <= s->total_frag && s->rwnd == 0) {
+        // the receiver shut its window and nothing's in flight to get us the ack that opens it.
+        // probe it every RTO, backing off like any timeout, and if it never answers it's gone
+        if (s->verbose) {
+            printf("Window shut, probing the receiver\n");
+        }
+        senderSetTimeout(s, MIN(s->timeout_ms * 2, MAX_TIMEOUT));
+        s->timer_start = now;
+        s->timeouts += 1;
+        if (s->timeouts > MAX_TIMEOUTS) {
+            return -1;
+        }
+        senderProbe(s);
+        s->probes += 1;
+        return 0;
+    }
+    if (s->base == s->next_frag && s->base <= s->total_frag) { // nothing in flight, we're waiting on our own source
+        s->timer_start = now;
+        if (get_time_diff(s->keepalive_time, now) >= KEEPALIVE_MS) { // so the receiver knows we're still here
+            senderProbe(s);
+            s->keepalive_time = now;
+        }
+        return 0;
+    }
+    if (s->base <= s->total_frag) {
+        printf("TIMEOUT for fragment %llu: waited %.6f ms\n", s->base, s->timeout_ms);
+    }
+    traceEvent(TRACE_TIMEOUT, s->transfer_id, s->base, s->next_frag - s->base, 0, s->timeout_ms * 1000, 0);
+    s->exp_backoff = 1;
+    senderSetTimeout(s, MIN(s->timeout_ms * 2, MAX_TIMEOUT));
+    s->timer_start = now;
+    s->timeouts += 1;
+    if (s->timeouts > MAX_TIMEOUTS) {
+        return -1;
+    }
+    if (s->timeouts == PMTU_BLACKHOLE_TIMEOUTS && !s->split && s->flags & FEATURE_PARTS && s->frag_size > PART_SIZE) {
+        // nothing's got through for a while, maybe the path stopped taking packets this big and
+        // whatever would've told us so (ICMP) got lost. parts get through anything
+        printf("PATH MTU BLACK HOLE? sending %u byte fragments in %d byte parts\n", s->frag_size, PART_SIZE);
+        s->split = 1;
+        s->split_since = now;
+        senderLimitWindow(s);
+    }
+    if (s->base > s->total_frag) {
+        return 0;
+    }
+
+    if (s->cc == CC_RENO) {
+        s->ssthresh = MAX((s->next_frag - s->base) / 2.0, 2);
+        s->cwnd = 1;
+    }
+    s->recover = 0;
+    s->dup_nacks = 0;
+
+    retransmitFragment(s, s->base);
+    s->retransmits += 1;
+    return 0;
+}
+
+void senderOnAck(struct sender *s, const struct ackpkt *ack, struct timespec now) {
+    if (ack->transfer_id != s->transfer_id) {
+        return;
+    }
+    s->timeouts = 0;
+    traceEvent(TRACE_ACK_RECV, s->transfer_id, ack->frag_no, s->next_frag - s->base, ack->ack_nack ? 0 : TRACE_NACK, s->cwnd * 1000, ack->rwnd);
+
+    // a nack for frag_no also tells us everything before it arrived
+    unsigned long long cum_frag = ack->ack_nack == 1 ? ack->frag_no : ack->frag_no - 1;
+    if (cum_frag >= s->next_frag) { // can't be acking something we never sent
+        return;
+    }
+    if (cum_frag + 1 >= s->base) { // an older ack that got reordered would have an older window too
+        s->rwnd = MIN(ack->rwnd, MAX_WINDOW);
+    }
+
+    if (cum_frag >= s->base) { // new data acked
+        if (s->verbose) {
+            printf("Received ack for fragment %llu\n", cum_frag);
+        }
+        struct frag_state *fs = &s->window[cum_frag % MAX_WINDOW];
+        double rtt_sample = -1;
+        double delay_ms = ack->delay_us / 1000.0;
+        if (s->exp_backoff) {
+            s->exp_backoff = 0;
+        } else if (!fs->retransmitted && !s->window[s->base % MAX_WINDOW].retransmitted) {
+            // skip the sample if a retransmit filled the hole that held this ack back
+            double rtt = get_time_diff(fs->sent_time, now);
+            rtt_sample = rtt > delay_ms ? rtt - delay_ms : rtt;
+            updateRTT(s, rtt_sample);
+        }
+        senderSetTimeout(s, MIN(s->estimatedRTT + 4 * s->devRTT + ACK_DELAY_MS, MAX_TIMEOUT));
+        if (s->paths) {
+            // every fragment this acks gives its path an RTT sample, or an unused path with one bad
+            // sample would never get another. same rules as the sample above
+            for (unsigned long long f = s->base; f <= cum_frag; f++) {
+                struct frag_state *pf = &s->window[f % MAX_WINDOW];
+                double rtt = get_time_diff(pf->sent_time, now);
+                pathAcked(s, pf, rtt_sample < 0 || pf->retransmitted ? -1 : rtt > delay_ms ? rtt - delay_ms : rtt);
+            }
+        }
+
+        unsigned int newly_acked = cum_frag - s->base + 1;
+        s->base = cum_frag + 1;
+        s->timer_start = now;
+        s->dup_nacks = 0;
+        s->delivered += newly_acked;
+        s->delivered_time = now;
+
+        int recovered = 0;
+        if (s->recover) {
+            if (cum_frag >= s->recover) { // everything outstanding at the loss got through
+                s->recover = 0;
+                recovered = 1;
+            } else if (s->base < s->next_frag) { // partial ack, the next hole was lost too so resend it right away
+                retransmitFragment(s, s->base);
+                s->fast_retransmits += 1;
+            }
+        }
+
+        if (s->cc == CC_BBR) {
+            bbrOnAck(s, fs, newly_acked, rtt_sample, delay_ms, now);
+        } else if (recovered) {
+            s->cwnd = s->ssthresh;
+        } else if (s->recover) {
+            // hold cwnd until recovery is over
+        } else if (s->cwnd < s->ssthresh) { // slow start
+            s->cwnd += newly_acked;
+        } else { // congestion avoidance
+            s->cwnd += newly_acked / s->cwnd;
+        }
+        s->cwnd = MIN(s->cwnd, s->max_window);
+    }
+
+    if (ack->ack_nack == 0 && ack->frag_no >= s->base && ack->frag_no < s->next_frag) {
+        if (s->verbose) {
+            printf("Received nack for fragment %llu\n", ack->frag_no);
+        }
+        if (ack->frag_no == s->last_nack) {
+            s->dup_nacks += 1;
+        } else {
+            s->last_nack = ack->frag_no;
+            s->dup_nacks = 1;
+        }
+
+        // fast retransmit, don't wait for the timer
+        if (s->dup_nacks == DUP_NACK_THRESHOLD && !s->recover) {
+            printf("FAST RETRANSMIT for fragment %llu after %d nacks\n", ack->frag_no, s->dup_nacks);
+            if (s->cc == CC_RENO) { // bbr's model already accounts for loss, the window stays
+                s->ssthresh = MAX((s->next_frag - s->base) / 2.0, 2);
+                s->cwnd = s->ssthresh;
+            }
+            s->recover = s->next_frag - 1;
+
+            retransmitFragment(s, ack->frag_no);
+            s->fast_retransmits += 1;
+            s->timer_start = now;
+        }
+    }
+}
+
+int senderDone(const struct sender *s) {
+    return s->base > s->total_frag;
+}
+
+void senderReadAhead(struct sender *s, off_t bytes) {
+    // keep up to bytes of the file past the window read in, 0 reads each fragment as it's sent
+    s->read_ahead = bytes;
+    if (bytes > 0 && s->src->map == NULL && !s->src->stream && s->total_frag > 0) {
+        s->reader = readerStart(s->src, s->frag_size, s->total_frag, bytes);
+    }
+}
+
+void senderRestart(struct sender *s, struct timespec now) {
+    // the receiver dropped everything in flight without looking (made us retry the handshake
+    // first), so send it all again. that's not loss, the window and RTO stay as they are
+    unsigned long long frag_no = s->base;
+    for (unsigned long long f = s->base; s->paths && f < s->next_frag; f++) {
+        pathForget(s, &s->window[f % MAX_WINDOW]);
+    }
+    while (frag_no < s->next_frag) {
+        unsigned int sent = sendFragment(s, frag_no, s->next_frag - frag_no);
+        for (unsigned int i = 0; i < sent; i++) {
+            s->window[(frag_no + i) % MAX_WINDOW].sent_time = now;
+        }
+        frag_no += sent;
+    }
+    s->timer_start = now;
+}
+
+void senderSend(struct sender *s, const void *msg, size_t len) {
+    // anything but data to the receiver, over the best path if there's more than one
+    if (s->paths) {
+        pathSend(s, pathPick(s, NO_PATH), msg, len);
+        return;
+    }
+    sendMsg(s->sockfd, msg, len, (struct sockaddr *) &s->peer_addr, s->peer_addr_len);
+}
+
+void senderClose(struct sender *s) {
+    if (s->reader) {
+        readerStop(s->reader);
+        s->reader = NULL;
+    }
+    manifestFree(s->dedup);
+    s->dedup = NULL;
+    free(s->stream_buf);
+    s->stream_buf = NULL;
+    s->merkle = NULL; // belongs to whoever built it, the server shares one per file
+}
+
+void receiverInit(struct receiver *r, int sockfd, const struct sockaddr *addr, socklen_t addr_len, const struct handshake *hs, int fd) {
+    memset(r, 0, sizeof *r);
+    r->sockfd = sockfd;
+    memcpy(&r->peer_addr, addr, addr_len);
+    r->peer_addr_len = addr_len;
+    r->fd = fd;
+    r->frag_size = hs->frag_size;
+    r->file_size = hs->file_size;
+    r->total_frag = hs->flags & FEATURE_STREAM ? UNKNOWN_FRAGS : totalFrags(hs->file_size, hs->frag_size);
+    r->transfer_id = hs->transfer_id;
+    r->window = MIN(hs->window, MAX_WINDOW);
+    clock_gettime(CLOCK_MONOTONIC, &r->last_heard);
+    r->idle_ms = IDLE_TIMEOUT;
+    if (hs->flags & FEATURE_MERKLE) {
+        merkleReceiverInit(r, hs);
+    }
+}
+
+void receiverOrdered(struct receiver *r) {
+    // fd can't be written at an offset (a pipe), so hold fragments until the ones before them are
+    // out. it's non-blocking, and a full pipe shrinks the window we advertise instead of stalling us
+    r->order_buf = malloc((size_t) MAX_WINDOW * r->frag_size);
+    if (r->order_buf == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for reorder buffer\n");
+        exit(1);
+    }
+}
+
+void receiverFlush(struct receiver *r) {
+    // write out whatever's in order that the pipe will take
+    while (r->flushed < r->cum_frag) {
+        unsigned int slot = (r->flushed + 1) % MAX_WINDOW;
+        ssize_t n = 0;
+        if (r->flush_off < r->order_len[slot]) {
+            n = write(r->fd, r->order_buf + (size_t) slot * r->frag_size + r->flush_off, r->order_len[slot] - r->flush_off);
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1) { // reader went away, nothing to do but finish the transfer
+            perror("write");
+            n = r->order_len[slot] - r->flush_off;
+        }
+        r->flush_off += n;
+        if (r->flush_off == r->order_len[slot]) {
+            r->flushed += 1;
+            r->flush_off = 0;
+        }
+    }
+}
+
+unsigned int receiverWindow(const struct receiver *r) {
+    // how far past cum_frag the sender may go: the reorder window, less whatever the write queue
+    // can't take right now. at least 1 so the sender keeps a fragment in flight and hears about it
+    // when the queue drains, instead of both sides waiting on each other
+    unsigned int rwnd = r->window;
+    if (r->order_buf) { // slots still waiting on the pipe can't take anything new
+        rwnd = MIN(rwnd, MAX_WINDOW - (r->cum_frag - r->flushed));
+    } else if (r->writer) {
+        rwnd = MIN(rwnd, writerRoom(r->writer));
+    } else if (r->uring) {
+        rwnd = MIN(rwnd, uringRoom(r->uring));
+    }
+    rwnd = MAX(rwnd, 1);
+    if (r->rate_limited) { // not past what we've been granted, receiverGrant opens it again
+        rwnd = MIN(rwnd, r->credit > r->cum_frag ? r->credit - r->cum_frag : 0);
+    }
+    return rwnd;
+}
+
+void sendAck(struct receiver *r, unsigned int ack_nack, unsigned long long frag_no, struct timespec now) {
+    // any ack or nack carries cum_frag, so it covers whatever delayed ack was pending. with a
+    // merkle tree the last fragment isn't acked until it's all verified, so the sender stays to answer,
+    // and with hold_last not until the server's put the file in place
+    if (ack_nack && frag_no >= r->total_frag && r->total_frag > 0 && ((r->merkle && !r->merkle->verified) || r->hold_last)) {
+        frag_no = r->total_frag - 1;
+    }
+    struct ackpkt ack = {ack_nack, frag_no, r->transfer_id, 0, receiverWindow(r)};
+    if (r->cum_frag > 0) {
+        double delay_ms = get_time_diff(r->recv_time[r->cum_frag % MAX_WINDOW], now);
+        ack.delay_us = delay_ms > 0 ? (unsigned int) (delay_ms * 1000) : 0;
+    }
+    char msg[MAXBUFLEN];
+    size_t msg_len = serializeAck(&ack, msg, MAXBUFLEN);
+    sendMsg(r->sockfd, msg, msg_len, (struct sockaddr *) &r->peer_addr, r->peer_addr_len);
+    traceEvent(TRACE_ACK_SEND, r->transfer_id, frag_no, 0, ack_nack ? 0 : TRACE_NACK, ack.rwnd, ack.delay_us);
+    if (ack.rwnd == 0) {
+        r->reopen_pending = 1;
+    }
+
+    r->unacked = 0;
+    r->ack_pending = 0;
+    r->acks_sent += 1;
+}
+
+void writeAt(struct receiver *r, const char *data, unsigned int size, off_t offset) {
+    // by whichever way this receiver writes
+    if (r->writer) {
+        writerWrite(r->writer, r->fd, data, size, offset);
+    } else if (r->uring) {
+        uringWrite(r->uring, r->fd, data, size, offset);
+    } else if (pwrite(r->fd, data, size, offset) == -1) {
+        perror("pwrite");
+        exit(1);
+    }
+}
+
+int writeFragment(struct receiver *r, const struct packet *pkt, unsigned long long frag_no) {
+    // fragments can arrive out of order, so write each one at its own offset. the output was
+    // truncated and sized up front, so holes are already zeros there and stay sparse. -1 if
+    // a dup record names data we don't have after all
+    off_t offset = (off_t) (frag_no - 1) * r->frag_size;
+    const char *data = pkt->filedata;
+    unsigned int size = pkt->size;
+    char stored[MAX_FRAG_SIZE];
+    if (r->parts[frag_no % PART_SLOTS].frag_no == frag_no) { // came whole after all, forget the parts
+        r->parts[frag_no % PART_SLOTS].frag_no = 0;
+    }
+    if (r->order_buf) { // its turn comes in receiverFlush, holes are written out as zeros there
+        char *slot = r->order_buf + (size_t) (frag_no % MAX_WINDOW) * r->frag_size;
+        r->order_len[frag_no % MAX_WINDOW] = pkt->hole_frags > 0 ? MIN((off_t) r->frag_size, r->file_size - offset) : size;
+        if (pkt->hole_frags > 0) {
+            memset(slot, 0, r->frag_size);
+        } else {
+            memcpy(slot, data, size);
+        }
+        return 0;
+    }
+    if (pkt->from_store) { // copy it out of the store instead
+        size = MIN((off_t) r->frag_size, r->file_size - offset);
+        if (storeRead(r->dedup, stored, size, offset) == -1) {
+            fprintf(stderr, "Error: chunk store is missing data for fragment %llu\n", frag_no);
+            return -1;
+        }
+        data = stored;
+        r->stored_frags += 1;
+    }
+
+    char zeros[MAX_FRAG_SIZE];
+    if (pkt->hole_frags > 0 && !pkt->from_store && r->merkle && frag_no <= r->cum_frag) {
+        // a repair can't leave the bad data there, everywhere else it's zeros already
+        memset(zeros, 0, sizeof zeros);
+        size = MIN((off_t) r->frag_size, r->file_size - offset);
+        data = zeros;
+    } else if (pkt->hole_frags > 0 && !pkt->from_store) {
+        if (r->writer && r->writer->direct) { // nothing to write, but its block can't go out without it
+            writerZeros(r->writer, r->fd, MIN((off_t) r->frag_size, r->file_size - offset), offset);
+        }
+        return 0;
+    }
+    writeAt(r, data, size, offset);
+    return 0;
+}
+
+void receiverOnRepair(struct receiver *r, const struct packet *pkt, unsigned long long last_frag) {
+    // fragments behind cum_frag we asked for again because their block didn't verify
+    if (r->merkle == NULL || pkt->frag_no == 0 || last_frag > r->total_frag) {
+        return;
+    }
+    off_t run_start = (off_t) (pkt->frag_no - 1) * r->frag_size;
+    if (pkt->from_store && !manifestCovers(r->dedup, run_start, MIN((off_t) last_frag * r->frag_size, r->file_size) - run_start)) {
+        return;
+    }
+    for (unsigned long long frag_no = pkt->frag_no; frag_no <= last_frag; frag_no++) {
+        if (!receiverRepairFrag(r, frag_no)) {
+            continue;
+        }
+        if (writeFragment(r, pkt, frag_no) == -1) {
+            r->merkle->missing[(frag_no - 1) / MERKLE_BLOCK_FRAGS] |= 1ULL << ((frag_no - 1) % MERKLE_BLOCK_FRAGS);
+            continue;
+        }
+        receiverRepairDone(r, frag_no);
+    }
+}
+
+unsigned long long receiverLimit(const struct receiver *r) {
+    // furthest fragment the sender may be sending right now
+    unsigned long long limit = r->cum_frag + r->window;
+    if (r->order_buf) { // and not onto a slot the pipe hasn't taken yet
+        limit = MIN(limit, r->flushed + MAX_WINDOW);
+    }
+    if (r->rate_limited) { // a sender that ignores the window gets nothing for it
+        limit = MIN(limit, r->credit);
+    }
+    return limit;
+}
+
+void receiverAdvance(struct receiver *r, unsigned long long first, unsigned long long last, struct timespec now) {
+    // fragments [first, last] just came in: move cum_frag past them if they were next, and ack
+    r->highest_frag = MAX(r->highest_frag, last);
+    if (first != r->cum_frag + 1) { // gap, nack the missing fragment right away so the sender can fast retransmit
+        sendAck(r, 0, r->cum_frag + 1, now);
+        return;
+    }
+
+    while (r->cum_frag < r->total_frag && r->received[(r->cum_frag + 1) % MAX_WINDOW]) {
+        r->received[(r->cum_frag + 1) % MAX_WINDOW] = 0;
+        r->cum_frag += 1;
+        if (r->merkle && (r->cum_frag % MERKLE_BLOCK_FRAGS == 0 || r->cum_frag == r->total_frag)) {
+            receiverHashBlock(r, (r->cum_frag - 1) / MERKLE_BLOCK_FRAGS); // that block's all here
+        }
+    }
+    r->unacked += last - first + 1;
+    if (r->order_buf) {
+        receiverFlush(r);
+    }
+
+    // ack now if this filled a hole (sender is recovering), there's still a hole, it's the
+    // last fragment, enough have piled up, or the sender's stuck on our window until it hears from us.
+    // otherwise wait a bit and ack several at once
+    int filled_hole = r->cum_frag > last;
+    if (filled_hole || r->highest_frag > r->cum_frag || receiverDone(r) || r->unacked >= ACK_EVERY || r->unacked >= receiverWindow(r)) {
+        sendAck(r, 1, r->cum_frag, now);
+    } else if (!r->ack_pending) {
+        r->ack_pending = 1;
+        r->ack_due = add_time_ms(now, ACK_DELAY_MS);
+    }
+    receiverMerkleProgress(r, now);
+}
+
+int partArrived(struct receiver *r, const struct packet *pkt) {
+    // notes which bytes of its fragment a part has, 1 once that's all of them
+    struct part_state *ps = &r->parts[pkt->frag_no % PART_SLOTS];
+    if (ps->frag_no != pkt->frag_no) { // whatever had the slot isn't getting finished, the sender's long past it
+        ps->frag_no = pkt->frag_no;
+        memset(ps->have, 0, sizeof ps->have);
+    }
+    unsigned int end = (pkt->part_offset + pkt->size + PART_UNIT - 1) / PART_UNIT;
+    for (unsigned int u = pkt->part_offset / PART_UNIT; u < end; u++) {
+        ps->have[u / 64] |= 1ULL << (u % 64);
+    }
+    unsigned int units = (pkt->frag_len + PART_UNIT - 1) / PART_UNIT;
+    for (unsigned int u = 0; u < units; u++) {
+        if (!((ps->have[u / 64] >> (u % 64)) & 1)) {
+            return 0;
+        }
+    }
+    ps->frag_no = 0;
+    r->part_frags += 1;
+    return 1;
+}
+
+void receiverOnPart(struct receiver *r, const struct packet *pkt, struct timespec now) {
+    // a piece of a fragment the sender split up because its path stopped taking whole ones. it
+    // goes where it belongs right away, and the fragment counts as received once it's all here
+    unsigned long long frag_no = pkt->frag_no;
+    off_t offset = (off_t) (frag_no - 1) * r->frag_size;
+    if (frag_no == 0 || frag_no > r->total_frag || pkt->frag_len > r->frag_size ||
+        (r->file_size > 0 && pkt->frag_len != MIN((off_t) r->frag_size, r->file_size - offset))) {
+        return; // not how this transfer's fragments are cut
+    }
+    if (frag_no <= r->cum_frag) { // a repair, or our ack got lost
+        if (receiverRepairWanted(r, frag_no)) {
+            writeAt(r, pkt->filedata, pkt->size, offset + pkt->part_offset);
+            if (partArrived(r, pkt) && receiverRepairFrag(r, frag_no)) {
+                receiverRepairDone(r, frag_no);
+            }
+        } else if (pkt->part_offset + pkt->size == pkt->frag_len) { // once a fragment, not once a part
+            sendAck(r, 1, r->cum_frag, now);
+        }
+        receiverMerkleProgress(r, now);
+        return;
+    }
+    if (frag_no > receiverLimit(r) || r->received[frag_no % MAX_WINDOW]) {
+        return;
+    }
+    if (r->order_buf) {
+        memcpy(r->order_buf + (size_t) (frag_no % MAX_WINDOW) * r->frag_size + pkt->part_offset, pkt->filedata, pkt->size);
+        r->order_len[frag_no % MAX_WINDOW] = pkt->frag_len;
+    } else {
+        writeAt(r, pkt->filedata, pkt->size, offset + pkt->part_offset);
+    }
+    if (!partArrived(r, pkt)) {
+        return;
+    }
+    r->received[frag_no % MAX_WINDOW] = 1;
+    r->recv_time[frag_no % MAX_WINDOW] = now;
+    if (r->verbose) {
+        printf("Received fragment %llu/%llu (%u file bytes) in parts\n", frag_no, pkt->total_frag, pkt->frag_len);
+    }
+    receiverAdvance(r, frag_no, frag_no, now);
+}
+
+void receiverOnData(struct receiver *r, const struct packet *pkt, struct timespec now) {
+    if (pkt->transfer_id != r->transfer_id) {
+        return;
+    }
+    r->last_heard = now;
+    if (tracer) {
+        unsigned int flags = pkt->from_store ? TRACE_DUP : pkt->hole_frags > 0 ? TRACE_HOLE : 0;
+        traceEvent(TRACE_RECV, r->transfer_id, pkt->frag_no, pkt->hole_frags > 0 ? pkt->hole_frags : 1, flags, pkt->hole_frags > 0 ? 0 : pkt->size, 0);
+    }
+    r->reopen_pending = 0; // the sender heard the window's open
+    if (r->total_frag == UNKNOWN_FRAGS && pkt->total_frag > 0 && pkt->total_frag >= MAX(r->cum_frag, r->highest_frag)) {
+        r->total_frag = pkt->total_frag; // stream's sender got to the end
+    }
+    if (pkt->frag_len > 0) {
+        receiverOnPart(r, pkt, now);
+        return;
+    }
+
+    // a hole record stands for several fragments, data for one
+    unsigned long long last_frag = pkt->frag_no + (pkt->hole_frags > 0 ? pkt->hole_frags - 1 : 0);
+    if (last_frag <= r->cum_frag) { // duplicate, our ack must've gotten lost. or a block we asked for again
+        receiverOnRepair(r, pkt, last_frag);
+        sendAck(r, 1, r->cum_frag, now);
+        receiverMerkleProgress(r, now);
+        return;
+    }
+    unsigned long long limit = receiverLimit(r);
+    if (pkt->frag_no == 0 || pkt->frag_no > limit || last_frag > r->total_frag) { // sender shouldn't be this far ahead
+        return;
+    }
+
+    unsigned long long first = MAX(pkt->frag_no, r->cum_frag + 1);
+    unsigned long long last = MIN(last_frag, limit);
+    off_t run_start = (off_t) (first - 1) * r->frag_size;
+    if (pkt->from_store && !manifestCovers(r->dedup, run_start, MIN((off_t) last * r->frag_size, r->file_size) - run_start)) {
+        return; // we never said we had these chunks
+    }
+    for (unsigned long long frag_no = first; frag_no <= last; frag_no++) {
+        if (r->received[frag_no % MAX_WINDOW]) {
+            continue;
+        }
+        if (writeFragment(r, pkt, frag_no) == -1) {
+            continue;
+        }
+        r->received[frag_no % MAX_WINDOW] = 1;
+        r->recv_time[frag_no % MAX_WINDOW] = now;
+        r->hole_frags += pkt->hole_frags > 0 && !pkt->from_store;
+    }
+    if (r->verbose && pkt->hole_frags > 0) {
+        printf("Received %s %llu-%llu/%llu\n", pkt->from_store ? "dup" : "hole", pkt->frag_no, last_frag, pkt->total_frag);
+    } else if (r->verbose) {
+        printf("Received fragment %llu/%llu (%u file bytes)\n", pkt->frag_no, pkt->total_frag, pkt->size);
+    }
+    receiverAdvance(r, first, last, now);
+}
+
+double receiverTimeLeft(const struct receiver *r, struct timespec now) {
+    // ms until receiverOnTimer has something to do: the delayed ack, looking at the merkle tree
+    // again, or giving up on the sender. MAX_TIMEOUT at most
+    double left = MIN(MAX_TIMEOUT, r->idle_ms - get_time_diff(r->last_heard, now));
+    if (r->ack_pending) {
+        left = get_time_diff(now, r->ack_due);
+    }
+    if (r->order_buf && r->flushed < r->cum_frag) { // pipe was full
+        left = MIN(left, PIPE_RETRY_MS);
+    }
+    return MIN(left, receiverMerkleTimeLeft(r, now));
+}
+
+int receiverOnTimer(struct receiver *r, struct timespec now) {
+    // returns -1 once the sender's been quiet for too long
+    if (get_time_diff(r->last_heard, now) >= r->idle_ms) {
+        return -1;
+    }
+    unsigned long long flushed = r->flushed;
+    if (r->order_buf) {
+        receiverFlush(r);
+    }
+    if (r->flushed > flushed && MAX_WINDOW - (r->cum_frag - flushed) < ACK_EVERY) { // window had all but shut, tell the sender it's open
+        sendAck(r, 1, r->cum_frag, now);
+    } else if (r->ack_pending && get_time_diff(now, r->ack_due) <= 0) {
+        sendAck(r, 1, r->cum_frag, now);
+    }
+    receiverMerkleProgress(r, now);
+    return 0;
+}
+
+unsigned long long receiverWants(const struct receiver *r) {
+    // fragments of credit it could use right now, as far as the window and the file go
+    unsigned long long most = MIN(r->cum_frag + r->window, r->total_frag);
+    return most > r->credit ? most - r->credit : 0;
+}
+
+void receiverGrant(struct receiver *r, unsigned long long frags, struct timespec now) {
+    // frags more the sender may send. if we'd told it the window was shut, tell it it's open, and
+    // keep doing so every grant until data shows up in case that ack got lost
+    r->credit += MIN(frags, receiverWants(r));
+    if (r->reopen_pending && receiverWindow(r) > 0) {
+        sendAck(r, 1, r->cum_frag, now);
+    }
+}
+
+int receiverDone(const struct receiver *r) {
+    return r->cum_frag >= r->total_frag && (r->merkle == NULL || r->merkle->verified) && (r->order_buf == NULL || r->flushed >= r->total_frag);
+}
@@ -0,0 +1,854 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// shared by deliver and server: wire format, and the sender/receiver halves of a transfer.
+// whoever has the file runs a sender, whoever wants it runs a receiver, so uploads (ftp)
+// and downloads (get) go through the same code
+
+#define MAXBUFLEN 9000 // biggest datagram we send or take, a jumbo frame's payload and a byte for a terminator
+#define FRAG_SIZE 1000 // fragment size we propose in the handshake when we don't know the path MTU
+#define PKT_HEADER_MAX 64 // most a data packet's header can take, the rest of a datagram is fragment
+#define MAX_FRAG_SIZE (MAX_PLPMTU - 28 - PKT_HEADER_MAX) // a jumbo frame's worth, leaves room for the header in MAXBUFLEN
+#define MAX_FILENAME 256
+#define MAX_TIMEOUT 30000
+#define MAX_WINDOW 64 // max fragments in flight we support, all per-fragment state is this big whatever the file size
+#define INITIAL_WINDOW 10 // fragments sent along with the handshake, before we hear back
+#define DUP_NACK_THRESHOLD 3 // fast retransmit after this many nacks for the same fragment
+#define MAX_TIMEOUTS 10 // give up on the peer after this many timeouts in a row
+#define IDLE_TIMEOUT (MAX_TIMEOUTS * MAX_TIMEOUT) // receiver gives up on a sender it hasn't heard from in this long, a live one would have given up on us by then
+#define KEEPALIVE_MS 1000 // sender waiting on its own source (a quiet stream) probes the receiver this often so it doesn't give up on us
+#define ACK_EVERY 4 // receiver acks every this many in-order fragments...
+#define ACK_DELAY_MS 5 // ...or this long after the first unacked one, whichever comes first
+#define PACING_QUANTUM_MS 1 // a paced sender can burst this much sending time to catch up after a late wakeup
+#define WRITE_RING_SIZE 1024 // fragments the network thread can hand the disk thread before it has to wait, power of 2
+#define WRITE_BATCH 64 // most fragments one pwritev writes
+#define DIRECT_BLOCK (1 << 20) // a direct writer packs fragments into aligned blocks this big and writes them whole...
+#define DIRECT_ALIGN 4096 // ...O_DIRECT wants offsets, lengths and buffers to be multiples of this
+#define DIRECT_POOL 16 // blocks a direct writer can be filling at once, across every transfer
+#define READ_AHEAD_MB 4 // default for how far ahead of the window the sender reads
+#define READ_AHEAD_RETRY_MS 1 // how soon to look again when read-ahead hasn't got to the next fragment yet
+#define PIPE_RETRY_MS 1 // how soon a receiver writing to a full pipe tries it again
+#define PUBLISH_POLL_MS 1 // how often the server looks whether the writer thread's got a finished upload under its real name yet
+#define RATE_TICK_MS 1 // how often a rate limited server hands out window to its uploads, a window per tick is the most one can get
+#define UNKNOWN_FRAGS (1ULL << 62) // total_frag of a stream until its end marker, past anything that gets sent
+#define URING_ENTRIES 256 // submission queue size for the io_uring engine
+#define URING_RECV_BUFS 256 // datagrams the kernel can have received that we haven't looked at yet
+#define URING_OPS 1024 // sends, writes and closes that can be in flight at once
+#define CHUNK_MIN 2048 // content-defined chunks for dedup are at least this big...
+#define CHUNK_AVG_BITS 13 // ...about 2^this on average past CHUNK_MIN...
+#define CHUNK_MAX 65536 // ...and at most this big
+#define CHUNKS_PER_QUERY 32 // chunk hashes per "chunks" message, fits in MAXBUFLEN
+#define CHUNK_DIR "chunks" // where a dedup server keeps chunks, named by hash, relative to where it runs
+#define SHA256_LEN 32
+#define MERKLE_BLOCK_FRAGS 64 // fragments per merkle leaf, a block's fragments fit in one 64 bit mask
+#define MERKLE_GROUP_LEAVES 32 // leaves the receiver checks with the sender at once, power of 2
+#define MERKLE_RETRY_MS 50 // ask again about a group, or for its bad blocks, if we haven't heard back by then
+#define MCAST_RATE_MB 10 // default rate a multicast sender paces at, it has no single receiver's acks to go by
+#define MCAST_ANNOUNCE_MS 100 // multicast sender repeats what it's sending this often, for late joiners and lost tails
+#define MCAST_NACK_BACKOFF_MS 20 // receivers wait up to this long (at random) before nacking, so they don't all at once
+#define MCAST_REPAIR_HOLD_MS 100 // a receiver doesn't nack fragments the sender said it's repairing for this long
+#define MCAST_LINGER_MS 2000 // sender stays this long after its last nack, for receivers still repairing
+#define MCAST_NACK_RANGES 32 // most (first, count) ranges in one nack
+#define MCAST_HELD_RANGES 64 // repairs the sender announced that a receiver remembers
+#define SIM_SENDER_FD -2 // sockfds the two ends of a simulated transfer send on, see sim.c. not real sockets
+#define SIM_RECEIVER_FD -3
+#define MAX_PATHS 8 // local addresses (or interfaces) one multipath upload can go out over
+#define NO_PATH 255 // frag_state.path of a fragment that isn't out on any path
+#define PATH_LOSS_GAIN 0.05 // weight of each fragment's fate in a path's loss estimate
+#define PATH_DOWN_LOSSES 4 // a path that loses this many in a row with nothing getting through is down...
+#define PATH_RETRY_MS 1000 // ...and gets a fragment at a time again after this long, to see if it's back
+#define PATH_CHALLENGE_MS 100 // server challenges an upload's data from a new source address at most this often, acks stay where they were until it answers
+#define BASE_PLPMTU 1200 // path MTU search (see pmtu.c) takes every path to carry IP packets this big...
+#define MAX_PLPMTU 9000 // ...and looks no further than jumbo frames
+#define PMTU_PROBES 3 // a probe size is too big once this many probes of it go unanswered
+#define PMTU_LADDER 7 // sizes probed at once in each round of the search, between what works and what doesn't
+#define PMTU_STEP 16 // search stops when what works is this close to what doesn't
+#define PMTU_PROBE_MIN_MS 10 // least we wait for a probe's answer
+#define PMTU_RAISE_MS 600000 // look for a bigger path MTU again after this long, and try whole fragments again
+#define PMTU_BLACKHOLE_TIMEOUTS 3 // timeouts in a row with nothing acked before a sender takes it the path MTU shrank...
+#define PART_SIZE 1024 // ...and splits fragments into parts this big, a part fits BASE_PLPMTU whatever the headers
+#define PART_HEADER_MAX 96 // most a part record's header can take
+#define PART_UNIT 64 // receiver tracks which bytes of a split fragment it has in units of this, parts start on them
+#define PART_WORDS ((MAX_FRAG_SIZE + PART_UNIT * 64 - 1) / (PART_UNIT * 64)) // bitmap words per fragment
+#define PART_SLOTS (2 * MAX_WINDOW) // split fragments a receiver can be putting together at once, repairs included
+#define TRACE_RING_SIZE 16384 // trace records a thread can have waiting for the flusher, power of 2
+#define TRACE_FLUSH_MS 10 // how often the flusher thread writes out what's in the rings
+
+#define PROTOCOL_VERSION 1
+// feature flags, each side advertises what it supports and the transfer uses the intersection
+#define FEATURE_COMPRESSION 0x1
+#define FEATURE_FEC 0x2
+#define FEATURE_CHECKSUM 0x4
+#define FEATURE_SPARSE 0x8 // runs of all-zero fragments go as a single "hole" record
+#define FEATURE_DEDUP 0x10 // uploads ask which chunks the server already has and only send the rest
+#define FEATURE_MERKLE 0x20 // receiver checks blocks against a hash tree whose root is in the sender's handshake
+#define FEATURE_STREAM 0x40 // size isn't known up front, an empty fragment marks the end. none of the above with it
+#define FEATURE_PARTS 0x80 // receiver takes a fragment split over several "part" records, for when the path MTU shrinks
+#define SUPPORTED_FEATURES (FEATURE_SPARSE | FEATURE_DEDUP | FEATURE_MERKLE | FEATURE_STREAM | FEATURE_PARTS)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// serialized as "<total_frag>:<frag_no>:<size>:<transfer_id>:<filedata>", or for a run of zero
+// fragments as "hole:<total_frag>:<frag_no>:<hole_frags>:<transfer_id>" with no data. a run the
+// receiver already has in its chunk store is the same with "dup" for "hole". a stream's
+// fragments have total_frag 0 until the sender hits the end, which goes as an empty fragment.
+// a fragment too big for the path goes in pieces as
+// "part:<total_frag>:<frag_no>:<frag_len>:<offset>:<size>:<transfer_id>:<filedata>", filedata
+// being bytes [offset, offset + size) of the frag_len byte fragment
+struct packet {
+    unsigned long long total_frag;
+    unsigned long long frag_no;
+    unsigned int size;
+    unsigned int transfer_id; // from the handshake, so stale packets from older transfers get ignored
+    unsigned int hole_frags; // 0 for data, otherwise fragments [frag_no, frag_no + hole_frags) are all zeros
+    int from_store; // or, if set, are made of chunks the receiver already has
+    unsigned int frag_len; // 0, or this is a part of a fragment that long...
+    unsigned int part_offset; // ...starting this far in, a multiple of PART_UNIT
+    char filedata[MAX_FRAG_SIZE];
+};
+
+// serialized as "ack:<transfer_id>:<frag_no>:<delay_us>:<rwnd>" or "nack:<transfer_id>:<frag_no>:<delay_us>:<rwnd>"
+struct ackpkt {
+    unsigned int ack_nack; // 1 for ack, 0 for nack
+    unsigned long long frag_no; // ack: every fragment up to frag_no arrived, nack: receiver is missing frag_no
+    unsigned int transfer_id;
+    unsigned int delay_us; // how long the receiver held the ack back, the sender takes it out of its RTT sample
+    unsigned int rwnd; // receiver can take fragments up to its cumulative ack + rwnd, less than the window when its disk is behind
+};
+
+// the client sends "ftp:..." (upload) or "get:..." (download), the server answers with
+// "yes:..." holding the negotiated values, or "no". a busy server won't commit to anything for
+// a client that hasn't shown it's really at its address, and answers "retry:<transfer_id>:<cookie>"
+// instead, the client sends the handshake again with the cookie in it. upload data from an
+// address the transfer hasn't come from before gets "challenge:<transfer_id>:<cookie>" sent
+// there, and acks only follow once "response:<transfer_id>:<cookie>" comes back from it
+struct handshake {
+    unsigned int version;
+    unsigned int frag_size;
+    unsigned int window; // max fragments in flight
+    unsigned int rcvbuf; // receiver's socket buffer, in bytes
+    unsigned int flags; // FEATURE_* bits
+    long long file_size; // 0 in a get request, the server fills it in
+    unsigned int transfer_id;
+    unsigned long long cookie; // from the server, tied to the client's address, in hex. 0 if we have none
+    unsigned char root[SHA256_LEN]; // merkle root of the file from whoever sends it, hex or "-" on the wire
+    char filename[MAX_FILENAME]; // echoed back in the reply
+};
+
+// where a sender reads fragments from, a mapping (can be shared between transfers) or pread on fd
+struct file_source {
+    int fd;
+    const char *map; // NULL if we pread instead
+    off_t size;
+    struct manifest *recipe; // file is stored as chunks in the dedup store, read through this and not fd
+    int stream; // fd is a pipe or the like: read once front to back, non-blocking, and size means nothing
+};
+
+// dedup: files are cut into chunks where the content says so (a rolling hash hits a pattern), so an
+// insert or delete only changes the chunks around it, and chunks are named by their SHA-256
+struct chunk {
+    unsigned char hash[SHA256_LEN];
+    unsigned int len;
+    off_t offset;
+    int have; // the receiver (or the store, on the server) has this chunk
+};
+
+struct manifest {
+    off_t size;
+    unsigned long long count;
+    struct chunk *chunks; // in file order
+    pthread_mutex_t lock; // guards the open chunk, the reader thread and the send loop both read
+    long long open_chunk; // chunk open_fd is, -1 for none
+    int open_fd;
+};
+
+// "chunks:<transfer_id>:<total>:<first>:<offset>:<count>:" then count binary (hash, 4 byte big
+// endian length) pairs. the receiver answers "have:<transfer_id>:<first>:<count>:<bits in hex>"
+struct chunk_query {
+    unsigned int transfer_id;
+    unsigned long long total; // chunks in the whole file
+    unsigned long long first; // index of chunks[0]
+    off_t offset; // where chunks[0] starts in the file
+    unsigned int count;
+    struct chunk chunks[CHUNKS_PER_QUERY];
+};
+
+struct chunk_answer {
+    unsigned int transfer_id;
+    unsigned long long first;
+    unsigned int count;
+    unsigned int have; // bit i is set if the receiver has chunk first + i
+};
+
+struct sha256 {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t buf_len;
+};
+
+// hash tree over blocks of MERKLE_BLOCK_FRAGS fragments. the sender has all the leaves up front;
+// the receiver fills them in as blocks land and checks them with the sender a group at a time.
+// "verify:<transfer_id>:<group>:<subtree root in hex>" goes to the sender, which answers
+// "tree:<transfer_id>:<group>:<ok>:<count>:" plus its leaves in binary when not ok, and the
+// receiver asks for bad blocks again with "resend:<transfer_id>:<frag_no>:<count>"
+enum merkle_msg {
+    MERKLE_VERIFY, MERKLE_TREE, MERKLE_RESEND
+};
+
+struct merkle {
+    unsigned int frag_size;
+    unsigned long long leaves;
+    unsigned char (*leaf)[SHA256_LEN];
+    unsigned char root[SHA256_LEN]; // ours on the sender, the sender's on the receiver
+
+    // receiver only
+    atomic_uchar *hashed; // leaf i is the hash of block i as it is on disk, set by whoever hashed it
+    unsigned long long *missing; // fragments of block i we asked for again and haven't got, bit per fragment
+    unsigned long long groups;
+    unsigned char *group_state; // see merkle.c
+    struct timespec *group_asked;
+    unsigned long long first_unverified; // groups before this one all checked out
+    unsigned long long repair_inflight; // fragments in the last batch of repairs we asked for that haven't come
+    struct timespec repair_asked;
+    int verified; // every group did, and the root matched
+    int failed; // every group did but the root didn't match, the file's no good and the last ack never goes
+    unsigned long long bad_blocks;
+};
+
+// multicast uploads, see mcast.c. the sender sends "mcast:..." announcements and ordinary data
+// packets to the group, receivers nack to the sender with "mnack:<transfer_id>:<ranges>:<first>:<count>...",
+// and the sender tells the group what it'll repair with "mrepair:<transfer_id>:<first>:<count>"
+struct mcast_announce {
+    unsigned int transfer_id;
+    unsigned int frag_size;
+    long long file_size;
+    unsigned long long sent; // fragments [1, sent] have gone out at least once
+    char filename[MAX_FILENAME];
+};
+
+struct mcast_range {
+    unsigned long long first, count;
+    struct timespec until;
+};
+
+struct mcast_sender {
+    int sockfd;
+    struct sockaddr_storage group;
+    socklen_t group_len;
+    const struct file_source *src;
+    unsigned int frag_size;
+    unsigned long long total_frag;
+    unsigned int transfer_id;
+    char filename[MAX_FILENAME];
+
+    unsigned long long next_frag; // next fragment that hasn't gone out once yet
+    unsigned char *repair; // bit per fragment, nacked and not sent again yet
+    unsigned long long repairs_pending;
+    unsigned long long repair_next; // no repair below this one
+    double rate; // fragments per ms
+    struct timespec next_send, next_announce;
+    struct timespec quiet_since; // last nack, or when the last new fragment went out
+
+    unsigned long long nacks, repairs_sent;
+};
+
+struct mcast_receiver {
+    int sockfd;
+    struct sockaddr_storage sender_addr; // nacks go straight to the sender, not the group
+    socklen_t sender_addr_len;
+    int fd;
+    struct writer *writer; // NULL to pwrite
+    unsigned int frag_size;
+    unsigned long long total_frag;
+    unsigned int transfer_id;
+    off_t file_size;
+
+    unsigned char *have; // bit per fragment
+    unsigned long long received;
+    unsigned long long first_missing; // we have everything before this
+    unsigned long long sent; // newest fragment the sender has sent, anything missing below it got lost
+    struct mcast_range held[MCAST_HELD_RANGES]; // repairs the sender announced, ring
+    int held_next;
+    int nack_pending;
+    struct timespec nack_due;
+    struct timespec last_heard;
+
+    unsigned long long nacks_sent, nacks_suppressed, dup_frags;
+};
+
+// fragments read ahead of the sender by another thread, so the send loop doesn't block on the disk.
+// fragment f sits in slot (f - 1) % slots while tail < f <= head
+struct reader {
+    pthread_t thread;
+    const struct file_source *src;
+    unsigned int frag_size;
+    unsigned long long total_frag;
+    char *bufs; // slots * frag_size bytes
+    unsigned long long slots;
+    atomic_ullong head; // fragments read so far, only the reader thread writes this
+    atomic_ullong tail; // fragments the sender is done with, only the sender writes this
+    atomic_int sleeping; // reader thread is (about to be) waiting on wake for free slots
+    atomic_int stop;
+    sem_t wake;
+};
+
+// congestion controllers a sender can run
+enum cc_algo {
+    CC_RENO, // loss-based: slow start, AIMD, halve on fast retransmit, back to 1 on timeout
+    CC_BBR // model-based: paces at the measured bottleneck bandwidth, loss doesn't shrink the window
+};
+
+enum bbr_state {
+    BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT
+};
+
+#define BBR_BW_ROUNDS 10 // bottleneck bandwidth is the max delivery rate over this many round trips
+#define BBR_MIN_RTT_MS 10000 // min RTT is considered stale after this long
+#define BBR_PROBE_RTT_MS 200 // how long we sit at BBR_MIN_CWND to re-measure min RTT
+#define BBR_MIN_CWND 4
+#define BBR_HIGH_GAIN 2.885 // 2/ln(2), doubles the sending rate every round in startup
+
+// per-slot state for fragments in flight, slot is frag_no % MAX_WINDOW
+struct frag_state {
+    struct timespec sent_time;
+    int retransmitted; // karn's alg: no RTT samples from retransmitted fragments
+    // sender's delivery state when this went out, to turn its ack into a delivery rate sample
+    unsigned long long delivered;
+    struct timespec delivered_time;
+    unsigned char path; // which of a multipath sender's paths it last went out on, NO_PATH if none
+};
+
+struct bbr {
+    enum bbr_state state;
+    double btl_bw; // bottleneck bandwidth estimate, fragments per ms
+    double bw_samples[BBR_BW_ROUNDS]; // max delivery rate seen in each of the last few round trips
+    unsigned long long round_count;
+    unsigned long long next_round_delivered; // a round trip ends once this much has been delivered
+    double min_rtt; // ms, < 0 until we have a sample
+    struct timespec min_rtt_stamp;
+    double full_bw; // startup ends once bandwidth stops growing 25% a round...
+    int full_bw_count; // ...for 3 rounds
+    int cycle_index; // position in the probe_bw gain cycle
+    struct timespec cycle_stamp;
+    struct timespec probe_rtt_done;
+    double pacing_gain, cwnd_gain;
+};
+
+// multipath: an upload can go out over several sockets, each bound to its own local address or
+// interface, still as one transfer with one window. each fragment goes on the path that should get
+// it there soonest, going by what's already in flight on it, its RTT and how much it loses, and
+// the receiver acks on whichever path data last came in on. see multipath.c
+enum path_state {
+    PATH_UP,
+    PATH_FAILED, // just went down, what's in flight on it still has to move to the others
+    PATH_DOWN
+};
+
+struct path {
+    int sockfd;
+    char name[32]; // the address or interface, for printing
+    enum path_state state;
+    int probing; // back from down, one fragment at a time until one gets through
+    struct timespec down_since;
+    double srtt; // ms, 0 until it has a sample
+    double loss; // fraction of fragments lost, a moving average
+    unsigned int inflight; // fragments whose last copy went out on this path
+    unsigned int losses_in_row;
+    struct timespec last_loss; // when the last fragment it lost was sent
+    unsigned long long sent, lost;
+};
+
+struct sender {
+    int sockfd;
+    struct sockaddr_storage peer_addr;
+    socklen_t peer_addr_len;
+    const struct file_source *src;
+    unsigned int frag_size;
+    unsigned long long total_frag;
+    unsigned int transfer_id;
+    unsigned int max_window; // from the receiver's limits in the handshake
+    unsigned int rcv_window, rcvbuf; // those limits, its window and socket buffer
+    unsigned int rwnd; // from its latest ack, never more than max_window
+    unsigned int flags; // FEATURE_* bits the receiver agreed to, none until we hear back
+
+    // sliding window: fragments [base, next_frag) are in flight
+    struct frag_state window[MAX_WINDOW];
+    unsigned long long base; // oldest unacked fragment
+    unsigned long long next_frag; // next fragment we haven't sent yet
+    unsigned long long last_nack; // fragment the receiver last nacked
+    int dup_nacks; // how many nacks in a row we got for last_nack
+    unsigned long long recover; // highest fragment sent when we entered fast recovery, 0 when not recovering
+    struct timespec timer_start; // one RTO timer, for the oldest unacked fragment
+    double cwnd; // congestion window in fragments
+    double ssthresh;
+
+    enum cc_algo cc;
+    struct bbr bbr;
+    unsigned long long delivered; // fragments acked so far
+    struct timespec delivered_time; // when delivered last went up
+    double pacing_rate; // fragments per ms, 0 means send as fast as the window allows
+    struct timespec next_send_time;
+
+    // what SEEK_DATA told us about the source: [hole_start, hole_end) is a hole, and nothing
+    // before seek_checked needs asking again
+    off_t hole_start, hole_end, seek_checked;
+
+    // read-ahead: a reader thread for pread sources, or madvise on mapped ones
+    struct reader *reader; // NULL if we read as we send
+    off_t read_ahead; // bytes
+    off_t advised_to; // mapping is madvised up to here
+    unsigned long long read_stalls; // times the window was open but the next fragment wasn't read yet
+    unsigned long long rwnd_stalls; // times cwnd had room but the receiver's window didn't
+    unsigned long long probes; // zero window probes, sent when the window's shut and nothing's in flight
+    struct timespec keepalive_time; // last probe sent while waiting on our own source
+
+    double timeout_ms;
+    double estimatedRTT, devRTT;
+    int exp_backoff; // whether we are in exponential backoff mode or not
+    int timeouts; // in a row, reset by any ack
+
+    unsigned int retransmits, fast_retransmits;
+    unsigned long long hole_frags; // fragments that went out as part of a hole record
+    struct manifest *dedup; // our chunks and which the receiver has, NULL if we haven't asked
+    unsigned long long stored_frags; // fragments that went out as part of a dup record
+    struct merkle *merkle; // our tree, NULL without FEATURE_MERKLE. not ours to free, see senderClose
+    struct path *paths; // NULL unless multipath, then sockfd is paths[0]'s. not ours either
+    int num_paths;
+    unsigned long long rerouted_frags; // fragments moved off a path that went down
+    unsigned long long repaired_frags; // fragments sent again because their block failed verification
+
+    // path MTU black hole: timeouts with nothing getting through, so fragments go as PART_SIZE
+    // parts for a while, in case the path stopped taking packets as big as they are
+    int split;
+    struct timespec split_since;
+    unsigned long long split_frags; // fragments that went out in parts
+
+    // stream source: what's in flight can't be read again, so the last MAX_WINDOW fragments
+    // stay here, slot is frag_no % MAX_WINDOW. total_frag is UNKNOWN_FRAGS until the end
+    char *stream_buf;
+    unsigned int stream_len[MAX_WINDOW];
+    unsigned int stream_fill; // bytes of next_frag read so far
+    int stream_eof;
+    off_t stream_bytes; // read and sent so far
+    int verbose;
+};
+
+// received fragments on their way to disk. the network thread pushes, the writer thread pops,
+// so a slow disk holds up the ring instead of acks
+enum write_op {
+    WRITE_DATA,
+    WRITE_ZEROS, // len bytes of a hole at offset, nothing to write but a direct writer still counts them towards their block
+    WRITE_CLOSE, // close fd once everything before it is written, and rename data's first string to its second if there is one
+    WRITE_STORE, // same, but put the file into the dedup store under the second name instead of renaming it
+    WRITE_HASH, // read a block of fd back once it's written and fill in its merkle leaf
+    WRITE_FREE, // merkleFree the merkle once the hashes ahead of it are done
+    WRITE_STOP // writer thread exits
+};
+
+struct write_req {
+    enum write_op op;
+    int fd;
+    off_t offset;
+    unsigned int len;
+    struct merkle *merkle; // WRITE_HASH and WRITE_FREE only, which block is in offset
+    off_t file_size;
+    atomic_int *done; // WRITE_CLOSE and WRITE_STORE, set once the file's under its real name. NULL if nobody's waiting
+    char data[MAX_FRAG_SIZE];
+};
+
+// direct writes: fragments are copied into one of these until all DIRECT_BLOCK bytes of it are
+// there, then it goes to disk in one aligned write that bypasses the page cache
+struct direct_block {
+    int fd; // -1 if it's free
+    off_t offset; // multiple of DIRECT_BLOCK
+    char *buf; // DIRECT_ALIGN aligned
+    unsigned char *have; // a bit per byte of buf we've been given
+    unsigned int filled; // bits set in have
+    unsigned int end; // one past the last byte given, for a file's last block
+    int has_data; // all holes so far, a block that stays that way needn't be written
+    unsigned long long last_use; // the least recently used goes first when the pool's all in use
+};
+
+struct writer {
+    pthread_t thread;
+    struct write_req *ring; // WRITE_RING_SIZE slots
+    atomic_ulong head; // next slot the network thread fills, only it writes this
+    atomic_ulong tail; // next slot the writer thread drains, only it writes this
+    atomic_int sleeping; // writer thread is (about to be) waiting on wake
+    sem_t wake;
+
+    // only touched by the writer thread, read them after writerStop
+    unsigned long long frags_written, pwritevs;
+
+    // direct mode, see writerStart. the pool's only touched by the writer thread too
+    int direct;
+    struct direct_block pool[DIRECT_POOL];
+    char *bounce; // aligned, for reading back from an O_DIRECT file
+    unsigned long long use_clock;
+    unsigned long long direct_writes, partial_writes; // blocks written, and how many of those weren't full
+};
+
+// a probe in a path MTU search, see pmtu.c
+struct pmtu_probe {
+    unsigned int size; // whole IP packet
+    int tries;
+    struct timespec sent;
+    int acked; // 1 if it came back, -1 if it's too big (PMTU_PROBES went unanswered, or EMSGSIZE)
+};
+
+struct uring; // io_uring engine, see uring.c
+
+// when the server runs the io_uring engine, sendMsg queues sends here instead of calling sendto
+extern struct uring *io_ring;
+
+// the simulator sets this to put everything sendMsg is given on its simulated link instead
+extern void (*send_hook)(int sockfd, const void *msg, size_t len);
+
+// event trace (deliver's and server's trace=<file>): a fixed-size binary record for every data
+// packet, ack, timeout and RTO change, see trace.c. tracedump turns a trace into CSV or a plot
+#define TRACE_MAGIC "fttrace1"
+enum trace_event {
+    TRACE_SEND, // sender put out frag_no: count fragments (a hole or dup record), a = bytes, b = path
+    TRACE_RECV, // receiver got frag_no: count, a = bytes
+    TRACE_ACK_SEND, // receiver acked (or nacked) frag_no: a = its window, b = ack delay in us
+    TRACE_ACK_RECV, // sender got that: count = fragments in flight, a = cwnd * 1000, b = the window in it
+    TRACE_TIMEOUT, // sender timed out on frag_no: count = fragments in flight, a = the RTO it waited, in us
+    TRACE_RTO, // sender's RTO changed: a = new RTO, b = smoothed RTT, both us
+    TRACE_DROP, // server threw frag_no away on purpose, its 1% loss
+    TRACE_EVENTS
+};
+#define TRACE_RETRANSMIT 0x1 // flags: not the first time it's gone out...
+#define TRACE_HOLE 0x2 // ...a hole record...
+#define TRACE_DUP 0x4 // ...a dup record (the receiver has it in its chunk store)...
+#define TRACE_NACK 0x8 // ...a nack rather than an ack
+
+struct trace_header {
+    char magic[8]; // TRACE_MAGIC, no terminator
+    uint32_t record_size; // sizeof(struct trace_record), in case it ever grows
+    uint32_t pid;
+};
+
+struct trace_record { // 32 bytes, host byte order
+    uint64_t time_ns; // CLOCK_MONOTONIC, so a client's and a server's trace on the same box line up
+    uint64_t frag_no;
+    uint32_t transfer_id;
+    uint16_t count;
+    uint8_t event;
+    uint8_t flags;
+    uint32_t a, b;
+};
+
+// each thread that traces gets a ring of its own, so recording an event is a clock read and a few
+// stores with no lock. only that thread moves head, only the flusher moves tail
+struct trace_ring {
+    struct trace_record *records; // TRACE_RING_SIZE
+    atomic_ulong head, tail;
+    atomic_ulong dropped; // events that found the ring full, the flusher got behind
+    struct trace_ring *next;
+};
+
+struct tracer {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock; // the list of rings, threads add theirs whenever they first trace
+    struct trace_ring *rings;
+    atomic_int stop;
+};
+
+// NULL unless tracing, every traceEvent is a no-op then
+extern struct tracer *tracer;
+
+// simulated path for sim.c: data goes through a bottleneck of bw with a drop-tail queue in front of
+// it, acks come back unqueued, both ways take delay_ms and lose packets at random. nothing
+// overtakes anything else, so each direction is a FIFO of datagrams with their arrival times
+struct sim_datagram {
+    struct timespec arrive;
+    size_t len;
+    char buf[MAXBUFLEN];
+};
+
+struct sim_queue {
+    struct sim_datagram *q; // ring, grows when it has to
+    size_t head, len, cap;
+};
+
+struct sim_link {
+    double bw; // bytes per ms
+    double delay_ms; // one way
+    double queue_bytes;
+    double loss, ack_loss; // probability of each packet getting lost, 0 to 1
+    unsigned long long rng; // xorshift state, so a seed gives the same run every time
+    struct timespec now; // virtual clock
+    struct timespec busy_until; // when the bottleneck finishes with what's queued
+    struct sim_queue data, acks;
+
+    unsigned long long data_sent, acks_sent, lost, acks_lost, queue_drops;
+};
+
+// which PART_UNITs of a fragment we have, while its parts come in
+struct part_state {
+    unsigned long long frag_no; // 0 if the slot's free
+    uint64_t have[PART_WORDS];
+};
+
+struct receiver {
+    int sockfd;
+    struct sockaddr_storage peer_addr;
+    socklen_t peer_addr_len;
+    int fd; // output file
+    struct writer *writer; // NULL to pwrite from the network thread
+    struct uring *uring; // or queue the writes on the io_uring engine
+    unsigned int frag_size;
+    unsigned long long total_frag;
+    unsigned int transfer_id;
+    unsigned int window;
+
+    unsigned long long cum_frag; // every fragment up to and including this one has been written
+    unsigned long long highest_frag; // highest fragment received, above cum_frag while there's a hole
+    char received[MAX_WINDOW]; // out of order fragments in (cum_frag, cum_frag + window], slot is frag_no % MAX_WINDOW
+    struct timespec recv_time[MAX_WINDOW]; // when each fragment arrived, for the ack delay
+
+    // delayed acks
+    unsigned int unacked; // in-order fragments since our last ack
+    int ack_pending;
+    struct timespec ack_due;
+
+    unsigned long long acks_sent;
+    unsigned long long hole_frags;
+    struct manifest *dedup; // chunks the sender asked about, NULL unless it did
+    off_t file_size;
+    unsigned long long stored_frags; // fragments filled in from the chunk store
+    struct merkle *merkle; // NULL without FEATURE_MERKLE, the last ack waits until it's verified
+    int hold_last; // the last ack also waits until the server clears this, once the file's where a get finds it
+
+    // fragments coming in parts, slot is frag_no % PART_SLOTS. each part is written as it comes,
+    // the fragment counts as received once they all have
+    struct part_state parts[PART_SLOTS];
+    unsigned long long part_frags; // fragments put back together from parts
+
+    // output that has to be written in order (a pipe): fragments wait here until everything
+    // before them is out, slot is frag_no % MAX_WINDOW. NULL for files, they're written in place
+    char *order_buf;
+    unsigned int order_len[MAX_WINDOW];
+    unsigned long long flushed; // fragments written out in full
+    unsigned int flush_off; // bytes of the one after that written so far
+
+    // the server's rate limiter: the sender may only go as far as credit, which receiverGrant
+    // moves up as its share of the bandwidth comes in. the window can shut all the way with this
+    int rate_limited;
+    unsigned long long credit;
+    int reopen_pending; // we advertised a shut window and haven't had data since
+
+    struct timespec last_heard; // receiverOnTimer gives up once the sender's been quiet for idle_ms
+    double idle_ms; // IDLE_TIMEOUT unless whoever owns this wants otherwise
+    int verbose;
+};
+
+// running totals for a client session, over every transfer tried on it
+struct session_stats {
+    unsigned long long files; // transfers tried
+    unsigned long long failed; // of those, how many didn't finish
+    unsigned long long bytes; // file bytes moved by the ones that did
+    double busy_ms; // time spent in transfers, handshakes included
+    unsigned long long retransmits; // timeout and fast retransmits on uploads
+};
+
+// the client end, one socket to one server (or multicast group) for as many transfers as you
+// like. sessionOpen fills in the defaults, change the options before the first transfer
+struct session {
+    int sockfd;
+    struct addrinfo *servinfo;
+    struct addrinfo *ai; // the one we got a socket for
+    int is_mcast; // the address is a group, uploads only
+
+    // options
+    enum cc_algo cc; // congestion control for uploads
+    int threaded; // downloads written by a separate disk thread
+    off_t read_ahead; // uploads read this far ahead by a separate disk thread, 0 for none
+    double rate_mb; // multicast uploads go out this fast
+    struct in_addr mcast_if; // and from this interface
+    int verbose;
+
+    // what the last transfer learned about the path, so the next one needn't start cold
+    int warm;
+    double estimatedRTT, devRTT;
+    double ssthresh;
+    unsigned long long cookie; // the server's latest, so a busy server doesn't make us retry
+    int no_pmtu; // option: don't look for the path MTU, fragments are FRAG_SIZE
+    int pmtu_searched; // whether plpmtu is from a search, a black hole (or PMTU_RAISE_MS) means search again
+    unsigned int plpmtu; // biggest packet that got to the server and back, 0 if it doesn't answer probes
+    struct timespec pmtu_time; // when we looked
+    struct path paths[MAX_PATHS]; // uploads go out over all of these when there's more than one, see sessionPaths
+    int num_paths; // paths[0].sockfd is sockfd
+    int recv_path; // which of them sessionRecv's last message came in on
+
+    struct session_stats stats;
+};
+
+size_t serializePkt(const struct packet *pkt, char *dest_buf, size_t buf_size);
+int deserializePkt(const char *src_buf, size_t buf_size, struct packet *pkt);
+size_t serializeAck(const struct ackpkt *ackpkt, char *dest_buf, size_t buf_size);
+int deserializeAck(const char *src_buf, size_t buf_size, struct ackpkt *ackpkt);
+size_t serializeHandshake(const char *tag, const struct handshake *hs, char *dest_buf, size_t buf_size);
+int deserializeHandshake(const char *src_buf, size_t buf_size, const char *tag, struct handshake *hs);
+int isDataPkt(const char *buf);
+
+int unreachable(int err);
+void sendMsg(int sockfd, const void *msg, size_t len, const struct sockaddr *addr, socklen_t addr_len);
+double get_time_diff(struct timespec start, struct timespec end);
+struct timespec add_time_ms(struct timespec t, double ms);
+unsigned long long totalFrags(long long file_size, unsigned int frag_size);
+int sourceRead(const struct file_source *src, char *buf, size_t len, off_t offset);
+int parseCC(const char *name);
+const char *ccName(enum cc_algo cc);
+
+void senderInit(struct sender *s, int sockfd, const struct sockaddr *addr, socklen_t addr_len, const struct handshake *hs, const struct file_source *src, enum cc_algo cc);
+void senderSetLimits(struct sender *s, const struct handshake *reply);
+void senderRTTSample(struct sender *s, double sampleRTT);
+void senderSetTimeout(struct sender *s, double timeout_ms);
+unsigned int sendFragment(struct sender *s, unsigned long long frag_no, unsigned int max_frags);
+void senderFill(struct sender *s, struct timespec now);
+double senderTimeLeft(const struct sender *s, struct timespec now);
+double senderWaitTime(const struct sender *s, struct timespec now);
+int senderOnTimeout(struct sender *s, struct timespec now);
+void senderOnAck(struct sender *s, const struct ackpkt *ack, struct timespec now);
+int senderDone(const struct sender *s);
+void senderReadAhead(struct sender *s, off_t bytes);
+void senderRestart(struct sender *s, struct timespec now);
+void senderClose(struct sender *s);
+void senderSend(struct sender *s, const void *msg, size_t len);
+
+void pathsInit(struct sender *s, struct path *paths, int num_paths);
+int pathPick(const struct sender *s, int avoid);
+int pathSend(struct sender *s, int p, const void *msg, size_t len);
+void pathSent(struct sender *s, unsigned long long frag_no, int p);
+void pathAcked(struct sender *s, struct frag_state *fs, double rtt);
+void pathForget(struct sender *s, struct frag_state *fs);
+void pathsCheck(struct sender *s, struct timespec now);
+
+void sendAck(struct receiver *r, unsigned int ack_nack, unsigned long long frag_no, struct timespec now);
+void receiverInit(struct receiver *r, int sockfd, const struct sockaddr *addr, socklen_t addr_len, const struct handshake *hs, int fd);
+void receiverOrdered(struct receiver *r);
+void receiverOnData(struct receiver *r, const struct packet *pkt, struct timespec now);
+double receiverTimeLeft(const struct receiver *r, struct timespec now);
+int receiverOnTimer(struct receiver *r, struct timespec now);
+unsigned long long receiverWants(const struct receiver *r);
+void receiverGrant(struct receiver *r, unsigned long long frags, struct timespec now);
+int receiverDone(const struct receiver *r);
+
+void writerStart(struct writer *w, int direct);
+unsigned int writerRoom(struct writer *w);
+void writerWrite(struct writer *w, int fd, const void *data, unsigned int len, off_t offset);
+void writerZeros(struct writer *w, int fd, unsigned int len, off_t offset);
+void writerClose(struct writer *w, int fd, const char *from, const char *to, atomic_int *done);
+void writerStore(struct writer *w, int fd, const char *from, const char *to, atomic_int *done);
+void writerHash(struct writer *w, int fd, struct merkle *m, unsigned long long block, off_t file_size);
+void writerFree(struct writer *w, struct merkle *m);
+void writerStop(struct writer *w);
+
+struct reader *readerStart(const struct file_source *src, unsigned int frag_size, unsigned long long total_frag, off_t bytes);
+const char *readerGet(struct reader *r, unsigned long long frag_no);
+void readerRelease(struct reader *r, unsigned long long frags);
+void readerStop(struct reader *r);
+
+void sha256Init(struct sha256 *c);
+void sha256Update(struct sha256 *c, const void *data, size_t len);
+void sha256Final(struct sha256 *c, unsigned char *digest);
+void sha256(const void *data, size_t len, unsigned char *digest);
+
+size_t chunkLength(const unsigned char *data, size_t len, int at_eof);
+struct manifest *manifestNew(off_t size, unsigned long long count);
+struct manifest *manifestBuild(int fd, off_t size, int store);
+void manifestFree(struct manifest *m);
+int manifestCovers(const struct manifest *m, off_t offset, off_t len);
+int storeRead(struct manifest *m, char *buf, size_t len, off_t offset);
+struct manifest *recipeLoad(int fd);
+void dedupStore(const char *part_filename, const char *filename);
+size_t serializeChunkQuery(const struct chunk_query *q, char *dest_buf, size_t buf_size);
+int deserializeChunkQuery(const char *src_buf, size_t buf_size, struct chunk_query *q);
+size_t serializeChunkAnswer(const struct chunk_answer *a, char *dest_buf, size_t buf_size);
+int deserializeChunkAnswer(const char *src_buf, size_t buf_size, struct chunk_answer *a);
+void receiverOnChunkQuery(struct receiver *r, const struct chunk_query *q);
+
+void merkleLeaf(const char *data, size_t len, unsigned char *digest);
+void merkleRoot(unsigned char (*leaf)[SHA256_LEN], unsigned long long n, unsigned char *digest);
+struct merkle *merkleBuild(const struct file_source *src, unsigned int frag_size);
+void merkleFree(struct merkle *m);
+void merkleSetLeaf(struct merkle *m, unsigned long long block, const char *data, size_t len);
+void merkleHashBlock(struct merkle *m, int fd, unsigned long long block, off_t file_size);
+void merkleReceiverInit(struct receiver *r, const struct handshake *hs);
+void receiverHashBlock(struct receiver *r, unsigned long long block);
+int receiverRepairWanted(const struct receiver *r, unsigned long long frag_no);
+int receiverRepairFrag(struct receiver *r, unsigned long long frag_no);
+void receiverRepairDone(struct receiver *r, unsigned long long frag_no);
+void receiverMerkleProgress(struct receiver *r, struct timespec now);
+double receiverMerkleTimeLeft(const struct receiver *r, struct timespec now);
+int receiverMerkleFailed(const struct receiver *r);
+void receiverOnTree(struct receiver *r, const char *buf, size_t len, struct timespec now);
+void senderOnVerify(struct sender *s, const char *buf, size_t len);
+void senderOnResend(struct sender *s, const char *buf, size_t len);
+int merkleMsg(const char *buf, unsigned int *transfer_id);
+
+size_t serializeAnnounce(const struct mcast_announce *a, char *dest_buf, size_t buf_size);
+int deserializeAnnounce(const char *src_buf, size_t buf_size, struct mcast_announce *a);
+void mcastSenderInit(struct mcast_sender *m, int sockfd, const struct sockaddr *group, socklen_t group_len,
+                     const struct file_source *src, const char *filename, double rate_mb);
+void mcastSenderStep(struct mcast_sender *m, struct timespec now);
+double mcastSenderTimeLeft(const struct mcast_sender *m, struct timespec now);
+void mcastSenderOnNack(struct mcast_sender *m, const char *buf, size_t len, struct timespec now);
+int mcastSenderDone(const struct mcast_sender *m, struct timespec now);
+void mcastSenderClose(struct mcast_sender *m);
+void mcastReceiverInit(struct mcast_receiver *r, int sockfd, const struct sockaddr *sender, socklen_t sender_len,
+                       const struct mcast_announce *a, int fd, struct timespec now);
+void mcastOnAnnounce(struct mcast_receiver *r, const struct mcast_announce *a, struct timespec now);
+void mcastOnData(struct mcast_receiver *r, const struct packet *pkt, struct timespec now);
+void mcastOnRepair(struct mcast_receiver *r, const char *buf, size_t len, struct timespec now);
+double mcastTimeLeft(const struct mcast_receiver *r, struct timespec now);
+int mcastOnTimer(struct mcast_receiver *r, struct timespec now);
+int mcastDone(const struct mcast_receiver *r);
+void mcastReceiverClose(struct mcast_receiver *r);
+
+struct uring *uringStart(int sockfd);
+void uringWait(struct uring *u, int timeout_ms);
+int uringRecv(struct uring *u, char *recv_buf, struct sockaddr_storage *addr, socklen_t *addr_len);
+void uringSendMsg(struct uring *u, int sockfd, const void *msg, size_t len, const struct sockaddr *addr, socklen_t addr_len);
+void uringWrite(struct uring *u, int fd, const void *data, unsigned int len, off_t offset);
+void uringClose(struct uring *u, int fd, const char *from, const char *to);
+unsigned int uringRoom(const struct uring *u);
+void uringStats(const struct uring *u, unsigned long long *datagrams, unsigned long long *sent, unsigned long long *enters);
+
+unsigned int pmtuOverhead(int family);
+unsigned int pmtuSearch(int sockfd, const struct sockaddr *addr, socklen_t addr_len, double timeout_ms);
+void pmtuAnswer(int sockfd, const char *buf, size_t len, const struct sockaddr *addr, socklen_t addr_len);
+
+int sessionOpen(struct session *s, const char *host, const char *port);
+int sessionPaths(struct session *s, const char *list);
+int sessionSend(struct session *s, const char *filename);
+int sessionSendFd(struct session *s, int fd, const char *name);
+int sessionGet(struct session *s, const char *filename);
+const struct session_stats *sessionStats(const struct session *s);
+void sessionClose(struct session *s);
+
+int traceStart(const char *filename);
+void traceEvent(enum trace_event event, unsigned int transfer_id, unsigned long long frag_no, unsigned int count, unsigned int flags, unsigned int a, unsigned int b);
+void traceStop(void);
+
+void bbrInit(struct sender *s, struct timespec now);
+void bbrOnAck(struct sender *s, const struct frag_state *fs, unsigned int newly_acked, double rtt, double ack_delay, struct timespec now);
+
+#endif
@@ -0,0 +1,466 @@
+#include "transfer.h"
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// io_uring engine for the server, talking to the kernel with the raw syscalls (no liburing here).
+// one multishot recvmsg keeps receiving into a ring of buffers we provide, and everything we
+// send or write is queued as a request and handed over in one io_uring_enter per loop, which
+// is also where we wait. so a batch of datagrams in and the acks and writes they cause cost
+// one syscall, not one each
+
+struct uring *io_ring = NULL;
+
+enum uring_op_kind {
+    OP_SEND, OP_WRITE, OP_CLOSE
+};
+
+// what an in-flight request points at, has to stay put until its completion comes back
+struct uring_op {
+    enum uring_op_kind kind;
+    int fd;
+    int next; // free list, or the deferred close list
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    off_t offset;
+    char buf[MAXBUFLEN]; // OP_CLOSE: "<from>\0<to>\0" if it renames after closing
+};
+
+#define RECV_USER_DATA 0 // user_data of the multishot recv, requests use index + 1
+#define RENAME_FLAG (1ULL << 32) // user_data of the rename linked to a close
+
+struct uring {
+    int fd;
+    int sockfd;
+
+    // submission queue
+    unsigned int *sq_head, *sq_tail, *sq_mask;
+    unsigned int sq_local_tail; // published to the kernel on every uringSqe
+    struct io_uring_sqe *sqes;
+
+    // completion queue
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // provided buffers for the multishot recv
+    struct io_uring_buf_ring *buf_ring;
+    char *recv_bufs;
+    size_t recv_buf_stride;
+    unsigned short buf_tail;
+    struct msghdr recv_msg; // only the name and control lengths matter to a multishot recvmsg
+    int recv_armed;
+
+    struct uring_op ops[URING_OPS];
+    int free_ops; // -1 when they're all in flight
+    unsigned int ops_free; // how many are on that list
+    int deferred_closes; // closes waiting on their file's writes
+    int *fd_pending; // writes in flight per fd
+    int fd_pending_len;
+
+    unsigned long long datagrams, sent, enters;
+};
+
+int uringEnter(struct uring *u, unsigned int to_submit, unsigned int min_complete, unsigned int flags, struct __kernel_timespec *ts) {
+    struct io_uring_getevents_arg arg = {0};
+    arg.ts = (unsigned long) ts;
+    u->enters += 1;
+    return syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+unsigned int uringUnsubmitted(struct uring *u) {
+    return u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uringSqe(struct uring *u) {
+    // next free submission entry, zeroed. submits what's queued if the queue is full
+    while (uringUnsubmitted(u) == URING_ENTRIES) {
+        if (uringEnter(u, URING_ENTRIES, 0, 0, NULL) == -1 && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & *u->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+void uringQueue(struct uring *u) {
+    // hand the entry uringSqe gave out to the kernel, it goes in on the next enter
+    u->sq_local_tail += 1;
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+void uringRecycle(struct uring *u, unsigned short bid) {
+    // give a recv buffer back to the kernel
+    struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (URING_RECV_BUFS - 1)];
+    buf->addr = (unsigned long) (u->recv_bufs + bid * u->recv_buf_stride);
+    buf->len = u->recv_buf_stride - 1; // room for the '\0' we put after the payload
+    buf->bid = bid;
+    u->buf_tail += 1;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+void armRecv(struct uring *u) {
+    struct io_uring_sqe *sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = u->sockfd;
+    sqe->addr = (unsigned long) &u->recv_msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = RECV_USER_DATA;
+    uringQueue(u);
+    u->recv_armed = 1;
+}
+
+struct uring *uringStart(int sockfd) {
+    // NULL if this kernel can't do what we need, the caller falls back to poll
+    struct uring *u = malloc(sizeof(struct uring));
+    if (u == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for io_uring engine\n");
+        exit(1);
+    }
+    memset(u, 0, sizeof *u);
+    u->sockfd = sockfd;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN; // room for bursts of datagrams, no interrupts to run completions
+    p.cq_entries = URING_RECV_BUFS + URING_OPS * 2;
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd == -1 && errno == EINVAL) { // older kernel, try without the extras
+        memset(&p, 0, sizeof p);
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_RECV_BUFS + URING_OPS * 2;
+        u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (u->fd == -1) {
+        perror("io_uring_setup");
+        free(u);
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG) || p.sq_entries != URING_ENTRIES) {
+        fprintf(stderr, "io_uring: kernel too old\n");
+        close(u->fd);
+        free(u);
+        return NULL;
+    }
+
+    // map the rings
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    u->sq_head = (unsigned int *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    unsigned int *sq_array = (unsigned int *) (sq + p.sq_off.array);
+    for (unsigned int i = 0; i < p.sq_entries; i++) {
+        sq_array[i] = i; // entry i always sits in slot i
+    }
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // provided buffers, each holds the recvmsg header, the sender's address, then the datagram
+    u->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+    u->recv_buf_stride = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + MAXBUFLEN;
+    u->recv_bufs = malloc(URING_RECV_BUFS * u->recv_buf_stride);
+    u->buf_ring = mmap(NULL, URING_RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->recv_bufs == NULL || u->buf_ring == MAP_FAILED) {
+        fprintf(stderr, "Error: Memory allocation failed for io_uring buffers\n");
+        exit(1);
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long) u->buf_ring;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring_register");
+        close(u->fd);
+        free(u->recv_bufs);
+        free(u);
+        return NULL;
+    }
+    for (int i = 0; i < URING_RECV_BUFS; i++) {
+        uringRecycle(u, i);
+    }
+
+    for (int i = 0; i < URING_OPS; i++) {
+        u->ops[i].next = i + 1 < URING_OPS ? i + 1 : -1;
+    }
+    u->free_ops = 0;
+    u->ops_free = URING_OPS;
+    u->deferred_closes = -1;
+    return u;
+}
+
+void uringWait(struct uring *u, int timeout_ms) {
+    // submits everything queued and waits until something completes, or timeout_ms (-1 for no timeout)
+    if (!u->recv_armed) {
+        armRecv(u);
+    }
+    unsigned int min_complete = 1;
+    if (__atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) != *u->cq_head) {
+        min_complete = 0; // already have completions to look at
+    }
+    struct __kernel_timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+    if (uringEnter(u, uringUnsubmitted(u), min_complete, IORING_ENTER_GETEVENTS, timeout_ms >= 0 ? &ts : NULL) == -1 &&
+            errno != ETIME && errno != EINTR && errno != EBUSY) {
+        perror("io_uring_enter");
+        exit(1);
+    }
+}
+
+struct uring_op *uringOp(struct uring *u, enum uring_op_kind kind, int fd) {
+    // NULL if every request is in flight, then the caller does it synchronously instead
+    if (u->free_ops == -1) {
+        return NULL;
+    }
+    struct uring_op *op = &u->ops[u->free_ops];
+    u->free_ops = op->next;
+    u->ops_free -= 1;
+    op->kind = kind;
+    op->fd = fd;
+    return op;
+}
+
+void freeOp(struct uring *u, struct uring_op *op) {
+    op->next = u->free_ops;
+    u->free_ops = op - u->ops;
+    u->ops_free += 1;
+}
+
+int *fdPending(struct uring *u, int fd) {
+    // count of writes in flight to fd
+    if (fd >= u->fd_pending_len) {
+        int len = MAX(fd + 1, u->fd_pending_len * 2);
+        u->fd_pending = realloc(u->fd_pending, len * sizeof(int));
+        if (u->fd_pending == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for io_uring write counts\n");
+            exit(1);
+        }
+        memset(u->fd_pending + u->fd_pending_len, 0, (len - u->fd_pending_len) * sizeof(int));
+        u->fd_pending_len = len;
+    }
+    return &u->fd_pending[fd];
+}
+
+void queueClose(struct uring *u, struct uring_op *op) {
+    // close, then the rename linked behind it so it only happens once the file is closed
+    struct io_uring_sqe *sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = op->fd;
+    sqe->user_data = op - u->ops + 1;
+    if (op->buf[0] != '\0') {
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    uringQueue(u);
+    if (op->buf[0] == '\0') {
+        return;
+    }
+
+    sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_RENAMEAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) op->buf;
+    sqe->len = AT_FDCWD;
+    sqe->addr2 = (unsigned long) (op->buf + strlen(op->buf) + 1);
+    sqe->user_data = (op - u->ops + 1) | RENAME_FLAG;
+    uringQueue(u);
+}
+
+void completeOp(struct uring *u, unsigned long long user_data, int res) {
+    struct uring_op *op = &u->ops[(user_data & ~RENAME_FLAG) - 1];
+    if (op->kind == OP_SEND) {
+        if (res < 0 && unreachable(-res)) {
+            fprintf(stderr, "sendmsg: %s, dropped\n", strerror(-res));
+        } else if (res < 0) {
+            fprintf(stderr, "sendmsg: %s\n", strerror(-res));
+            exit(1);
+        }
+        freeOp(u, op);
+    } else if (op->kind == OP_WRITE) {
+        if (res < 0) {
+            fprintf(stderr, "write: %s\n", strerror(-res));
+            exit(1);
+        }
+        if ((size_t) res < op->iov.iov_len && pwrite(op->fd, op->buf + res, op->iov.iov_len - res, op->offset + res) == -1) {
+            perror("pwrite"); // short write, finish it off here
+            exit(1);
+        }
+        int fd = op->fd;
+        freeOp(u, op);
+
+        // last write to a file that's waiting to be closed
+        int *pending = fdPending(u, fd);
+        *pending -= 1;
+        for (int *link = &u->deferred_closes; *pending == 0 && *link != -1; link = &u->ops[*link].next) {
+            struct uring_op *close_op = &u->ops[*link];
+            if (close_op->fd == fd) {
+                *link = close_op->next;
+                queueClose(u, close_op);
+                break;
+            }
+        }
+    } else { // OP_CLOSE, and the rename after it if there is one
+        int renames = op->buf[0] != '\0';
+        if (res < 0 && res != -ECANCELED) {
+            fprintf(stderr, "%s: %s\n", user_data & RENAME_FLAG ? "rename" : "close", strerror(-res));
+        }
+        if (!renames || user_data & RENAME_FLAG) {
+            freeOp(u, op);
+        }
+    }
+}
+
+int uringRecv(struct uring *u, char *recv_buf, struct sockaddr_storage *addr, socklen_t *addr_len) {
+    // next datagram that came in, -1 once there are no more. takes care of any other
+    // completions on the way
+    unsigned int head = *u->cq_head;
+    unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    int numbytes = -1;
+    while (head != tail && numbytes == -1) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        head++;
+        if (cqe->user_data != RECV_USER_DATA) {
+            completeOp(u, cqe->user_data, cqe->res);
+            continue;
+        }
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) { // multishot stopped (ran out of buffers, most likely), rearm it
+            u->recv_armed = 0;
+        }
+        if (cqe->res < 0) {
+            if (cqe->res != -ENOBUFS) {
+                fprintf(stderr, "recvmsg: %s\n", strerror(-cqe->res));
+            }
+            continue;
+        }
+
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buf = u->recv_bufs + bid * u->recv_buf_stride;
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+        char *name = buf + sizeof *out;
+        char *payload = name + u->recv_msg.msg_namelen + u->recv_msg.msg_controllen;
+        if (!(out->flags & MSG_TRUNC)) { // too big to be one of ours otherwise
+            *addr_len = MIN(out->namelen, u->recv_msg.msg_namelen);
+            memcpy(addr, name, *addr_len);
+            memcpy(recv_buf, payload, out->payloadlen);
+            recv_buf[out->payloadlen] = '\0';
+            numbytes = out->payloadlen;
+            u->datagrams += 1;
+        }
+        uringRecycle(u, bid);
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return numbytes;
+}
+
+void uringSendMsg(struct uring *u, int sockfd, const void *msg, size_t len, const struct sockaddr *addr, socklen_t addr_len) {
+    struct uring_op *op = uringOp(u, OP_SEND, sockfd);
+    if (op == NULL) {
+        if (sendto(sockfd, msg, len, 0, addr, addr_len) == -1 && !unreachable(errno)) {
+            perror("sendto");
+            exit(1);
+        }
+        return;
+    }
+    memcpy(op->buf, msg, len);
+    memcpy(&op->addr, addr, addr_len);
+    op->iov.iov_base = op->buf;
+    op->iov.iov_len = len;
+    memset(&op->msg, 0, sizeof op->msg);
+    op->msg.msg_name = &op->addr;
+    op->msg.msg_namelen = addr_len;
+    op->msg.msg_iov = &op->iov;
+    op->msg.msg_iovlen = 1;
+
+    struct io_uring_sqe *sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sockfd;
+    sqe->addr = (unsigned long) &op->msg;
+    sqe->user_data = op - u->ops + 1;
+    uringQueue(u);
+    u->sent += 1;
+}
+
+void uringWrite(struct uring *u, int fd, const void *data, unsigned int len, off_t offset) {
+    struct uring_op *op = uringOp(u, OP_WRITE, fd);
+    if (op == NULL) {
+        if (pwrite(fd, data, len, offset) == -1) {
+            perror("pwrite");
+            exit(1);
+        }
+        return;
+    }
+    memcpy(op->buf, data, len);
+    op->iov.iov_len = len;
+    op->offset = offset;
+    *fdPending(u, fd) += 1;
+
+    struct io_uring_sqe *sqe = uringSqe(u);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) op->buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = op - u->ops + 1;
+    uringQueue(u);
+}
+
+void uringClose(struct uring *u, int fd, const char *from, const char *to) {
+    // closes fd once the writes queued for it are done, then renames from to to if from isn't NULL.
+    // the caller mustn't touch fd after this
+    struct uring_op *op = uringOp(u, OP_CLOSE, fd);
+    if (op == NULL) {
+        // everything's in flight. writes hold their own reference to the file once they're
+        // submitted, so after that closing it is fine. the rename just might show the file
+        // before the last of them land
+        while (uringUnsubmitted(u) > 0) {
+            if (uringEnter(u, uringUnsubmitted(u), 0, 0, NULL) == -1 && errno != EINTR && errno != EBUSY) {
+                perror("io_uring_enter");
+                exit(1);
+            }
+        }
+        close(fd);
+        if (from != NULL && rename(from, to) == -1) {
+            perror("rename");
+        }
+        return;
+    }
+    op->buf[0] = '\0';
+    if (from != NULL) {
+        snprintf(op->buf, MAXBUFLEN, "%s%c%s", from, '\0', to);
+    }
+
+    if (*fdPending(u, fd) == 0) {
+        queueClose(u, op);
+    } else {
+        op->next = u->deferred_closes;
+        u->deferred_closes = op - u->ops;
+    }
+}
+
+unsigned int uringRoom(const struct uring *u) {
+    // requests we can still queue without falling back to blocking calls
+    return u->ops_free;
+}
+
+void uringStats(const struct uring *u, unsigned long long *datagrams, unsigned long long *sent, unsigned long long *enters) {
+    *datagrams = u->datagrams;
+    *sent = u->sent;
+    *enters = u->enters;
+}
@@ -0,0 +1,442 @@
+#define _GNU_SOURCE // for O_DIRECT
+#include "transfer.h"
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+// disk side of a receiver. the network thread only copies each fragment into the ring and
+// moves on to acking, the writer thread turns runs of adjacent fragments into one pwritev.
+// head and tail each have a single writer, so the ring itself needs no lock; the semaphore
+// is only for putting the writer thread to sleep when there's nothing to do.
+//
+// a direct writer (server's direct option) doesn't pwritev fragments as they come. for multi-GB
+// uploads that leaves the whole file in the page cache and writeback stalls for everyone else on
+// the box, so they're packed into DIRECT_BLOCK blocks from a pool allocated up front instead, and
+// each block goes out with one aligned write on a file opened O_DIRECT once all of it's there.
+// only a file's unaligned tail goes through the page cache. memory is the pool whatever the size
+
+void *writerLoop(void *arg);
+
+void writerStart(struct writer *w, int direct) {
+    memset(w, 0, sizeof *w);
+    w->direct = direct;
+    for (int i = 0; direct && i < DIRECT_POOL; i++) {
+        struct direct_block *b = &w->pool[i];
+        b->fd = -1;
+        b->have = malloc(DIRECT_BLOCK / 8);
+        if (posix_memalign((void **) &b->buf, DIRECT_ALIGN, DIRECT_BLOCK) != 0 || b->have == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for direct write pool\n");
+            exit(1);
+        }
+        memset(b->buf, 0, DIRECT_BLOCK); // fault it all in now rather than mid-transfer
+    }
+    if (direct && posix_memalign((void **) &w->bounce, DIRECT_ALIGN, DIRECT_BLOCK) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed for direct write pool\n");
+        exit(1);
+    }
+    w->ring = malloc(WRITE_RING_SIZE * sizeof(struct write_req));
+    if (w->ring == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for write ring\n");
+        exit(1);
+    }
+    atomic_init(&w->head, 0);
+    atomic_init(&w->tail, 0);
+    atomic_init(&w->sleeping, 0);
+    sem_init(&w->wake, 0, 0);
+    if (pthread_create(&w->thread, NULL, writerLoop, w) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+struct write_req *writerSlot(struct writer *w) {
+    // next free slot, waits for the writer thread if the ring is full (the disk really is that far behind)
+    unsigned long head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&w->tail, memory_order_acquire) == WRITE_RING_SIZE) {
+        struct timespec pause = {0, 100000}; // 0.1 ms
+        nanosleep(&pause, NULL);
+    }
+    return &w->ring[head % WRITE_RING_SIZE];
+}
+
+unsigned int writerRoom(struct writer *w) {
+    // free slots in the ring, shared by every transfer writing through it
+    return WRITE_RING_SIZE - (atomic_load_explicit(&w->head, memory_order_relaxed) - atomic_load_explicit(&w->tail, memory_order_acquire));
+}
+
+void writerPush(struct writer *w) {
+    // publish the slot writerSlot returned, and wake the writer thread if it went to sleep.
+    // both sides store then load with seq_cst, so either it sees the new head or we see it sleeping
+    atomic_fetch_add(&w->head, 1);
+    if (atomic_load(&w->sleeping)) {
+        sem_post(&w->wake);
+    }
+}
+
+void writerWrite(struct writer *w, int fd, const void *data, unsigned int len, off_t offset) {
+    struct write_req *req = writerSlot(w);
+    req->op = WRITE_DATA;
+    req->fd = fd;
+    req->offset = offset;
+    req->len = len;
+    memcpy(req->data, data, len);
+    writerPush(w);
+}
+
+void writerZeros(struct writer *w, int fd, unsigned int len, off_t offset) {
+    // a hole, only a direct writer needs telling
+    struct write_req *req = writerSlot(w);
+    req->op = WRITE_ZEROS;
+    req->fd = fd;
+    req->offset = offset;
+    req->len = len;
+    writerPush(w);
+}
+
+void writerFinish(struct writer *w, enum write_op op, int fd, const char *from, const char *to, atomic_int *done) {
+    // the caller mustn't touch fd after this, the writer thread closes it
+    struct write_req *req = writerSlot(w);
+    req->op = op;
+    req->fd = fd;
+    req->done = done;
+    req->len = 0;
+    if (from != NULL) {
+        req->len = snprintf(req->data, MAX_FRAG_SIZE, "%s%c%s", from, '\0', to) + 1;
+    }
+    writerPush(w);
+}
+
+void writerClose(struct writer *w, int fd, const char *from, const char *to, atomic_int *done) {
+    // done is set once it's renamed, for whoever's holding back the upload's last ack until then
+    writerFinish(w, WRITE_CLOSE, fd, from, to, done);
+}
+
+void writerStore(struct writer *w, int fd, const char *from, const char *to, atomic_int *done) {
+    // chunking a big file takes a while, better here than on the network thread. done is set
+    // once it's in the store, same as writerClose
+    writerFinish(w, WRITE_STORE, fd, from, to, done);
+}
+
+void writerHash(struct writer *w, int fd, struct merkle *m, unsigned long long block, off_t file_size) {
+    // behind the block's writes in the ring, so it hashes what's on disk
+    struct write_req *req = writerSlot(w);
+    req->op = WRITE_HASH;
+    req->fd = fd;
+    req->offset = block;
+    req->merkle = m;
+    req->file_size = file_size;
+    writerPush(w);
+}
+
+void writerFree(struct writer *w, struct merkle *m) {
+    // for a transfer given up on while blocks of it may still be waiting to be hashed
+    struct write_req *req = writerSlot(w);
+    req->op = WRITE_FREE;
+    req->merkle = m;
+    writerPush(w);
+}
+
+void writerStop(struct writer *w) {
+    // returns once everything pushed so far is on disk
+    struct write_req *req = writerSlot(w);
+    req->op = WRITE_STOP;
+    writerPush(w);
+    pthread_join(w->thread, NULL);
+    sem_destroy(&w->wake);
+    free(w->ring);
+    for (int i = 0; w->direct && i < DIRECT_POOL; i++) {
+        free(w->pool[i].buf);
+        free(w->pool[i].have);
+    }
+    free(w->bounce);
+}
+
+unsigned long writeBatch(struct writer *w, unsigned long tail, unsigned long head) {
+    // writes the run of adjacent fragments starting at tail in one go, returns how many slots it used
+    struct iovec iov[WRITE_BATCH];
+    struct write_req *first = &w->ring[tail % WRITE_RING_SIZE];
+    off_t end = first->offset;
+    int n = 0;
+    while (tail + n != head && n < WRITE_BATCH) {
+        struct write_req *req = &w->ring[(tail + n) % WRITE_RING_SIZE];
+        if (req->op != WRITE_DATA || req->fd != first->fd || req->offset != end) {
+            break;
+        }
+        iov[n].iov_base = req->data;
+        iov[n].iov_len = req->len;
+        end += req->len;
+        n++;
+    }
+
+    off_t offset = first->offset;
+    int done = 0; // iovecs fully written, pwritev can come up short
+    while (done < n) {
+        ssize_t written = pwritev(first->fd, iov + done, n - done, offset);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwritev");
+            exit(1);
+        }
+        offset += written;
+        while (done < n && (size_t) written >= iov[done].iov_len) {
+            written -= iov[done].iov_len;
+            done++;
+        }
+        if (done < n) {
+            iov[done].iov_base = (char *) iov[done].iov_base + written;
+            iov[done].iov_len -= written;
+        }
+        w->pwritevs += 1;
+    }
+    w->frags_written += n;
+    return n;
+}
+
+unsigned int markRange(unsigned char *bits, unsigned int from, unsigned int len) {
+    // sets bits [from, from + len), returns how many weren't set already
+    unsigned int added = 0;
+    unsigned int i = from, end = from + len;
+    for (; i < end && i % 8 != 0; i++) {
+        added += !(bits[i / 8] & (1 << (i % 8)));
+        bits[i / 8] |= 1 << (i % 8);
+    }
+    for (; i + 8 <= end; i += 8) {
+        added += 8 - __builtin_popcount(bits[i / 8]);
+        bits[i / 8] = 0xff;
+    }
+    for (; i < end; i++) {
+        added += !(bits[i / 8] & (1 << (i % 8)));
+        bits[i / 8] |= 1 << (i % 8);
+    }
+    return added;
+}
+
+void directIO(int write, int fd, char *buf, size_t len, off_t offset) {
+    // the whole of it, or dies trying. reads stop early at the end of the file
+    while (len > 0) {
+        ssize_t done = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done == -1) {
+            perror(write ? "direct pwrite" : "direct pread");
+            exit(1);
+        }
+        if (done == 0 && !write) {
+            return;
+        }
+        buf += done;
+        len -= done;
+        offset += done;
+    }
+}
+
+void copyMasked(char *dst, const char *src, const unsigned char *bits, unsigned int from, unsigned int to, int set) {
+    // dst[i] = src[i] for i in [from, to) where bit i is set (or clear, if not set)
+    unsigned char skip = set ? 0 : 0xff; // bytes of bits like this have nothing to copy
+    for (unsigned int i = from; i < to; i++) {
+        if (i % 8 == 0 && i + 8 <= to && bits[i / 8] == skip) {
+            i += 7;
+        } else if (!(bits[i / 8] & (1 << (i % 8))) == !set) {
+            dst[i] = src[i];
+        }
+    }
+}
+
+void directFill(struct writer *w, struct direct_block *b, size_t len) {
+    // whatever of b's first len bytes we weren't given comes from what's on disk
+    size_t read_len = (len + DIRECT_ALIGN - 1) & ~((size_t) DIRECT_ALIGN - 1);
+    memset(w->bounce, 0, read_len); // past the end of the file
+    directIO(0, b->fd, w->bounce, read_len, b->offset);
+    copyMasked(b->buf, w->bounce, b->have, 0, len, 0);
+}
+
+void directFlush(struct writer *w, struct direct_block *b) {
+    // writes b out and frees it. a full block goes straight out, anything less got cut short
+    // (a file's last block, a merkle repair, the pool ran out) so it's filled in from disk first
+    if (b->has_data) {
+        size_t len = DIRECT_BLOCK;
+        if (b->filled < DIRECT_BLOCK) {
+            struct stat st;
+            if (fstat(b->fd, &st) == -1) {
+                perror("fstat");
+                exit(1);
+            }
+            len = MIN(DIRECT_BLOCK, MAX(st.st_size - b->offset, (off_t) b->end)); // a stream only grows as we write it
+            directFill(w, b, len);
+            w->partial_writes += 1;
+        }
+        size_t aligned = len & ~((size_t) DIRECT_ALIGN - 1);
+        directIO(1, b->fd, b->buf, aligned, b->offset);
+        if (aligned < len) { // the file's tail, O_DIRECT can't write that so it goes through the page cache
+            int flags = fcntl(b->fd, F_GETFL);
+            fcntl(b->fd, F_SETFL, flags & ~O_DIRECT);
+            directIO(1, b->fd, b->buf + aligned, len - aligned, b->offset + aligned);
+            fcntl(b->fd, F_SETFL, flags);
+        }
+        w->direct_writes += 1;
+    }
+    b->fd = -1;
+}
+
+void directFlushFd(struct writer *w, int fd) {
+    // everything of fd's still in the pool, before it's closed. -1 for every fd
+    for (int i = 0; i < DIRECT_POOL; i++) {
+        if (w->pool[i].fd != -1 && (fd == -1 || w->pool[i].fd == fd)) {
+            directFlush(w, &w->pool[i]);
+        }
+    }
+}
+
+struct direct_block *directBlock(struct writer *w, int fd, off_t offset) {
+    // the pool's block for this part of fd, taking a free one (or the least recently used) if it has none
+    struct direct_block *free_block = NULL, *oldest = NULL;
+    for (int i = 0; i < DIRECT_POOL; i++) {
+        struct direct_block *b = &w->pool[i];
+        if (b->fd == fd && b->offset == offset) {
+            return b;
+        } else if (b->fd == -1 && free_block == NULL) {
+            free_block = b;
+        } else if (b->fd != -1 && (oldest == NULL || b->last_use < oldest->last_use)) {
+            oldest = b;
+        }
+    }
+    if (free_block == NULL) { // more transfers than the pool's sized for, one goes out as it is
+        directFlush(w, oldest);
+        free_block = oldest;
+    }
+    free_block->fd = fd;
+    free_block->offset = offset;
+    free_block->filled = 0;
+    free_block->end = 0;
+    free_block->has_data = 0;
+    memset(free_block->have, 0, DIRECT_BLOCK / 8);
+    return free_block;
+}
+
+void directPut(struct writer *w, int fd, const char *data, unsigned int len, off_t offset) {
+    // data (zeros if NULL) into the pool, and any block that fills up out to disk
+    while (len > 0) {
+        off_t start = offset & ~((off_t) DIRECT_BLOCK - 1);
+        unsigned int at = offset - start;
+        unsigned int n = MIN(len, DIRECT_BLOCK - at);
+        struct direct_block *b = directBlock(w, fd, start);
+        if (data) {
+            memcpy(b->buf + at, data, n);
+            b->has_data = 1;
+            data += n;
+        } else {
+            memset(b->buf + at, 0, n);
+        }
+        b->filled += markRange(b->have, at, n);
+        b->end = MAX(b->end, at + n);
+        b->last_use = ++w->use_clock;
+        if (b->filled == DIRECT_BLOCK) {
+            directFlush(w, b);
+        }
+        offset += n;
+        len -= n;
+    }
+}
+
+const char *directRead(struct writer *w, int fd, size_t len, off_t offset) {
+    // len bytes of fd as written so far, from the disk with what's still in the pool on top.
+    // points into the bounce buffer, good until the next direct call
+    off_t start = offset & ~((off_t) DIRECT_ALIGN - 1);
+    size_t read_len = (offset + len - start + DIRECT_ALIGN - 1) & ~((size_t) DIRECT_ALIGN - 1);
+    if (read_len > DIRECT_BLOCK) {
+        fprintf(stderr, "Error: direct read of %zu bytes is bigger than a block\n", len);
+        exit(1);
+    }
+    memset(w->bounce, 0, read_len);
+    directIO(0, fd, w->bounce, read_len, start);
+    for (int i = 0; i < DIRECT_POOL; i++) {
+        struct direct_block *b = &w->pool[i];
+        if (b->fd != fd || b->offset >= start + (off_t) read_len || b->offset + DIRECT_BLOCK <= start) {
+            continue;
+        }
+        off_t from = MAX(b->offset, start), to = MIN(b->offset + DIRECT_BLOCK, start + (off_t) read_len);
+        // both buffers indexed from the block's start
+        copyMasked(w->bounce + (b->offset - start), b->buf, b->have, from - b->offset, to - b->offset, 1);
+    }
+    return w->bounce + (offset - start);
+}
+
+void directHash(struct writer *w, int fd, struct merkle *m, unsigned long long block, off_t file_size) {
+    // merkleHashBlock, but the block may not all be on disk yet and fd can't take unaligned reads
+    off_t block_size = (off_t) MERKLE_BLOCK_FRAGS * m->frag_size;
+    off_t offset = block * block_size;
+    size_t len = MIN(block_size, file_size - offset);
+    merkleSetLeaf(m, block, directRead(w, fd, len, offset), len);
+}
+
+void *writerLoop(void *arg) {
+    struct writer *w = arg;
+    unsigned long tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    while (1) {
+        unsigned long head = atomic_load_explicit(&w->head, memory_order_acquire);
+        if (tail == head) {
+            atomic_store(&w->sleeping, 1);
+            if (atomic_load(&w->head) == tail) {
+                sem_wait(&w->wake);
+            }
+            atomic_store(&w->sleeping, 0);
+            continue;
+        }
+
+        struct write_req *req = &w->ring[tail % WRITE_RING_SIZE];
+        unsigned long used = 1;
+        if (req->op == WRITE_DATA && w->direct) {
+            directPut(w, req->fd, req->data, req->len, req->offset);
+            w->frags_written += 1;
+        } else if (req->op == WRITE_DATA) {
+            used = writeBatch(w, tail, head);
+        } else if (req->op == WRITE_ZEROS) {
+            if (w->direct) {
+                directPut(w, req->fd, NULL, req->len, req->offset);
+            }
+        } else if (req->op == WRITE_HASH && w->direct) {
+            directHash(w, req->fd, req->merkle, req->offset, req->file_size);
+        } else if (req->op == WRITE_HASH) {
+            merkleHashBlock(req->merkle, req->fd, req->offset, req->file_size);
+        } else if (req->op == WRITE_FREE) {
+            merkleFree(req->merkle);
+        } else if (req->op == WRITE_STORE) {
+            if (w->direct) {
+                directFlushFd(w, req->fd);
+            }
+            close(req->fd);
+            dedupStore(req->data, req->data + strlen(req->data) + 1);
+            if (req->done != NULL) {
+                atomic_store_explicit(req->done, 1, memory_order_release);
+            }
+        } else if (req->op == WRITE_CLOSE) {
+            if (w->direct) {
+                directFlushFd(w, req->fd);
+            }
+            close(req->fd);
+            if (req->len > 0) {
+                const char *from = req->data;
+                const char *to = req->data + strlen(from) + 1;
+                if (rename(from, to) == -1) {
+                    perror("rename");
+                }
+            }
+            if (req->done != NULL) {
+                atomic_store_explicit(req->done, 1, memory_order_release);
+            }
+        } else { // WRITE_STOP
+            if (w->direct) {
+                directFlushFd(w, -1);
+            }
+            atomic_store_explicit(&w->tail, tail + 1, memory_order_release);
+            return NULL;
+        }
+        tail += used;
+        atomic_store_explicit(&w->tail, tail, memory_order_release); // slots can be reused now
+    }
+}
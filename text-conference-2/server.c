@@ -1,9 +1,17 @@
+#define _GNU_SOURCE // accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include "message.h"
 
 struct user_cred {
@@ -134,18 +142,159 @@ void initialize_user_list() {
     read_credentials_from_file();
 }
 
+#define MAX_EVENTS 256          // most ready fds handled per epoll_wait
+#define PRINT_CLIENTS_MAX 32    // past this many connections print_client_list only prints the count
+#define HEADER_SIZE (4 + 4 + 2) // "type:size:"
+#define MAX_WORKERS 64
+#define SESSION_BUCKETS 1024    // chains in the session table
+
+struct worker;
+struct session;
+
 struct client_info {
     int client_socket;
     char client_id[MAX_NAME];
     struct sockaddr_in client_address;  // IP and port
     char session_id[MAX_NAME];          // note that we use MAX_NAME for session_id too
+    struct session *session;            // the one named session_id, NULL if that's empty
     struct client_info *next;           // linked list
+    struct client_info *prev;
     char backlog[MAX_DATA];
+    size_t backlog_len;
+    struct worker *worker;              // the thread this connection belongs to
+
+    // sockets are non-blocking, so a message can come in over several reads and a reply
+    // can go out over several writes
+    char inbuf[MAX_BUF_SIZE + 1];       // what's been read of the next message(s), +1 for a null
+    size_t inlen;
+    char *outbuf;                       // replies the socket wouldn't take yet, sent on EPOLLOUT
+    size_t outstart, outlen, outcap;
+    int closing;                        // close once outbuf is flushed
+};
+
+// a chat message headed for another worker's clients, either everyone in a session or one user
+enum relay_type { RELAY_SESSION, RELAY_USER };
+
+struct relay {
+    struct relay *_Atomic next;
+    enum relay_type type;
+    char target[MAX_NAME];              // session or client id
+    char data[];
+};
+
+// many producers, one consumer, no locks (Vyukov's intrusive queue). producers swap themselves
+// in at head and then link the one before to them, the owning worker pops from tail. stub keeps
+// it from ever being empty so neither end has to special case that
+struct relay_queue {
+    struct relay *_Atomic head;
+    struct relay *tail;
+    struct relay stub;
+    atomic_int pending;                 // set once wake_fd's been written, till the owner drains
 };
 
-struct client_info *client_list = NULL;
+// each worker thread runs its own epoll loop over its own listener (SO_REUSEPORT spreads new
+// connections over them) and the clients accepted there. it's the only thread that touches
+// their sockets and backlogs. other workers only read ids and sessions, under lock, for logins,
+// PMs and queries (joins look at the session table), and hand it chat messages through queue
+struct worker {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int listener_fd;
+    int wake_fd;                        // eventfd, written after pushing onto queue
+    struct relay_queue queue;
+    pthread_mutex_t lock;               // held to change the list or ids and sessions in it, and by other workers reading them
+    struct client_info *client_list;
+    struct client_info *client_tail;
+    int client_count;
+};
+
+struct worker workers[MAX_WORKERS];
+int num_workers = 1;
+
+// logins and signups check every worker for the name and then take it, and signups add to
+// user_list, so one at a time
+pthread_mutex_t login_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// every session with anyone in it, and how many of each worker's clients that is. a chat message
+// only goes to workers with a count above 0, read without a lock, instead of looking through
+// their clients. counts only change under session_lock, each worker changes its own
+struct session {
+    char session_id[MAX_NAME];
+    atomic_int members[MAX_WORKERS];    // clients of workers[i] in it
+    int total;                          // freed once this is 0, nobody's pointing at it then
+    struct session *next;               // same bucket
+};
+
+struct session *session_table[SESSION_BUCKETS];
+pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void relay_queue_init(struct relay_queue *q) {
+    atomic_store(&q->stub.next, NULL);
+    atomic_store(&q->head, &q->stub);
+    q->tail = &q->stub;
+    atomic_store(&q->pending, 0);
+}
+
+void relay_push(struct relay_queue *q, struct relay *r) {
+    atomic_store(&r->next, NULL);
+    struct relay *prev = atomic_exchange(&q->head, r);
+    atomic_store(&prev->next, r);
+}
+
+struct relay *relay_pop(struct relay_queue *q) {
+    // owner only. NULL when empty, or when a producer's between its two steps, in which case
+    // its wakeup is still coming
+    struct relay *tail = q->tail;
+    struct relay *next = atomic_load(&tail->next);
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = atomic_load(&tail->next);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load(&q->head)) {
+        return NULL;
+    }
+    relay_push(q, &q->stub); // tail's the last one, put stub behind it so it can come off
+    next = atomic_load(&tail->next);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+void relay_to(struct worker *w, enum relay_type type, const char *target, const char *msgdata) {
+    size_t length = strlen(msgdata) + 1;
+    struct relay *r = malloc(sizeof(struct relay) + length);
+    if (r == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for relay\n");
+        exit(1);
+    }
+    r->type = type;
+    strncpy(r->target, target, MAX_NAME - 1);
+    r->target[MAX_NAME - 1] = '\0';
+    memcpy(r->data, msgdata, length);
+
+    relay_push(&w->queue, r);
+    // only the first push since the owner last drained needs to wake it
+    if (!atomic_exchange(&w->queue.pending, 1)) {
+        uint64_t one = 1;
+        if (write(w->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            perror("write eventfd");
+            exit(1);
+        }
+    }
+}
 
-void add_client(int client_socket, const char *client_id, struct sockaddr_in *client_address, const char *session_id) {
+struct client_info *add_client(struct worker *w, int client_socket, const char *client_id, struct sockaddr_in *client_address, const char *session_id) {
     // dynamically allocate new client
     struct client_info *new_client = malloc(sizeof(struct client_info));
     if (new_client == NULL) {
@@ -157,59 +306,73 @@ void add_client(int client_socket, const char *client_id, struct sockaddr_in *cl
     strcpy(new_client->client_id, client_id);
     memcpy(&new_client->client_address, client_address, sizeof(struct sockaddr_in));
     strcpy(new_client->session_id, session_id);
+    new_client->session = NULL;
     new_client->next = NULL;
     new_client->backlog[0] = '\0';
-
-    // add to linked list
-    if (client_list == NULL) { // first client in the list
-        client_list = new_client;  
+    new_client->backlog_len = 0;
+    new_client->worker = w;
+    new_client->inlen = 0;
+    new_client->outbuf = NULL;
+    new_client->outstart = new_client->outlen = new_client->outcap = 0;
+    new_client->closing = 0;
+
+    // add to end of linked list, kept in order of connecting
+    pthread_mutex_lock(&w->lock);
+    new_client->prev = w->client_tail;
+    if (w->client_list == NULL) { // first client in the list
+        w->client_list = new_client;  
     } else {
-        struct client_info *current = client_list;
-        while (current->next != NULL) {
-            current = current->next;  
-        }
-        current->next = new_client;  
+        w->client_tail->next = new_client;
     }
+    w->client_tail = new_client;
+    w->client_count++;
+    pthread_mutex_unlock(&w->lock);
+    return new_client;
 }
 
-int remove_client(int client_socket) {
-    // returns 1 if client was removed, 0 otherwise
-    struct client_info *current = client_list;
-    struct client_info *previous = NULL;
+void session_leave(struct client_info *client);
 
-    while (current != NULL) {
-        if (current->client_socket == client_socket) {
-            if (previous == NULL) { // removing the head
-                client_list = current->next;  
-            } else {
-                previous->next = current->next;  
-            }
-            free(current);  
-            return 1;
-        }
-        previous = current;
-        current = current->next;
+void remove_client(struct client_info *client) {
+    struct worker *w = client->worker;
+    pthread_mutex_lock(&session_lock);
+    session_leave(client);
+    pthread_mutex_unlock(&session_lock);
+    pthread_mutex_lock(&w->lock);
+    if (client->prev == NULL) { // removing the head
+        w->client_list = client->next;
+    } else {
+        client->prev->next = client->next;
     }
-
-    // if we reach end
-    // fprintf(stderr, "Error: client to remove not found\n");
-    // exit(1);
-    return 0;
+    if (client->next == NULL) { // removing the tail
+        w->client_tail = client->prev;
+    } else {
+        client->next->prev = client->prev;
+    }
+    w->client_count--;
+    pthread_mutex_unlock(&w->lock);
+    free(client->outbuf);
+    free(client);
 }
 
-void print_client_list() {
-    struct client_info *current = client_list;  
-    
+void print_client_list(struct worker *w) {
+    // just this worker's clients, the owner doesn't need the lock to read its own list
+    struct client_info *current = w->client_list;  
+
+    flockfile(stdout); // keep other workers' lines out of the middle of it
+    if (num_workers > 1) {
+        printf("Worker %d: ", w->id);
+    }
     if (current == NULL) {
         printf("No clients connected.\n");
-        return;
+    } else if (w->client_count > PRINT_CLIENTS_MAX) { // the whole list is just noise by now
+        printf("%d clients connected.\n", w->client_count);
+    } else {
+        printf("\n--------------------------\n");
+        printf("CURRENT CLIENTS:\n");
+        printf("--------------------------\n");
     }
 
-    printf("--------------------------\n");
-    printf("CURRENT CLIENTS:\n");
-    printf("--------------------------\n");
-
-    while (current != NULL) {
+    while (current != NULL && w->client_count <= PRINT_CLIENTS_MAX) {
         char ip_address[INET_ADDRSTRLEN];  
         
         inet_ntop(AF_INET, &current->client_address.sin_addr, ip_address, INET_ADDRSTRLEN);
@@ -223,46 +386,90 @@ void print_client_list() {
         
         current = current->next;  
     }
+    funlockfile(stdout);
 }
 
-int session_exists(const char *session_id) { 
-    struct client_info *current = client_list;
-    while (current != NULL) {
-        if (strcmp(current->session_id, session_id) == 0) { // session not empty
-            return 1;  
-        }
-        current = current->next;
+struct session **session_bucket(const char *session_id) {
+    unsigned int hash = 5381; // djb2
+    for (const char *c = session_id; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char) *c;
     }
-    return 0;  // session empty
+    return &session_table[hash % SESSION_BUCKETS];
 }
 
-int client_exists(const char *client_id) {
-    struct client_info *current = client_list;
+struct session *find_session(const char *session_id) {
+    // NULL if nobody's in it. hold session_lock
+    struct session *current = *session_bucket(session_id);
+    while (current != NULL && strcmp(current->session_id, session_id) != 0) {
+        current = current->next;
+    }
+    return current;
+}
 
-    while (current != NULL) {
-        if (strcmp(current->client_id, client_id) == 0) {
-            return 1; 
+void session_enter(struct client_info *client, const char *session_id) {
+    // counts client in, making the session if it's the first. hold session_lock
+    struct session *session = find_session(session_id);
+    if (session == NULL) {
+        session = calloc(1, sizeof(struct session));
+        if (session == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for session\n");
+            exit(1);
         }
-        current = current->next;
+        strcpy(session->session_id, session_id);
+        struct session **bucket = session_bucket(session_id);
+        session->next = *bucket;
+        *bucket = session;
     }
-    
-    return 0; // No match found
+    atomic_fetch_add(&session->members[client->worker->id], 1);
+    session->total++;
+    client->session = session;
 }
 
-void set_client_id(int client_socket, const char *client_id) {
-    struct client_info *current = client_list;
-    
-    while (current != NULL) {
-        if (current->client_socket == client_socket) {
-            strncpy(current->client_id, client_id, sizeof(current->client_id) - 1);
-            current->client_id[sizeof(current->client_id) - 1] = '\0'; // Ensure null termination
-            return;
+void session_leave(struct client_info *client) {
+    // counts client out of the session it's in, if any, and frees it if it was the last. hold session_lock
+    struct session *session = client->session;
+    if (session == NULL) {
+        return;
+    }
+    client->session = NULL;
+    atomic_fetch_sub(&session->members[client->worker->id], 1);
+    if (--session->total > 0) {
+        return;
+    }
+    struct session **link = session_bucket(session->session_id);
+    while (*link != session) {
+        link = &(*link)->next;
+    }
+    *link = session->next;
+    free(session);
+}
+
+struct worker *find_client_worker(const char *client_id) {
+    // the worker client_id is logged in on, NULL if it isn't. hold login_lock for an answer that
+    // stays true until you let go, nobody can log in meanwhile
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_lock(&workers[i].lock);
+        struct client_info *current = workers[i].client_list;
+        while (current != NULL && strcmp(current->client_id, client_id) != 0) {
+            current = current->next;
+        }
+        pthread_mutex_unlock(&workers[i].lock);
+        if (current != NULL) {
+            return &workers[i];
         }
-        current = current->next;
     }
+    return NULL; // No match found
+}
+
+int client_exists(const char *client_id) {
+    return find_client_worker(client_id) != NULL;
+}
 
-    fprintf(stderr, "Error: Client with socket %d not found, in set_client_id.\n", client_socket);
-    exit(1);
+void set_client_id(struct client_info *client, const char *client_id) {
+    pthread_mutex_lock(&client->worker->lock);
+    strncpy(client->client_id, client_id, sizeof(client->client_id) - 1);
+    client->client_id[sizeof(client->client_id) - 1] = '\0'; // Ensure null termination
+    pthread_mutex_unlock(&client->worker->lock);
 }
 
 int authenticate_user(const char *client_id, const char *password) {
@@ -278,42 +485,108 @@ int authenticate_user(const char *client_id, const char *password) {
     return 0; // Authentication failed
 }
 
-void remove_conn(int i, fd_set *master_ptr) {
-    close(i);
-    FD_CLR(i, master_ptr);
+void flush_output(struct client_info *client) {
+    // sends as much of outbuf as the socket takes, the rest waits for EPOLLOUT
+    while (client->outstart < client->outlen) {
+        ssize_t bytes = send(client->client_socket, client->outbuf + client->outstart, client->outlen - client->outstart, MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytes <= 0) { // client's gone, nobody left to send to
+            client->closing = 1;
+            break;
+        }
+        client->outstart += bytes;
+    }
+    client->outstart = client->outlen = 0;
+}
 
-    int removed = remove_client(i); // rmb client list doesn't only store authenticated clients, stores all active connections
-    if (removed) {
-        printf("Client removed from list.\n");
+void queue_reply(struct client_info *client, unsigned int type, const char *client_id, const char *data) {
+    // builds the same message the send_* functions in message.c do, but queues it instead of
+    // blocking on a client that isn't reading
+    struct message msg;
+    memset(&msg, 0, sizeof(msg));
+
+    msg.type = type;
+
+    strncpy((char *)msg.source, client_id, MAX_NAME - 1);
+    msg.source[MAX_NAME - 1] = '\0';
+
+    strncpy((char *)msg.data, data, MAX_DATA - 1);
+    msg.data[MAX_DATA - 1] = '\0';
+
+    msg.size = strlen((char *)msg.source) + strlen((char *)msg.data);
+
+    char buffer[MAX_BUF_SIZE];
+    serialize_message(&msg, buffer);
+    size_t length = strlen(buffer) + 1; // include the terminating null char
+
+    if (client->outstart > 0) { // move what's left to the front first
+        memmove(client->outbuf, client->outbuf + client->outstart, client->outlen - client->outstart);
+        client->outlen -= client->outstart;
+        client->outstart = 0;
+    }
+    if (client->outlen + length > client->outcap) {
+        size_t cap = client->outcap ? client->outcap : MAX_BUF_SIZE;
+        while (cap < client->outlen + length) {
+            cap *= 2;
+        }
+        client->outbuf = realloc(client->outbuf, cap);
+        if (client->outbuf == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for client output\n");
+            exit(1);
+        }
+        client->outcap = cap;
     }
-    print_client_list();
+    memcpy(client->outbuf + client->outlen, buffer, length);
+    client->outlen += length;
+
+    flush_output(client);
+}
+
+void remove_conn(struct client_info *client) {
+    struct worker *w = client->worker;
+    close(client->client_socket); // also takes it out of the epoll set
+
+    remove_client(client); // rmb client list doesn't only store authenticated clients, stores all active connections
+    printf("Client removed from list.\n");
+    print_client_list(w);
 }
 
-void handle_login(int i, const struct message *msg, fd_set *master_ptr) {
+void handle_login(struct client_info *client, const struct message *msg) {
+    pthread_mutex_lock(&login_lock);
     // check if client_id already exists 
     if (client_exists((char *) msg->source)) {
-        send_lonak(i, (char *) msg->source, "This client id is already logged in.");
-        remove_conn(i, master_ptr); 
+        pthread_mutex_unlock(&login_lock);
+        queue_reply(client, LO_NAK, (char *) msg->source, "This client id is already logged in.");
+        client->closing = 1;
         return;
     }
     
     if (authenticate_user((char *)msg->source, (char *)msg->data)) {
-        send_loack(i, (char *) msg->source);
         // set it's client id 
-        set_client_id(i, (char *) msg->source);
-        print_client_list();
+        set_client_id(client, (char *) msg->source);
+        pthread_mutex_unlock(&login_lock);
+        queue_reply(client, LO_ACK, (char *) msg->source, "");
+        print_client_list(client->worker);
     } else {
-        send_lonak(i, (char *) msg->source, "Either user does not exist or password incorrect.");
-        remove_conn(i, master_ptr);
+        pthread_mutex_unlock(&login_lock);
+        queue_reply(client, LO_NAK, (char *) msg->source, "Either user does not exist or password incorrect.");
+        client->closing = 1;
     }
 }
 
-void handle_signup(int i, const struct message *msg, fd_set *master_ptr) {
+void handle_signup(struct client_info *client, const struct message *msg) {
+    pthread_mutex_lock(&login_lock);
     // check if this user already exists
     // if so, send THIS USER ALREADY EXISTS, TRY LOGGING IN INSTEAD
     if (username_exists((char *) msg->source)) {
-        send_sunak(i, (char *) msg->source, "This client id already registered, try logging in instead.");
-        remove_conn(i, master_ptr); 
+        pthread_mutex_unlock(&login_lock);
+        queue_reply(client, SU_NAK, (char *) msg->source, "This client id already registered, try logging in instead.");
+        client->closing = 1;
         return;
     }
     
@@ -322,117 +595,343 @@ void handle_signup(int i, const struct message *msg, fd_set *master_ptr) {
     
     // Write updated credentials to file
     write_credentials_to_file();
+    set_client_id(client, (char *)msg->source);
+    pthread_mutex_unlock(&login_lock);
     
     // Send success response
-    send_suack(i, (char *)msg->source);
-    set_client_id(i, (char *)msg->source);
-    print_client_list();
+    queue_reply(client, SU_ACK, (char *)msg->source, "");
+    print_client_list(client->worker);
 }
 
-void set_client_session(int client_socket, const char *session_id) {
-    struct client_info *current = client_list;
-
-    while (current != NULL) {
-        if (current->client_socket == client_socket) {
-            strncpy(current->session_id, session_id, sizeof(current->session_id) - 1);
-            current->session_id[sizeof(current->session_id) - 1] = '\0'; 
-            return;
-        }
-        current = current->next;
+int set_client_session(struct client_info *client, const char *session_id, int must_exist) {
+    // "" for none. with must_exist it's only joined if someone's in it already, 0 if nobody was.
+    // that's checked under the same hold of session_lock as the join, so the last one in it
+    // can't leave in between
+    char name[MAX_NAME];
+    strncpy(name, session_id, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0'; 
+
+    pthread_mutex_lock(&session_lock);
+    if (must_exist && find_session(name) == NULL) { // only sessions with someone in them are kept
+        pthread_mutex_unlock(&session_lock);
+        return 0;
+    }
+    session_leave(client);
+    if (name[0] != '\0') {
+        session_enter(client, name);
     }
+    pthread_mutex_unlock(&session_lock);
+
+    pthread_mutex_lock(&client->worker->lock);
+    strcpy(client->session_id, name);
+    pthread_mutex_unlock(&client->worker->lock);
+    return 1;
+}
 
-    fprintf(stderr, "Error: Client with socket %d not found, in set_client_session.\n", client_socket);
-    exit(1);
+void add_to_backlog(struct client_info *client, const char *msgdata) {
+    size_t length = strlen(msgdata);
+    if (client->backlog_len + length + 1 >= sizeof(client->backlog)) { // they haven't asked for it in a while
+        printf("Backlog full for client with fd %d, message dropped.\n", client->client_socket);
+        return;
+    }
+    memcpy(client->backlog + client->backlog_len, msgdata, length);
+    client->backlog_len += length;
+    client->backlog[client->backlog_len++] = '\n';
+    client->backlog[client->backlog_len] = '\0';
 }
 
-void send_to_session(const char *session_id, int sender_sock, const char *msgdata) {
-    struct client_info *current = client_list;
+void send_to_session(struct worker *w, const char *session_id, struct client_info *sender, const char *msgdata) {
+    // this worker's clients only, see relay_to for the rest
+    struct client_info *current = w->client_list;
 
     while (current != NULL) {
-        if (strcmp(current->session_id, session_id) == 0 && current->client_socket != sender_sock) { 
-            strcat(current->backlog, msgdata);
-            strcat(current->backlog, "\n");
+        if (strcmp(current->session_id, session_id) == 0 && current != sender) { 
+            add_to_backlog(current, msgdata);
         }
         current = current->next;
     }
 }
 
-void send_to_user(const char *dest_user, const char *msgdata) {
-    struct client_info *current = client_list;
+int send_to_user(struct worker *w, const char *dest_user, const char *msgdata) {
+    // returns 1 if dest_user is one of this worker's clients
+    struct client_info *current = w->client_list;
 
     while (current != NULL) {
         if (strcmp(current->client_id, dest_user) == 0) { 
-            strcat(current->backlog, msgdata);
-            strcat(current->backlog, "\n");
-            return;
+            add_to_backlog(current, msgdata);
+            return 1;
         }
         current = current->next;
     }
-
-    printf("Private message error: Client with name %s not found.\n", dest_user);
+    return 0;
 }
 
-const char *get_client_session(int client_socket) {
-    struct client_info *current = client_list;
-
-    while (current != NULL) {
-        if (current->client_socket == client_socket) {
-            return current->session_id;
+void handle_relays(struct worker *w) {
+    uint64_t count;
+    if (read(w->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read eventfd");
+        exit(1);
+    }
+    atomic_store(&w->queue.pending, 0); // before draining, so anything pushed after this wakes us again
+
+    struct relay *r;
+    while ((r = relay_pop(&w->queue)) != NULL) {
+        if (r->type == RELAY_SESSION) {
+            send_to_session(w, r->target, NULL, r->data);
+        } else {
+            send_to_user(w, r->target, r->data);
         }
-        current = current->next;
+        free(r);
     }
+}
 
-    fprintf(stderr, "Error: Client with socket %d not found, in get_client_session.\n", client_socket);
-    exit(1);  
+void handle_message(struct client_info *client, struct message *msg) {
+    struct worker *w = client->worker;
+
+    switch (msg->type) {
+        case LOGIN:
+            handle_login(client, msg);
+            break;
+        case SIGN_UP:
+            print_message(msg);
+            handle_signup(client, msg);
+            break;
+        case EXIT:
+            client->closing = 1;
+            break;                
+        case JOIN:
+            printf("Client %s requested to JOIN session: %s\n", msg->source, msg->data);
+
+            if (!set_client_session(client, (char *) msg->data, 1)) {
+                char reason[MAX_DATA + 32]; // queue_reply cuts it down to MAX_DATA
+                snprintf(reason, sizeof(reason), "%s, %s", (char *) msg->data, "Session does not exist.");
+                queue_reply(client, JN_NAK, (char *) msg->source, reason);
+            } else {
+                print_client_list(w);
+                queue_reply(client, JN_ACK, (char *) msg->source, (char *) msg->data);
+            }
+            break;
+
+        case LEAVE_SESS:
+            printf("Client %s requested to leave session.\n", (char *) msg->source);
+            set_client_session(client, "", 0);
+            print_client_list(w);
+            break;
+        case NEW_SESS:
+            printf("Client requested to (create +) join session: %s\n", (char *) msg->data);
+            set_client_session(client, (char *) msg->data, 0);
+            print_client_list(w);
+            queue_reply(client, NS_ACK, (char *) msg->source, "");
+            break;
+
+        case MESSAGE:
+            printf("Client %s trying to send message: %s\n", (char *) msg->source, (char *) msg->data);
+            if (client->session == NULL) { // nobody to send it to
+                break;
+            }
+            send_to_session(w, client->session_id, client, (char *) msg->data);
+            for (int i = 0; i < num_workers; i++) { // no point waking one with nobody in the session
+                if (&workers[i] != w && atomic_load(&client->session->members[i]) > 0) {
+                    relay_to(&workers[i], RELAY_SESSION, client->session_id, (char *) msg->data);
+                }
+            }
+            break;
+        case QUERY:
+            printf("Client %s requested QUERY.\n", msg->source);
+
+            char user_list[MAX_DATA] = "Users and their Sessions\n-------------------\n";
+
+            int full = 0;
+            for (int i = 0; i < num_workers && !full; i++) {
+                pthread_mutex_lock(&workers[i].lock);
+                struct client_info *current = workers[i].client_list;
+                while (current != NULL) {
+                    char entry[MAX_NAME + MAX_NAME + 40];
+
+                    if (strlen(current->client_id) > 0) {
+                        if (strlen(current->session_id) > 0) {
+                            snprintf(entry, sizeof(entry), "%s (In session %s)\n", current->client_id, current->session_id);
+                        } else {
+                            snprintf(entry, sizeof(entry), "%s (No session)\n", current->client_id);
+                        }
+                        if (strlen(user_list) + strlen(entry) >= sizeof(user_list)) { // only so much fits in one message
+                            full = 1;
+                            break;
+                        }
+                        strcat(user_list, entry);
+                    }
+                    current = current->next;
+                }
+                pthread_mutex_unlock(&workers[i].lock);
+            }
+            queue_reply(client, QU_ACK, (char *) msg->source, user_list);
+            break;
+        
+        case GET_MSG:
+            printf("Client %s backlog query\n", (char *) msg->source);
+            queue_reply(client, MESSAGE, (char *) msg->source, client->backlog);
+            client->backlog[0] = '\0';
+            client->backlog_len = 0;
+            break;
+
+        case PRIV_MSG:
+            printf("Private message to %s\n", (char *) msg->source); // remember here source is the destination
+            if (!send_to_user(w, (char *) msg->source, (char *) msg->data)) {
+                pthread_mutex_lock(&login_lock);
+                struct worker *owner = find_client_worker((char *) msg->source);
+                if (owner != NULL) { // only the worker that has them
+                    relay_to(owner, RELAY_USER, (char *) msg->source, (char *) msg->data);
+                }
+                pthread_mutex_unlock(&login_lock);
+                if (owner == NULL) {
+                    // the client has nothing waiting on a reply to this, so the NAK goes in the
+                    // sender's backlog and shows up with its next GET_MSG
+                    printf("Private message error: Client with name %s not found.\n", (char *) msg->source);
+                    char reason[MAX_NAME + 64];
+                    snprintf(reason, sizeof(reason), "[PRIVATE MESSAGE NOT SENT] %s is not logged in.", (char *) msg->source);
+                    add_to_backlog(client, reason);
+                }
+            }
+            break;
+
+        default:
+            printf("Unknown message type received: %d\n", msg->type);
+            break;
+    }
 }
 
-const char *get_client_backlog(int client_socket) {
-    struct client_info *current = client_list;
+int read_messages(struct client_info *client) {
+    // edge-triggered, so read until the socket's empty or we'll never hear about what's left.
+    // every whole message in inbuf gets handled, a partial one waits for the rest.
+    // returns 0 if the client hung up or can't be talked to anymore
+    while (!client->closing) {
+        ssize_t bytes = recv(client->client_socket, client->inbuf + client->inlen, MAX_BUF_SIZE - client->inlen, 0);
+        if (bytes == 0) { // connection closes
+            printf("Client with fd %d hung up.\n", client->client_socket);
+            return 0;
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            perror("recv");
+            return 0;
+        }
+        client->inlen += bytes;
+
+        while (client->inlen >= HEADER_SIZE && !client->closing) {
+            client->inbuf[client->inlen] = '\0';
 
-    while (current != NULL) {
-        if (current->client_socket == client_socket) {
-            return current->backlog;
+            // the header is "type:size:", then size bytes of source and data, a colon and a null char
+            unsigned int type, size;
+            if (sscanf(client->inbuf, "%4u:%4u:", &type, &size) != 2 || HEADER_SIZE + size + 2 > MAX_BUF_SIZE) {
+                fprintf(stderr, "Bad message header from fd %d, dropping it.\n", client->client_socket);
+                return 0;
+            }
+            size_t length = HEADER_SIZE + size + 2;
+            if (client->inlen < length) { // rest of it hasn't come yet
+                break;
+            }
+
+            struct message msg;
+            memset(&msg, 0, sizeof(msg));
+            client->inbuf[length - 1] = '\0';
+            deserialize_message(client->inbuf, &msg);
+            memmove(client->inbuf, client->inbuf + length, client->inlen - length);
+            client->inlen -= length;
+
+            handle_message(client, &msg);
         }
-        current = current->next;
     }
-
-    fprintf(stderr, "Error: Client with socket %d not found, in get_client_session.\n", client_socket);
-    exit(1);  
+    return 1;
 }
 
-void delete_client_backlog(int client_socket) {
-    struct client_info *current = client_list;
+void accept_clients(struct worker *w) {
+    // edge-triggered, so take every connection that's waiting
+    while (1) {
+        struct sockaddr_storage remoteaddr; // the client's address
+        socklen_t addrlen = sizeof remoteaddr;
+        int newfd = accept4(w->listener_fd, (struct sockaddr *) &remoteaddr, &addrlen, SOCK_NONBLOCK);
 
-    while (current != NULL) {
-        if (current->client_socket == client_socket) {
-            current->backlog[0] = '\0';
-            return;
+        if (newfd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) { // out of fds, the rest wait in the queue
+                perror("accept");
+                return;
+            }
+            perror("accept");
+            exit(1);
         }
-        current = current->next;
-    }
 
-    fprintf(stderr, "Error: Client with socket %d not found, in delete_client_backlog.\n", client_socket);
-    exit(1);  
-}
+        struct client_info *client = add_client(w, newfd, "", (struct sockaddr_in *) &remoteaddr, "");
 
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = client;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, newfd, &ev) == -1) {
+            perror("epoll_ctl");
+            exit(1);
+        }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(1);
+        printf("New client connected.\n");
+        print_client_list(w);
     }
+}
+
+void *run_worker(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
 
-    fd_set master; 
-    fd_set read_fds;
-    FD_ZERO(&master);    
-    FD_ZERO(&read_fds);
-    int fdmax;
+    while (1) {
+        int ready = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1); // block until some are ready
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
 
+        for (int i = 0; i < ready; i++) {
+            struct client_info *client = events[i].data.ptr;
+            if (client == NULL) { // new client(s)
+                accept_clients(w);
+                continue;
+            }
+            if (events[i].data.ptr == (void *) w) { // messages from other workers
+                handle_relays(w);
+                continue;
+            }
+
+            // client socket activity
+            int alive = 1;
+            if (events[i].events & EPOLLOUT) {
+                flush_output(client);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                alive = read_messages(client);
+            }
+            if (!alive || (client->closing && client->outstart == client->outlen)) {
+                remove_conn(client);
+            }
+        }
+    }
+    return NULL;
+}
+
+int open_listener(int port) {
     // bind the TCP port
     int listener_fd;
     struct addrinfo hints, *ai_head, *ai_curr;
 
-    int port = atoi(argv[1]);
     char port_str[6];
     snprintf(port_str, sizeof(port_str), "%d", port);
 
@@ -448,7 +947,7 @@ int main(int argc, char *argv[]) {
     }
 
     for (ai_curr = ai_head; ai_curr != NULL; ai_curr = ai_curr->ai_next) {
-        listener_fd = socket(ai_curr->ai_family, ai_curr->ai_socktype, ai_curr->ai_protocol);
+        listener_fd = socket(ai_curr->ai_family, ai_curr->ai_socktype | SOCK_NONBLOCK, ai_curr->ai_protocol);
         if (listener_fd < 0) { // if socket call fails, try the next one
             continue;
         }
@@ -456,6 +955,11 @@ int main(int argc, char *argv[]) {
         // deal with address already in use error
         int yes = 1;
         setsockopt(listener_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        // every worker binds the port, and the kernel spreads connections over them
+        if (setsockopt(listener_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("setsockopt SO_REUSEPORT");
+            exit(1);
+        }
 
         if (bind(listener_fd, ai_curr->ai_addr, ai_curr->ai_addrlen) < 0) { // if bind fails, try next one
             close(listener_fd);
@@ -470,149 +974,91 @@ int main(int argc, char *argv[]) {
 
     freeaddrinfo(ai_head);
 
-    if (listen(listener_fd, 10) == -1) {
+    if (listen(listener_fd, SOMAXCONN) == -1) { // lots of clients can show up at once
         perror("listen");
         exit(1);
     }
+    return listener_fd;
+}
 
-    FD_SET(listener_fd, &master); // add it to the set
-    fdmax = listener_fd;
+void start_worker(struct worker *w, int id, int port) {
+    w->id = id;
+    w->client_list = w->client_tail = NULL;
+    w->client_count = 0;
+    pthread_mutex_init(&w->lock, NULL);
+    relay_queue_init(&w->queue);
+    w->listener_fd = open_listener(port);
+
+    // epoll instead of select, so a wakeup costs as much as the fds that are ready, not as
+    // much as the highest fd, and there's no FD_SETSIZE cap on how many clients we take.
+    // the listener is the one entry without a client_info, the eventfd's is the worker itself
+    w->epoll_fd = epoll_create1(0);
+    w->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (w->epoll_fd == -1 || w->wake_fd == -1) {
+        perror("epoll_create1/eventfd");
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listener_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev.data.ptr = w;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
 
-    printf(">>> Server now listening on port %d\n", port);
+void raise_fd_limit() {
+    // each client is an fd, and the default soft limit is usually 1024
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            perror("setrlimit");
+        }
+    }
+}
 
-    initialize_user_list(); // initialize the user credentials
-    print_users();
 
-    struct sockaddr_storage remoteaddr; // the client's address
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <port> [threads]\n", argv[0]);
+        exit(1);
+    }
 
-    while (1) {
-        read_fds = master;
-        if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1) { // block until one is ready to read
-            perror("select");
+    int port = atoi(argv[1]);
+    if (argc == 3) {
+        num_workers = atoi(argv[2]);
+        if (num_workers < 1 || num_workers > MAX_WORKERS) {
+            fprintf(stderr, "threads must be 1 to %d\n", MAX_WORKERS);
             exit(1);
         }
+    }
 
-        for (int i = 0; i <= fdmax; i++) {
-            if (!FD_ISSET(i, &read_fds)) {
-                continue;
-            }
-
-            if (i == listener_fd) { // new client
-                socklen_t addrlen = sizeof remoteaddr;
-                int newfd = accept(listener_fd, (struct sockaddr *) &remoteaddr, &addrlen);
-
-                if (newfd == -1) {
-                    perror("accept");
-                    exit(1);
-                } 
-
-                FD_SET(newfd, &master);
-                if (newfd > fdmax) {  
-                    fdmax = newfd;
-                }
-
-                add_client(newfd, "", (struct sockaddr_in *) &remoteaddr, "");
-                printf("New client connected.\n");
-                print_client_list();
-            } else { // client socket activity
-                struct message msg;
-                memset(&msg, 0, sizeof(msg));
-                int nbytes = receive_message(i, &msg);
-
-                // print_message(&msg);
-
-                if (nbytes <= 0) { // either hung up or errored
-                    if (nbytes == 0) { // connection closes
-                        printf("Client with fd %d hung up.\n", i);
-                    } else {
-                        fprintf(stderr, "Failed to receive client data.\n");
-                        exit(1);
-                    }
-                    remove_conn(i, &master);
-                } else { // got data from client
+    raise_fd_limit();
 
-                    switch (msg.type) {
-                        case LOGIN:
-                            handle_login(i, &msg, &master);
-                            break;
-                        case SIGN_UP:
-                            print_message(&msg);
-                            handle_signup(i, &msg, &master);
-                            break;
-                        case EXIT:
-                            remove_conn(i, &master);
-                            break;                
-                        case JOIN:
-                            printf("Client %s requested to JOIN session: %s\n", msg.source, msg.data);
-
-                            if (!session_exists((char *) msg.data)) {
-                                send_joinnak(i, (char *) msg.source, (char *) msg.data, "Session does not exist.");
-                            } else {
-                                set_client_session(i, (char *) msg.data);
-                                print_client_list();
-                                send_joinack(i, (char *) msg.source, (char*) msg.data);  
-                            }
-                            break;
-                
-                        case LEAVE_SESS:
-                            printf("Client %s requested to leave session.\n", (char *) msg.source);
-                            set_client_session(i, "");
-                            print_client_list();
-                            break;
-                        case NEW_SESS:
-                            printf("Client requested to (create +) join session: %s\n", (char *) msg.data);
-                            set_client_session(i, (char *) msg.data);
-                            print_client_list();
-                            send_newsessack(i, (char *) msg.source);
-                            break;
-                
-                        case MESSAGE:
-                            printf("Client %s trying to send message: %s\n", (char *) msg.source, (char *) msg.data);
-                            send_to_session(get_client_session(i), i, (char *) msg.data);
-                            break;
-                        case QUERY:
-                            printf("Client %s requested QUERY.\n", msg.source);
-
-                            char user_list[MAX_DATA] = "Users and their Sessions\n-------------------\n";
-
-                            struct client_info *current = client_list;
-                            while (current != NULL) {
-                                char entry[MAX_NAME + MAX_NAME + 40];
-
-                                if (strlen(current->client_id) > 0) {
-                                    if (strlen(current->session_id) > 0) {
-                                        snprintf(entry, sizeof(entry), "%s (In session %s)\n", current->client_id, current->session_id);
-                                    } else {
-                                        snprintf(entry, sizeof(entry), "%s (No session)\n", current->client_id);
-                                    }
-                                    strcat(user_list, entry);
-                                }
-                                current = current->next;
-                            }
-                            send_quack(i, (char *) msg.source, user_list);
-                            break;
-                        
-                        case GET_MSG:
-                            printf("Client %s backlog query\n", (char *) msg.source);
-                            send_usermsg(i, (char *) msg.source, get_client_backlog(i));
-                            delete_client_backlog(i);
-                            break;
+    initialize_user_list(); // initialize the user credentials
+    print_users();
 
-                        case PRIV_MSG:
-                            printf("Private message to %s\n", (char *) msg.source); // remember here source is the destination
-                            send_to_user((char *) msg.source, (char *) msg.data);
-                            break;
+    // every listener's bound before any worker starts taking connections
+    for (int i = 0; i < num_workers; i++) {
+        start_worker(&workers[i], i, port);
+    }
 
-                        default:
-                            printf("Unknown message type received: %d\n", msg.type);
-                            break;
-                    }                
-                }
+    printf(">>> Server now listening on port %d with %d thread(s)\n", port, num_workers);
 
-            }
+    for (int i = 1; i < num_workers; i++) {
+        int rv = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+        if (rv != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rv));
+            exit(1);
         }
-
     }
+    run_worker(&workers[0]); // this thread's the first worker
 
     return 0;
 }